@@ -0,0 +1,120 @@
+// Admission control for Station and Party: a cap on how many callers may
+// be waiting at once, and what happens to an arrival that finds the cap
+// reached. Without a cap (the default) nothing is counted and arrivals
+// cost nothing extra.
+//
+// The blocking calls (wait_for_train, meet) cannot report failure, so an
+// arrival through them that finds the cap reached always waits at the
+// gate until there is room. The try variants (try_wait_for_train,
+// try_meet) follow the configured Overload policy.
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+// What a try variant does when its gate is full.
+enum class Overload {
+    // Fail at once. Rejection is a load and a compare on the gate's
+    // counter; it takes no lock.
+    REJECT,
+
+    // Take the place of the longest-waiting caller that came through a
+    // try variant, whose call then fails. If there is no such caller, the
+    // arrival is rejected instead.
+    SHED_OLDEST,
+
+    // Wait at the gate, outside the object's lock, until someone leaves.
+    BLOCK,
+};
+
+struct Admission {
+    // The most callers that may be waiting at once; 0 means no limit.
+    std::size_t cap = 0;
+    Overload overload = Overload::REJECT;
+};
+
+/**
+ * Class: BasicAdmissionGate
+ * -------------------------
+ * Counts the callers admitted and not yet gone, up to a cap, in one or
+ * more separate counts with the same cap, named by index (Party keeps one
+ * per sign pair). Entering and leaving are one atomic operation each.
+ * Only blocking needs a lock, and it is rare, so callers blocked at any
+ * full count share one lock and condition variable of the given
+ * policies, which leave() touches only when someone is blocked.
+ */
+template <typename LockPolicy, typename WaitPolicy>
+class BasicAdmissionGate {
+public:
+    explicit BasicAdmissionGate(std::size_t numCounts = 1)
+        : counts_(new std::atomic<std::size_t>[numCounts]())
+    {}
+
+    void set_cap(std::size_t cap) { cap_ = cap; }
+    std::size_t cap() const { return cap_; }
+
+    // Callers admitted to count i and not yet gone; always 0 without a
+    // cap.
+    std::size_t count(std::size_t i = 0) const { return counts_[i].load(); }
+
+    // Admits the caller to count i if it is not full.
+    bool try_enter(std::size_t i = 0)
+    {
+        if (cap_ == 0) {
+            return true;
+        }
+        std::atomic<std::size_t>& count = counts_[i];
+        std::size_t c = count.load(std::memory_order_relaxed);
+        do {
+            if (c >= cap_) {
+                return false;
+            }
+        } while (!count.compare_exchange_weak(c, c + 1));
+        return true;
+    }
+
+    // Admits the caller to count i, waiting for room if it is full.
+    void enter(std::size_t i = 0)
+    {
+        if (try_enter(i)) {
+            return;
+        }
+        std::unique_lock<LockPolicy> lock(mutex_);
+        blocked_++;
+        while (!try_enter(i)) {
+            open_.wait(lock);
+        }
+        blocked_--;
+    }
+
+    // Called once for each admission to count i when the caller is no
+    // longer waiting.
+    void leave(std::size_t i = 0)
+    {
+        if (cap_ == 0) {
+            return;
+        }
+        counts_[i].fetch_sub(1);
+        if (blocked_.load() > 0) {
+            // The blocked callers may be waiting on other counts, so
+            // waking just one could miss the one this makes room for.
+            std::lock_guard<LockPolicy> lock(mutex_);
+            open_.notify_all();
+        }
+    }
+
+private:
+    std::size_t cap_ = 0;
+    std::unique_ptr<std::atomic<std::size_t>[]> counts_;
+
+    // Callers in enter() that found their count full.
+    std::atomic<int> blocked_ = 0;
+    LockPolicy mutex_;
+    WaitPolicy open_;
+};
+
+#endif /* ADMISSION_H */
@@ -0,0 +1,125 @@
+// This file contains ArrivalRecorder and load_arrival_trace.
+
+#include "arrival-trace.hh"
+
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+// Records buffered before the caller that fills the buffer writes it out.
+static const size_t BUFFER_RECORDS = 4096;
+
+ArrivalRecorder::ArrivalRecorder(const string& path,
+        function<uint64_t()> clock)
+    : clock_(move(clock))
+    , start_(clock_())
+    , file_(fopen(path.c_str(), "wb"))
+{
+    if (file_ == nullptr) {
+        perror(path.c_str());
+        return;
+    }
+    ArrivalTraceHeader header = {};
+    memcpy(header.magic, "ARTRACE1", 8);
+    header.version = 1;
+    header.recordSize = sizeof(ArrivalRecord);
+    if (fwrite(&header, sizeof(header), 1, file_) != 1) {
+        perror(path.c_str());
+    }
+    buffer_.reserve(BUFFER_RECORDS);
+}
+
+ArrivalRecorder::~ArrivalRecorder()
+{
+    if (file_ != nullptr) {
+        flush();
+        fclose(file_);
+    }
+}
+
+void ArrivalRecorder::record(ArrivalKind kind, int line, uint32_t arg,
+        uint8_t flags)
+{
+    if (file_ == nullptr) {
+        return;
+    }
+    ArrivalRecord r;
+    r.time = clock_() - start_;
+    r.arg = arg;
+    r.line = line;
+    r.kind = kind;
+    r.flags = flags;
+    recorded_++;
+
+    vector<ArrivalRecord> full;
+    {
+        lock_guard<SpinLock> lock(bufferLock_);
+        buffer_.push_back(r);
+        if (buffer_.size() < BUFFER_RECORDS) {
+            return;
+        }
+        full.reserve(BUFFER_RECORDS);
+        full.swap(buffer_);
+    }
+    write(full);
+}
+
+void ArrivalRecorder::flush()
+{
+    if (file_ == nullptr) {
+        return;
+    }
+    vector<ArrivalRecord> pending;
+    {
+        lock_guard<SpinLock> lock(bufferLock_);
+        pending.swap(buffer_);
+        buffer_.reserve(BUFFER_RECORDS);
+    }
+    write(pending);
+    lock_guard<mutex> lock(fileMutex_);
+    fflush(file_);
+}
+
+void ArrivalRecorder::write(const vector<ArrivalRecord>& records)
+{
+    lock_guard<mutex> lock(fileMutex_);
+    if (fwrite(records.data(), sizeof(ArrivalRecord), records.size(),
+            file_) != records.size()) {
+        perror("arrival trace");
+    }
+}
+
+bool load_arrival_trace(const string& path, vector<ArrivalRecord> *records)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        perror(path.c_str());
+        return false;
+    }
+    ArrivalTraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || memcmp(header.magic, "ARTRACE1", 8) != 0
+            || header.version != 1
+            || header.recordSize != sizeof(ArrivalRecord)) {
+        cerr << path << ": not a version 1 arrival trace" << endl;
+        fclose(file);
+        return false;
+    }
+
+    records->clear();
+    ArrivalRecord r;
+    while (fread(&r, sizeof(r), 1, file) == 1) {
+        records->push_back(r);
+    }
+    if (ftell(file) != long(sizeof(header)
+            + records->size() * sizeof(ArrivalRecord))) {
+        cerr << path << ": ignoring a partial record at the end" << endl;
+    }
+    fclose(file);
+    stable_sort(records->begin(), records->end(),
+            [](const ArrivalRecord& a, const ArrivalRecord& b) {
+                return a.time < b.time;
+            });
+    return true;
+}
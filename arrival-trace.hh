@@ -0,0 +1,514 @@
+// Arrival traces: a compact binary record of when passengers, trains and
+// guests arrived at a Station or Party, and with what arguments, so that
+// production traffic can be reproduced. ArrivalRecorder writes a trace;
+// RecordingStation and RecordingParty wrap a live station or party and
+// record each arrival before passing the call on. replay_arrivals issues
+// a trace's calls again, against another station or party, from a thread
+// pool: at the recorded pace, at a multiple of it, or as fast as
+// possible. The arrival_replay tool does this from the command line.
+//
+// The event trace (event-trace.hh) records what the synchronization did;
+// an arrival trace records only what the callers asked for and when.
+// Boarding time and guest names are not recorded.
+
+#ifndef ARRIVAL_TRACE_H
+#define ARRIVAL_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "party.hh"
+#include "thread-utils.h"
+
+// Kinds of arrivals. The values are part of the file format.
+enum ArrivalKind : uint8_t {
+    // wait_for_train called for line.
+    ARRIVAL_PASSENGER = 1,
+
+    // load_train called for line (arg: available seats).
+    ARRIVAL_TRAIN = 2,
+
+    // meet called (arg: my_sign << 8 | other_sign).
+    ARRIVAL_GUEST = 3,
+};
+
+// Bits of ArrivalRecord::flags.
+enum : uint8_t {
+    // The call was try_wait_for_train or try_meet.
+    ARRIVAL_TRY = 1,
+};
+
+// Layout of a trace file: one ArrivalTraceHeader, then records up to the
+// end of the file. There is no record count, so the records written
+// before a crash can still be read.
+struct ArrivalTraceHeader {
+    // "ARTRACE1"
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    char reserved[16];
+};
+
+struct ArrivalRecord {
+    // Nanoseconds since recording started.
+    uint64_t time;
+
+    // Kind-specific argument (see ArrivalKind).
+    uint32_t arg;
+
+    uint16_t line;
+    uint8_t kind;
+    uint8_t flags;
+};
+
+static_assert(sizeof(ArrivalTraceHeader) == 32, "arrival header layout");
+static_assert(sizeof(ArrivalRecord) == 16, "arrival record layout");
+
+/**
+ * Class: ArrivalRecorder
+ * ----------------------
+ * Writes an arrival trace. record() may be called from any thread: it
+ * appends to a buffer under a spin lock, and whichever caller fills the
+ * buffer writes it out, after releasing the lock. Records from different
+ * threads can therefore reach the file slightly out of time order;
+ * load_arrival_trace sorts them.
+ */
+class ArrivalRecorder {
+public:
+    // Creates (or truncates) the trace file at path. Times come from
+    // clock, in nanoseconds, relative to its value now: by default the
+    // monotonic clock, but a simulation can pass its virtual clock. If
+    // the file cannot be created, an error is printed and nothing is
+    // recorded.
+    explicit ArrivalRecorder(const std::string& path,
+            std::function<std::uint64_t()> clock = monotonic_ns);
+
+    // Writes any buffered records and closes the file.
+    ~ArrivalRecorder();
+
+    ArrivalRecorder(const ArrivalRecorder&) = delete;
+    ArrivalRecorder& operator=(const ArrivalRecorder&) = delete;
+
+    bool ok() const { return file_ != nullptr; }
+
+    void record(ArrivalKind kind, int line, std::uint32_t arg,
+            std::uint8_t flags = 0);
+
+    // Writes buffered records to the file.
+    void flush();
+
+    // Records made so far.
+    std::uint64_t recorded() const { return recorded_.load(); }
+
+private:
+    void write(const std::vector<ArrivalRecord>& records);
+
+    const std::function<std::uint64_t()> clock_;
+    const std::uint64_t start_;
+    std::atomic<std::uint64_t> recorded_ = 0;
+
+    SpinLock bufferLock_;
+    std::vector<ArrivalRecord> buffer_;
+
+    // Serializes writes to file_.
+    std::mutex fileMutex_;
+    std::FILE *file_;
+};
+
+// Reads the trace at path into *records, sorted by time. Prints an error
+// and returns false if the file is missing or not an arrival trace.
+bool load_arrival_trace(const std::string& path,
+        std::vector<ArrivalRecord> *records);
+
+/**
+ * Class: RecordingStation
+ * -----------------------
+ * Wraps a station, recording each passenger and train arrival before
+ * passing the call on. Has the same interface as BasicStation, so it can
+ * stand in for one in client code, including a Dispatcher.
+ */
+template <typename StationType>
+class RecordingStation {
+public:
+    RecordingStation(StationType& station, ArrivalRecorder& recorder)
+        : station_(station)
+        , recorder_(recorder)
+    {}
+
+    // The number of doors is not recorded; replays use one.
+    void load_train(int line, int available, int doors = 1)
+    {
+        recorder_.record(ARRIVAL_TRAIN, line, available);
+        station_.load_train(line, available, doors);
+    }
+    void load_train(int available) { load_train(0, available); }
+
+    int wait_for_train(int line)
+    {
+        recorder_.record(ARRIVAL_PASSENGER, line, 0);
+        return station_.wait_for_train(line);
+    }
+    int wait_for_train() { return wait_for_train(0); }
+
+    bool try_wait_for_train(int line = 0, int *door = nullptr)
+    {
+        recorder_.record(ARRIVAL_PASSENGER, line, 0, ARRIVAL_TRY);
+        return station_.try_wait_for_train(line, door);
+    }
+
+    void boarded(int line = 0, int door = 0)
+    {
+        station_.boarded(line, door);
+    }
+
+    int num_lines() const { return station_.num_lines(); }
+
+    std::size_t num_waiting(int line = 0) const
+    {
+        return station_.num_waiting(line);
+    }
+
+private:
+    StationType& station_;
+    ArrivalRecorder& recorder_;
+};
+
+/**
+ * Class: RecordingParty
+ * ---------------------
+ * Wraps a party, recording each guest's arrival before passing the call
+ * on. Has the same interface as BasicParty.
+ */
+template <typename PartyType>
+class RecordingParty {
+public:
+    RecordingParty(PartyType& party, ArrivalRecorder& recorder)
+        : party_(party)
+        , recorder_(recorder)
+    {}
+
+    std::string meet(std::string &my_name, int my_sign, int other_sign)
+    {
+        recorder_.record(ARRIVAL_GUEST, 0, my_sign << 8 | other_sign);
+        return party_.meet(my_name, my_sign, other_sign);
+    }
+
+    std::optional<std::string> try_meet(std::string &my_name, int my_sign,
+            int other_sign)
+    {
+        recorder_.record(ARRIVAL_GUEST, 0, my_sign << 8 | other_sign,
+                ARRIVAL_TRY);
+        return party_.try_meet(my_name, my_sign, other_sign);
+    }
+
+private:
+    PartyType& party_;
+    ArrivalRecorder& recorder_;
+};
+
+struct ReplayOptions {
+    // Issues calls at speed times the recorded pace (10 replays ten
+    // times faster); 0 issues each call as soon as the last was posted,
+    // except that a train first waits for the passengers posted before
+    // it on its line to reach the station.
+    double speed = 1;
+
+    // Pool workers kept running (0 means one per hardware thread), and
+    // the most threads started to cover calls blocked in the station or
+    // party. Each waiting passenger or guest holds a thread, so
+    // maxThreads must cover the most callers the trace has waiting at
+    // once.
+    std::size_t threads = 0;
+    std::size_t maxThreads = 4096;
+
+    // Seconds each passenger takes to board, at the recorded pace.
+    double boardSeconds = 0;
+};
+
+struct ReplayResult {
+    // Calls issued from the trace, and try calls among them that
+    // returned without a seat or a match.
+    std::size_t passengers = 0;
+    std::size_t trains = 0;
+    std::size_t guests = 0;
+    std::size_t refused = 0;
+
+    // Trains and guests added at the end to release the passengers and
+    // guests the trace left waiting.
+    std::size_t drainTrains = 0;
+    std::size_t drainGuests = 0;
+
+    // For each record, how many nanoseconds after its scaled time (or,
+    // replaying as fast as possible, after it was posted) its call was
+    // made.
+    std::vector<std::uint64_t> lateness;
+
+    // From the first call until every call had returned.
+    double seconds = 0;
+};
+
+// Replays records (sorted by time, as load_arrival_trace returns them)
+// against station and party, either of which may be null if the trace
+// has no arrivals for it. The station must have every line the trace
+// uses. Returns once every call has returned.
+//
+// A station serves one train per line at a time, so trains for a line
+// run one after another, as they did when recorded: a train due while
+// the previous one for its line is still in load_train is issued when
+// that one returns.
+//
+// A trace often ends with callers still waiting (one cut off in the
+// middle of an incident always does), whose calls would never return.
+// So once every call has been issued and none has returned for a while,
+// the replayer sends each line a train with a seat for everyone still
+// waiting there, and each unmatched guest a guest with the complementary
+// signs, and repeats until all calls have returned.
+template <typename StationType, typename PartyType>
+ReplayResult replay_arrivals(const std::vector<ArrivalRecord>& records,
+        StationType *station, PartyType *party,
+        const ReplayOptions& options = ReplayOptions())
+{
+    ReplayResult result;
+    result.lateness.resize(records.size());
+    if (records.empty()) {
+        return result;
+    }
+    double scale = options.speed > 0 ? 1 / options.speed : 0;
+    std::uint64_t boardNs = options.boardSeconds * 1e9 * scale;
+    int numLines = station != nullptr ? station->num_lines() : 0;
+
+    // Callers now inside the station, per line, and inside the party,
+    // per sign pair; calls posted, started and returned.
+    std::vector<std::atomic<long>> waitingPassengers(numLines);
+    std::vector<std::atomic<long>> waitingGuests(NUM_SIGNS * NUM_SIGNS);
+    std::atomic<long> posted = 0;
+    std::atomic<long> started = 0;
+    std::atomic<long> returned = 0;
+    std::atomic<std::size_t> refused = 0;
+
+    // Per line: passenger calls posted, and those past wait_for_train
+    // (seated or refused).
+    std::vector<long> passengersPosted(numLines);
+    std::vector<std::atomic<long>> passengersPast(numLines);
+
+    // Per line: whether a train is in load_train, and the trains due
+    // since then, waiting for it to leave.
+    struct LineTrains {
+        std::mutex mutex;
+        bool docked = false;
+        std::deque<std::function<void()>> queued;
+    };
+    std::vector<LineTrains> lineTrains(numLines);
+
+    ThreadPool pool(options.threads,
+            std::max(options.threads, options.maxThreads));
+    auto passenger = [&](int line, bool tryVariant) {
+        waitingPassengers[line]++;
+        int door = 0;
+        bool seated = pool.blocking([&] {
+            if (tryVariant) {
+                return station->try_wait_for_train(line, &door);
+            }
+            door = station->wait_for_train(line);
+            return true;
+        });
+        waitingPassengers[line]--;
+        passengersPast[line]++;
+        if (!seated) {
+            refused++;
+            return;
+        }
+        if (boardNs > 0) {
+            pool.blocking([&] { sleep_for_ns(boardNs); });
+        }
+        station->boarded(line, door);
+    };
+    auto guest = [&](std::string name, int mySign, int otherSign,
+            bool tryVariant) {
+        std::atomic<long>& waiting =
+                waitingGuests[mySign * NUM_SIGNS + otherSign];
+        waiting++;
+        bool matched = pool.blocking([&] {
+            if (tryVariant) {
+                return party->try_meet(name, mySign, otherSign).has_value();
+            }
+            party->meet(name, mySign, otherSign);
+            return true;
+        });
+        waiting--;
+        refused += !matched;
+    };
+    auto post = [&](std::function<void()> call) {
+        posted++;
+        pool.post([&, call] {
+            started++;
+            call();
+            returned++;
+        });
+    };
+
+    // Posts call, which runs load_train for line, once no other train is
+    // in load_train there.
+    std::function<void(int, std::function<void()>)> train =
+            [&](int line, std::function<void()> call) {
+        LineTrains& t = lineTrains[line];
+        {
+            std::lock_guard<std::mutex> lock(t.mutex);
+            if (t.docked) {
+                t.queued.push_back(std::move(call));
+                return;
+            }
+            t.docked = true;
+        }
+        post([&, line, call] {
+            call();
+            std::function<void()> next;
+            {
+                LineTrains& t = lineTrains[line];
+                std::lock_guard<std::mutex> lock(t.mutex);
+                t.docked = false;
+                if (t.queued.empty()) {
+                    return;
+                }
+                next = std::move(t.queued.front());
+                t.queued.pop_front();
+            }
+            train(line, std::move(next));
+        });
+    };
+
+    // Waits until every passenger posted for line is in the station or
+    // past it, or none has arrived for 20 ms. Once a passenger has
+    // arrived, load_train waits for it, so a train issued after this
+    // finds everyone recorded before it. The limit covers passengers held
+    // at the admission gate, which only a train can let in.
+    auto await_passengers = [&](int line) {
+        long arrived = -1;
+        std::uint64_t deadline = 0;
+        while (true) {
+            long count = passengersPast[line]
+                    + long(station->num_waiting(line));
+            if (count >= passengersPosted[line]) {
+                break;
+            } else if (count != arrived) {
+                arrived = count;
+                deadline = monotonic_ns() + 20000000;
+            } else if (monotonic_ns() >= deadline) {
+                break;
+            }
+            std::this_thread::yield();
+        }
+    };
+
+    std::uint64_t start = monotonic_ns();
+    std::uint64_t origin = records.front().time;
+    for (std::size_t i = 0; i < records.size(); i++) {
+        ArrivalRecord r = records[i];
+        std::uint64_t due = start + (r.time - origin) * scale;
+        if (scale > 0) {
+            sleep_until_ns(due);
+        } else {
+            due = monotonic_ns();
+        }
+        bool tryVariant = r.flags & ARRIVAL_TRY;
+        if (r.kind == ARRIVAL_PASSENGER && station != nullptr) {
+            result.passengers++;
+            passengersPosted[r.line]++;
+            post([&, i, r, due, tryVariant] {
+                result.lateness[i] = std::max(monotonic_ns(), due) - due;
+                passenger(r.line, tryVariant);
+            });
+        } else if (r.kind == ARRIVAL_TRAIN && station != nullptr) {
+            result.trains++;
+            if (scale == 0) {
+                await_passengers(r.line);
+            }
+            train(r.line, [&, i, r, due] {
+                result.lateness[i] = std::max(monotonic_ns(), due) - due;
+                pool.blocking([&] { station->load_train(r.line, r.arg); });
+            });
+        } else if (r.kind == ARRIVAL_GUEST && party != nullptr) {
+            result.guests++;
+            post([&, i, r, due, tryVariant] {
+                result.lateness[i] = std::max(monotonic_ns(), due) - due;
+                guest("guest_" + std::to_string(i), r.arg >> 8 & 0xff,
+                        r.arg & 0xff, tryVariant);
+            });
+        }
+    }
+
+    // Calls returned plus passengers in the station; it stops changing
+    // once everyone left is blocked.
+    auto progress = [&] {
+        long total = returned;
+        for (int line = 0; line < numLines; line++) {
+            total += station->num_waiting(line);
+        }
+        return total;
+    };
+
+    // Once every call has started, no train is in load_train (which
+    // always returns in time) and neither calls returning nor passengers
+    // arriving have made progress for longer than a passenger takes to
+    // board, the waiting counts are exact: everyone counted is blocked.
+    const std::uint64_t quietNs = boardNs + 20000000;
+    long lastProgress = -1;
+    while (returned < posted) {
+        sleep_for_ns(quietNs);
+        bool docked = false;
+        for (LineTrains& t : lineTrains) {
+            std::lock_guard<std::mutex> lock(t.mutex);
+            docked |= t.docked;
+        }
+        if (started < posted || docked || progress() != lastProgress) {
+            lastProgress = progress();
+            continue;
+        }
+        for (int line = 0; line < numLines; line++) {
+            long waiting = waitingPassengers[line];
+            if (waiting > 0) {
+                result.drainTrains++;
+                train(line, [&, line, waiting] {
+                    pool.blocking([&] {
+                        station->load_train(line, waiting);
+                    });
+                });
+            }
+        }
+        for (int my = 0; my < NUM_SIGNS; my++) {
+            for (int other = 0; other < NUM_SIGNS; other++) {
+                long waiting = waitingGuests[my * NUM_SIGNS + other];
+                if (waiting == 0 || (my != other
+                        && waitingGuests[other * NUM_SIGNS + my] > 0)) {
+                    continue;
+                }
+                // Two guests looking for their own signs match each
+                // other, so at most one of them can be left.
+                for (long n = 0; n < (my == other ? 1 : waiting); n++) {
+                    result.drainGuests++;
+                    post([&, my, other, n] {
+                        guest("drain_" + std::to_string(n), other, my,
+                                false);
+                    });
+                }
+            }
+        }
+        lastProgress = -1;
+    }
+    pool.wait_idle();
+    result.seconds = (monotonic_ns() - start) / 1e9;
+    result.refused = refused;
+    return result;
+}
+
+#endif /* ARRIVAL_TRACE_H */
@@ -0,0 +1,144 @@
+/*
+ * Replays an arrival trace (arrival-trace.hh) against a fresh Station and
+ * Party: every recorded passenger, train and guest arrival is issued
+ * again, from a thread pool, at the recorded pace scaled by --speed or,
+ * with --speed=max, as fast as possible. Prints one JSON object with the
+ * calls made, how long the replay took and how late calls were issued
+ * relative to their scheduled times.
+ *
+ * Usage: arrival_replay [--speed=X|max] [--lock=std|futex]
+ *                       [--threads=N] [--max-threads=N] [--board=SEC]
+ *                       [--cap=N] [--overload=reject|shed|block] FILE
+ *
+ * The station gets as many lines as the trace uses. --board is the time
+ * each passenger takes to board, at the recorded pace, since traces do
+ * not record it. --cap and --overload configure admission control
+ * (admission.hh) for both the station and the party, so recorded
+ * try_wait_for_train and try_meet calls can be refused. Passengers and
+ * guests the trace leaves waiting are released at the end by extra trains
+ * and guests, which are counted separately (see replay_arrivals).
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "arrival-trace.hh"
+#include "caltrain.hh"
+#include "party.hh"
+#include "sync-policies.hh"
+#include "thread-utils.h"
+
+using namespace std;
+
+struct Options {
+    string path;
+    string lock = "std";
+    ReplayOptions replay;
+    Admission admission;
+};
+
+// Prints ", "name": {p50, p99, max}" for samples in nanoseconds, as
+// microseconds.
+static void print_micros(const char *name, vector<uint64_t>& samples)
+{
+    sort(samples.begin(), samples.end());
+    auto pct = [&samples](double p) {
+        return samples[static_cast<size_t>(p / 100 * (samples.size() - 1))]
+                / 1e3;
+    };
+    cout << ", \"" << name << "\": {\"p50\": " << pct(50)
+         << ", \"p99\": " << pct(99) << ", \"max\": " << pct(100) << "}";
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+static void replay(const Options& opts, vector<ArrivalRecord>& records)
+{
+    int lines = 1;
+    for (const ArrivalRecord& r : records) {
+        lines = max(lines, r.line + 1);
+    }
+    BasicStation<LockPolicy, WaitPolicy> station(lines, opts.admission);
+    BasicParty<LockPolicy, WaitPolicy> party(opts.admission);
+    ReplayResult result = replay_arrivals(records, &station, &party,
+            opts.replay);
+
+    double recorded = records.empty() ? 0
+            : (records.back().time - records.front().time) / 1e9;
+    cout << "{\"trace\": \"" << opts.path << "\", \"lock\": \"" << opts.lock
+         << "\", \"speed\": " << opts.replay.speed
+         << ", \"records\": " << records.size()
+         << ", \"passengers\": " << result.passengers
+         << ", \"trains\": " << result.trains
+         << ", \"guests\": " << result.guests
+         << ", \"refused\": " << result.refused
+         << ", \"drain_trains\": " << result.drainTrains
+         << ", \"drain_guests\": " << result.drainGuests
+         << ", \"recorded_seconds\": " << recorded
+         << ", \"replay_seconds\": " << result.seconds;
+    if (!records.empty()) {
+        print_micros("lateness_us", result.lateness);
+    }
+    cout << "}" << endl;
+}
+
+static bool parse(const char *arg, const char *name, string *value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+        return false;
+    }
+    *value = arg + len + 1;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    bool usage = false;
+    for (int i = 1; i < argc; i++) {
+        string value;
+        if (parse(argv[i], "--speed", &value)) {
+            opts.replay.speed = value == "max" ? 0 : atof(value.c_str());
+            usage |= value != "max" && opts.replay.speed <= 0;
+        } else if (parse(argv[i], "--lock", &opts.lock)) {
+            usage |= opts.lock != "std" && opts.lock != "futex";
+        } else if (parse(argv[i], "--threads", &value)) {
+            opts.replay.threads = atoi(value.c_str());
+        } else if (parse(argv[i], "--max-threads", &value)) {
+            opts.replay.maxThreads = atoi(value.c_str());
+        } else if (parse(argv[i], "--board", &value)) {
+            opts.replay.boardSeconds = atof(value.c_str());
+        } else if (parse(argv[i], "--cap", &value)) {
+            opts.admission.cap = atol(value.c_str());
+        } else if (parse(argv[i], "--overload", &value)) {
+            opts.admission.overload = value == "shed" ? Overload::SHED_OLDEST
+                    : value == "block" ? Overload::BLOCK : Overload::REJECT;
+            usage |= value != "reject" && value != "shed"
+                    && value != "block";
+        } else if (argv[i][0] != '-' && opts.path.empty()) {
+            opts.path = argv[i];
+        } else {
+            usage = true;
+        }
+    }
+    if (usage || opts.path.empty()) {
+        cerr << "Usage: arrival_replay [--speed=X|max] [--lock=std|futex] "
+                "[--threads=N] [--max-threads=N] [--board=SEC] [--cap=N] "
+                "[--overload=reject|shed|block] FILE" << endl;
+        return 1;
+    }
+
+    vector<ArrivalRecord> records;
+    if (!load_arrival_trace(opts.path, &records)) {
+        return 1;
+    }
+    if (opts.lock == "futex") {
+        replay<FutexLock, FutexCondVar>(opts, records);
+    } else {
+        replay<mutex, condition_variable_any>(opts, records);
+    }
+    return 0;
+}
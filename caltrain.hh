@@ -1,43 +1,356 @@
 // This class models a Caltrain station that coordinates trains and loading
 // passengers.  Trains can arrive at the station to be loaded; passengers
 // wait for trains before boarding, and indicate once they are boarded.
+//
+// The station is a template on a lock policy and a wait policy (see
+// sync-policies.hh), so the same code serves kernel threads (Station, which
+// uses std::mutex and std::condition_variable_any, or e.g. FutexLock and
+// FutexCondVar), fibers (FiberMutex, FiberCondVar) and single-threaded
+// simulation (NullLock, FiberCondVar).
+//
+// A station may serve several lines. A passenger waits for a train on
+// their own line and boards only that; each line has its own lock, wait
+// queues and waiting indicator, so trains and passengers on one line never
+// wake or contend with those on another. The methods without a line
+// argument use line 0, which is all a single-line station has.
+//
+// The number of passengers waiting at the station, across all lines, can
+// be capped (see admission.hh). SHED_OLDEST sheds the longest-waiting
+// try_wait_for_train caller on the arriving passenger's own line, so that
+// lines stay independent.
+//
+// A train may have several doors, and each passenger boards through the
+// door wait_for_train assigns. Passengers count themselves out in
+// boarded on their own door's counter, with no lock; only the last
+// passenger through a door takes the line's lock, to count the door out,
+// and only the last door to finish wakes the train. So a large train's
+// passengers finishing at once contend on one counter per door instead
+// of on the line's lock.
+//
+// A line can instead be served continuously, for a people mover rather
+// than trains: a producer publishes seats as they free up with add_seats,
+// which returns at once, and waiting passengers take them as they come.
+// The line's free seats then work as a bounded multi-producer,
+// multi-consumer channel of seat credits. add_seats wakes one waiting
+// passenger per seat published, with a single notify where the wait
+// policy allows (see notify_some in sync-policies.hh), and blocks while
+// the line already holds set_seat_limit unclaimed seats. A line is served
+// either by load_train or by add_seats, never both.
 
 #ifndef CALTRAIN_H
 #define CALTRAIN_H
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
 #include <condition_variable>
+#include <list>
+#include <memory>
 #include <mutex>
 
-class Station {
+#include "admission.hh"
+#include "event-trace.hh"
+#include "snzi.hh"
+#include "sync-policies.hh"
+
+template <typename LockPolicy = std::mutex,
+          typename WaitPolicy = std::condition_variable_any>
+class BasicStation {
 public:
-    Station();
-    
+    // The most doors a train can have.
+    static const int MAX_DOORS = 16;
+
+    // A station serving lines 0 to numLines - 1, admitting passengers as
+    // given by admission.
+    explicit BasicStation(int numLines = 1,
+            Admission admission = Admission());
+
     // Called when a train arrives in the station and has opened its doors.
     // available indicates how many seats are currently free on the train.
     // This method does not return until the train is satisfactorily loaded
     // (all new passengers boarded, and either the train is full or there
-    // are no waiting passengers).
-    void load_train(int available);
-    
+    // are no passengers waiting for its line). Passengers are spread over
+    // the train's doors, of which there are at most MAX_DOORS.
+    void load_train(int line, int available, int doors = 1);
+    void load_train(int available) { load_train(0, available); }
+
     // Invoked when a passenger arrives in the station. This method does
-    // not return until a train is in the station (i.e., a call to load_train
-    // is in progress) and there are enough free seats on the train to
-    // accommodate this passenger. Once this method returns, the passenger
-    // can begin boarding.
-    void wait_for_train();
-    
+    // not return until a train for the passenger's line is in the station
+    // (i.e., a call to load_train is in progress) and there are enough
+    // free seats on the train to accommodate this passenger. Once this
+    // method returns, the passenger can begin boarding. Returns the door
+    // to board through, to be passed to boarded.
+    int wait_for_train(int line);
+    int wait_for_train() { return wait_for_train(0); }
+
+    // Like wait_for_train, but if the station's cap on waiting passengers
+    // has been reached, the Overload policy applies: returns false,
+    // without a seat, if the passenger was rejected or later shed. The
+    // door is stored in *door, if given, when the passenger gets a seat.
+    bool try_wait_for_train(int line = 0, int *door = nullptr);
+
     // Invoked by each passenger once they have successfully boarded the train.
-    void boarded();
-    
+    void boarded(int line = 0, int door = 0);
+
+    // Publishes seats more free seats on a continuously served line and
+    // wakes as many waiting passengers, without waiting for anyone to
+    // board. Blocks while the line holds the seat limit in unclaimed
+    // seats, publishing the rest as passengers take them.
+    void add_seats(int line, int seats);
+    void add_seats(int seats) { add_seats(0, seats); }
+
+    // The most unclaimed seats add_seats lets a line hold; unlimited by
+    // default. Set it while no add_seats call is in progress.
+    void set_seat_limit(int limit) { seatLimit_ = limit; }
+
+    int num_lines() const { return numLines_; }
+
+    // About how many passengers are waiting for line, without taking its
+    // lock (see Snzi::estimate), for callers such as a dispatcher that
+    // watch demand.
+    std::size_t num_waiting(int line = 0) const
+    {
+        return lines_[line].waiting.estimate();
+    }
+
 private:
-    // Synchronizes access to all information in this object.
-    std::mutex mutex_;
-
-    std::condition_variable_any trainArrived;
-    std::condition_variable_any trainLeaving;
-    int seatsAvailable;
-    int numWaiting;
-    int boarding;
+    // Everything about one line. Its fields are laid out so that no two
+    // of them written by different parties share a cache line: the lock
+    // word (hit by every arriving thread), the data it protects, each wait
+    // policy (whose state notifiers touch), and the waiting indicator's
+    // root. Lines are aligned too, so they share no lines with each other.
+    struct Line {
+        // Synchronizes access to all information in this line except
+        // waiting, which has its own synchronization.
+        alignas(64) LockPolicy mutex_;
+
+        alignas(64) int seatsAvailable = 0;
+
+        // Doors of the train in the station with passengers still
+        // boarding through them, the number of doors, and the door the
+        // next passenger to take a seat is assigned.
+        int doorsBoarding = 0;
+        int numDoors = 1;
+        int nextDoor = 0;
+
+        // Passengers blocked in trainArrived.wait, and producers blocked
+        // in seatTaken.wait, for add_seats.
+        int sleeping = 0;
+        int producersWaiting = 0;
+
+        alignas(64) WaitPolicy trainArrived;
+        alignas(64) WaitPolicy trainLeaving;
+        alignas(64) WaitPolicy seatTaken;
+
+        // Passengers for this line that have arrived but not yet taken a
+        // seat. Arrivals are recorded before taking mutex_, on a per-CPU
+        // leaf; departures happen under mutex_ when a passenger takes a
+        // seat, so load_train can ask whether anyone is waiting with a
+        // single load.
+        Snzi waiting;
+
+        // Flags of the passengers waiting in try_wait_for_train that may
+        // be shed, oldest first; setting one sheds its passenger.
+        std::list<bool *> sheddable;
+
+        // Passengers assigned to each door and not yet boarded. A door
+        // goes from zero to nonzero under mutex_, and is counted in
+        // doorsBoarding until it goes back to zero.
+        struct alignas(64) Door {
+            std::atomic<int> boarding = 0;
+        };
+        Door doors[MAX_DOORS];
+    };
+
+    // Takes a seat on line, once admitted, and returns its door; returns
+    // -1 if the passenger was shed instead.
+    int wait_admitted(int line, bool sheddable);
+
+    // Sheds the oldest sheddable passenger on line, whose admission then
+    // passes to the caller; returns false if there is none.
+    bool shed_oldest(int line);
+
+    int numLines_;
+    std::unique_ptr<Line[]> lines_;
+
+    int seatLimit_ = INT_MAX;
+    Overload overload_;
+    alignas(64) BasicAdmissionGate<LockPolicy, WaitPolicy> gate_;
 };
 
+typedef BasicStation<> Station;
+
+template <typename LockPolicy, typename WaitPolicy>
+BasicStation<LockPolicy, WaitPolicy>::BasicStation(int numLines,
+        Admission admission)
+    : numLines_(numLines)
+    , lines_(new Line[numLines])
+    , overload_(admission.overload)
+{
+    gate_.set_cap(admission.cap);
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+void BasicStation<LockPolicy, WaitPolicy>::load_train(int line,
+        int available, int doors)
+{
+    Line& l = lines_[line];
+    trace_event(TRACE_TRAIN_ARRIVE, &l, available);
+    std::unique_lock<LockPolicy> lock(l.mutex_);
+    l.seatsAvailable = available;
+    l.numDoors = std::clamp(doors, 1, MAX_DOORS);
+    l.nextDoor = 0;
+
+    // let passengers on board
+    if (l.seatsAvailable > 0) {
+        l.trainArrived.notify_all();
+    }
+
+    // wait until everyone who took a seat has boarded and the train is
+    // full or nobody is waiting; checking the doors too keeps a spurious
+    // wakeup from sending the train off with passengers still boarding
+    while (l.doorsBoarding > 0
+            || (l.seatsAvailable > 0 && l.waiting.nonzero())) {
+        l.trainLeaving.wait(lock);
+    }
+
+    l.seatsAvailable = 0;
+    trace_event(TRACE_TRAIN_DEPART, &l);
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+int BasicStation<LockPolicy, WaitPolicy>::wait_for_train(int line)
+{
+    gate_.enter();
+    return wait_admitted(line, false);
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+bool BasicStation<LockPolicy, WaitPolicy>::try_wait_for_train(int line,
+        int *door)
+{
+    if (overload_ == Overload::BLOCK) {
+        gate_.enter();
+    } else if (!gate_.try_enter()) {
+        if (overload_ == Overload::REJECT || !shed_oldest(line)) {
+            return false;
+        }
+    }
+    int assigned = wait_admitted(line, true);
+    if (door != nullptr && assigned >= 0) {
+        *door = assigned;
+    }
+    return assigned >= 0;
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+int BasicStation<LockPolicy, WaitPolicy>::wait_admitted(int line,
+        bool sheddable)
+{
+    Line& l = lines_[line];
+    trace_event(TRACE_PASSENGER_ARRIVE, &l);
+    std::size_t leaf = l.waiting.arrive();
+    std::unique_lock<LockPolicy> lock(l.mutex_);
+    bool shed = false;
+    typename std::list<bool *>::iterator entry;
+    if (sheddable) {
+        entry = l.sheddable.insert(l.sheddable.end(), &shed);
+    }
+
+    // wait until there are seats available
+    while (l.seatsAvailable == 0 && !shed) {
+        l.sleeping++;
+        l.trainArrived.wait(lock);
+        l.sleeping--;
+    }
+    l.waiting.depart(leaf);
+    if (l.seatsAvailable == 0) {
+        return -1;
+    }
+
+    // A passenger shed just as seats became available boards anyway, but
+    // its admission now belongs to the passenger that shed it.
+    if (sheddable && !shed) {
+        l.sheddable.erase(entry);
+    }
+    l.seatsAvailable--;
+    int door = l.nextDoor;
+    l.nextDoor = (door + 1) % l.numDoors;
+    if (l.doors[door].boarding.fetch_add(1) == 0) {
+        l.doorsBoarding++;
+    }
+    if (l.producersWaiting > 0) {
+        l.seatTaken.notify_one();
+    }
+    trace_event(TRACE_PASSENGER_WAKE, &l);
+    lock.unlock();
+    if (!shed) {
+        gate_.leave();
+    }
+    return door;
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+bool BasicStation<LockPolicy, WaitPolicy>::shed_oldest(int line)
+{
+    Line& l = lines_[line];
+    std::unique_lock<LockPolicy> lock(l.mutex_);
+    if (l.sheddable.empty()) {
+        return false;
+    }
+    *l.sheddable.front() = true;
+    l.sheddable.pop_front();
+    l.trainArrived.notify_all();
+    return true;
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+void BasicStation<LockPolicy, WaitPolicy>::boarded(int line, int door)
+{
+    Line& l = lines_[line];
+    trace_event(TRACE_PASSENGER_BOARD, &l, door);
+    if (l.doors[door].boarding.fetch_sub(1) > 1) {
+        return;
+    }
+
+    // The door was counted in doorsBoarding, so the train cannot leave
+    // (and the station cannot be destroyed) before this gets the lock.
+    std::unique_lock<LockPolicy> lock(l.mutex_);
+    l.doorsBoarding--;
+
+    // train leaves when everyone is seated
+    if (l.doorsBoarding == 0) {
+        l.trainLeaving.notify_all();
+    }
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+void BasicStation<LockPolicy, WaitPolicy>::add_seats(int line, int seats)
+{
+    Line& l = lines_[line];
+    trace_event(TRACE_SEATS_ADD, &l, seats);
+    std::unique_lock<LockPolicy> lock(l.mutex_);
+    while (seats > 0) {
+        while (l.seatsAvailable >= seatLimit_) {
+            l.producersWaiting++;
+            l.seatTaken.wait(lock);
+            l.producersWaiting--;
+        }
+        int added = std::min(seats, seatLimit_ - l.seatsAvailable);
+        l.seatsAvailable += added;
+        seats -= added;
+
+        // One sleeper per seat is enough: one woken for a seat that an
+        // arriving passenger takes first just sleeps again.
+        if (l.sleeping > added) {
+            notify_some(l.trainArrived, added);
+        } else if (l.sleeping > 0) {
+            l.trainArrived.notify_all();
+        }
+    }
+}
+
+// Station is compiled once, in caltrain.cc.
+extern template class BasicStation<>;
+
 #endif /* CALTRAIN_H */
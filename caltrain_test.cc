@@ -13,14 +13,23 @@
 #include <cstdarg>
 #include <functional>
 #include <iostream>
+#include <random>
+#include <semaphore>
 #include <thread>
+#include <vector>
 
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <map>
 
+#include "arrival-trace.hh"
 #include "caltrain.hh"
+#include "dispatcher.hh"
+#include "fiber.hh"
+#include "sim.hh"
+#include "sync-policies.hh"
+#include "thread-utils.h"
 
 using namespace std;
 
@@ -830,6 +839,945 @@ void random(int total_passengers, int max_free_seats_per_train)
 }
 
 
+/* Passengers run as tasks on a ThreadPool rather than on threads of their
+ * own, and board by themselves. Each waits for a train inside blocking(),
+ * so the pool adds workers while passengers are blocked; trains are loaded
+ * from the main thread until every passenger has boarded.
+ */
+void pool_passengers(void)
+{
+    trains_arrived = 0;
+    passengers_arrived = 0;
+
+    Station station;
+    atomic<int> boarded_passengers = 0;
+    const int NUM_PASSENGERS = 200;
+    const int SEATS = 50;
+    ThreadPool pool(4);
+
+    cout << NUM_PASSENGERS << " passengers arrive as pool tasks" << endl;
+    for (int i = 0; i < NUM_PASSENGERS; i++) {
+        pool.post([&] {
+            passengers_arrived++;
+            pool.blocking([&] { station.wait_for_train(); });
+            station.boarded();
+            boarded_passengers++;
+        });
+    }
+    if (!wait_for(passengers_arrived, NUM_PASSENGERS, 1000)) {
+        cout << "Error: only " << passengers_arrived.load()
+             << " passenger tasks started" << endl;
+        exit(1);
+    }
+
+    for (int i = 1; i <= NUM_PASSENGERS / SEATS; i++) {
+        cout << "Train arrives with " << SEATS << " seats available" << endl;
+        station.load_train(SEATS);
+        if (!wait_for(boarded_passengers, i * SEATS, 100)) {
+            cout << "Error: " << boarded_passengers.load()
+                 << " passengers boarded after train " << i
+                 << " (expected " << i * SEATS << ")" << endl;
+            exit(1);
+        }
+    }
+    pool.wait_idle();
+    cout << "All passengers boarded" << endl;
+}
+
+/* The same station logic instantiated with futex-based lock and wait
+ * policies: two trains with two seats each carry four waiting passengers,
+ * and each train leaves only when its passengers have boarded.
+ */
+template <typename LockPolicy, typename WaitPolicy>
+bool futex_trains(void)
+{
+    BasicStation<LockPolicy, WaitPolicy> station;
+    atomic<int> waiting = 0;
+    atomic<int> boarding_threads = 0;
+    atomic<int> loaded_trains = 0;
+
+    cout << "4 passengers arrive, begin waiting" << endl;
+    for (int i = 0; i < 4; i++) {
+        thread([&] {
+            waiting++;
+            station.wait_for_train();
+            boarding_threads++;
+        }).detach();
+    }
+    wait_for(waiting, 4, 100);
+    usleep(100000);
+
+    for (int t = 1; t <= 2; t++) {
+        cout << "Train arrives with 2 empty seats" << endl;
+        thread([&] {
+            station.load_train(2);
+            loaded_trains++;
+        }).detach();
+        if (!wait_for(boarding_threads, 2 * t, 100)
+                || wait_for(boarding_threads, 2 * t + 1, 100)) {
+            cout << "Error: expected " << 2 * t << " passengers to have "
+                 << "begun boarding, but actual number is "
+                 << boarding_threads.load() << endl;
+            return false;
+        }
+        if (wait_for(loaded_trains, t, 100)) {
+            cout << "Error: load_train returned before passengers boarded"
+                 << endl;
+            return false;
+        }
+        station.boarded();
+        station.boarded();
+        if (!wait_for(loaded_trains, t, 100)) {
+            cout << "Error: load_train didn't return when train was full"
+                 << endl;
+            return false;
+        }
+        cout << "2 passengers boarded, train left" << endl;
+    }
+    return true;
+}
+
+void futex_policies(void)
+{
+    cout << "FutexLock and FutexCondVar:" << endl;
+    if (!futex_trains<FutexLock, FutexCondVar>()) {
+        return;
+    }
+    cout << "FutexLock and AdaptiveCondVar:" << endl;
+    if (!futex_trains<FutexLock, AdaptiveCondVar>()) {
+        return;
+    }
+    cout << "MorphingMutex and MorphingCondVar:" << endl;
+    futex_trains<MorphingMutex, MorphingCondVar>();
+}
+
+// Times the calling thread has returned from CountingCondVar::wait.
+thread_local int wakeups = 0;
+
+// A condition_variable_any that counts wakeups per thread.
+class CountingCondVar {
+public:
+    template <typename Lock>
+    void wait(Lock& lock)
+    {
+        cond_.wait(lock);
+        wakeups++;
+    }
+
+    void notify_one() { cond_.notify_one(); }
+    void notify_all() { cond_.notify_all(); }
+
+private:
+    condition_variable_any cond_;
+};
+
+/* A station serving two lines: a train boards only passengers for its own
+ * line, leaves without waiting for passengers for the other line, and
+ * does not wake them. Each passenger counts the times it was woken, which
+ * should be once.
+ */
+void multiple_lines(void)
+{
+    BasicStation<mutex, CountingCondVar> station(2);
+    atomic<int> waiting = 0;
+    atomic<int> boarding[2] = {0, 0};
+    atomic<int> total_wakeups = 0;
+    atomic<int> loaded_trains = 0;
+
+    cout << "2 passengers for line 0 and 2 for line 1 arrive" << endl;
+    for (int i = 0; i < 4; i++) {
+        int line = i % 2;
+        thread([&, line] {
+            waiting++;
+            station.wait_for_train(line);
+            total_wakeups += wakeups;
+            boarding[line]++;
+        }).detach();
+    }
+    wait_for(waiting, 4, 100);
+    usleep(100000);
+
+    for (int line : {1, 0}) {
+        cout << "Train for line " << line << " arrives with 5 seats" << endl;
+        thread([&, line] {
+            station.load_train(line, 5);
+            loaded_trains++;
+        }).detach();
+        if (!wait_for(boarding[line], 2, 100)
+                || (line == 1 && wait_for(boarding[0], 1, 100))) {
+            cout << "Error: expected 2 passengers for line " << line
+                 << " to have begun boarding, but " << boarding[0].load()
+                 << " for line 0 and " << boarding[1].load()
+                 << " for line 1 have" << endl;
+            return;
+        }
+        station.boarded(line);
+        station.boarded(line);
+        if (!wait_for(loaded_trains, line == 1 ? 1 : 2, 100)) {
+            cout << "Error: train for line " << line << " didn't leave "
+                    "once its passengers had boarded" << endl;
+            return;
+        }
+        cout << "2 passengers boarded, train left" << endl;
+    }
+    if (total_wakeups != 4) {
+        cout << "Error: passengers were woken " << total_wakeups.load()
+             << " times in all, expected 4" << endl;
+        return;
+    }
+    cout << "Each passenger was woken once" << endl;
+}
+
+/* A train with 3 doors and 6 seats: the 6 waiting passengers are
+ * assigned 2 to each door, and the train leaves only once the last
+ * passenger through the last door to finish has boarded.
+ */
+void multiple_doors(void)
+{
+    Station station;
+    atomic<int> waiting = 0;
+    atomic<int> boarding = 0;
+    atomic<int> perDoor[3] = {0, 0, 0};
+    atomic<int> loaded_trains = 0;
+
+    cout << "6 passengers arrive" << endl;
+    for (int i = 0; i < 6; i++) {
+        thread([&] {
+            waiting++;
+            int door = station.wait_for_train();
+            if (door >= 0 && door < 3) {
+                perDoor[door]++;
+            }
+            boarding++;
+        }).detach();
+    }
+    wait_for(waiting, 6, 100);
+    usleep(100000);
+
+    cout << "Train arrives with 6 seats and 3 doors" << endl;
+    thread([&] {
+        station.load_train(0, 6, 3);
+        loaded_trains++;
+    }).detach();
+    if (!wait_for(boarding, 6, 100)) {
+        cout << "Error: only " << boarding.load()
+             << " passengers began boarding" << endl;
+        return;
+    }
+    if (perDoor[0] != 2 || perDoor[1] != 2 || perDoor[2] != 2) {
+        cout << "Error: doors were assigned " << perDoor[0].load() << ", "
+             << perDoor[1].load() << " and " << perDoor[2].load()
+             << " passengers, expected 2 each" << endl;
+        return;
+    }
+    cout << "2 passengers assigned to each door" << endl;
+
+    for (int door : {0, 0, 1, 1, 2}) {
+        station.boarded(0, door);
+    }
+    if (wait_for(loaded_trains, 1, 100)) {
+        cout << "Error: load_train returned with a passenger still "
+                "boarding through door 2" << endl;
+        return;
+    }
+    station.boarded(0, 2);
+    if (!wait_for(loaded_trains, 1, 100)) {
+        cout << "Error: load_train didn't return once every door had "
+                "finished boarding" << endl;
+        return;
+    }
+    cout << "Train left once the last door finished" << endl;
+}
+
+/* A station that admits at most 2 waiting passengers. With REJECT a third
+ * try_wait_for_train fails at once, while a wait_for_train waits at the
+ * gate and gets in once a train has seated the first two; with
+ * SHED_OLDEST a third arrival sheds the first.
+ */
+void admission_control(void)
+{
+    atomic<int> waiting = 0;
+    atomic<int> boarding_threads = 0;
+    atomic<int> turned_away = 0;
+    atomic<int> loaded_trains = 0;
+    atomic<bool> first_boarded = false;
+    auto try_passenger = [&](Station& station, bool first) {
+        thread([&, first, s = &station] {
+            waiting++;
+            if (!s->try_wait_for_train()) {
+                turned_away++;
+            } else {
+                first_boarded = first_boarded || first;
+                boarding_threads++;
+            }
+        }).detach();
+    };
+
+    {
+        Station station(1, Admission{2, Overload::REJECT});
+        cout << "REJECT: 2 passengers arrive, begin waiting" << endl;
+        try_passenger(station, false);
+        try_passenger(station, false);
+        wait_for(waiting, 2, 100);
+        usleep(100000);
+        cout << "Third passenger tries to wait" << endl;
+        try_passenger(station, false);
+        if (!wait_for(turned_away, 1, 100)) {
+            cout << "Error: third passenger was not turned away" << endl;
+            exit(1);
+        }
+        cout << "Fourth passenger waits at the gate" << endl;
+        thread([&] {
+            station.wait_for_train();
+            boarding_threads++;
+        }).detach();
+        usleep(100000);
+        cout << "Train arrives with 3 seats" << endl;
+        thread([&] {
+            station.load_train(3);
+            loaded_trains++;
+        }).detach();
+        if (!wait_for(boarding_threads, 3, 1000)) {
+            cout << "Error: expected 3 passengers to have begun boarding, "
+                    "but actual number is " << boarding_threads.load()
+                 << endl;
+            exit(1);
+        }
+        for (int i = 0; i < 3; i++) {
+            station.boarded();
+        }
+        if (!wait_for(loaded_trains, 1, 100)) {
+            cout << "Error: train didn't leave" << endl;
+            exit(1);
+        }
+        cout << "3 passengers boarded, train left" << endl;
+    }
+
+    {
+        Station station(1, Admission{2, Overload::SHED_OLDEST});
+        waiting = 0;
+        boarding_threads = 0;
+        turned_away = 0;
+        loaded_trains = 0;
+        cout << "SHED_OLDEST: 2 passengers arrive, begin waiting" << endl;
+        try_passenger(station, true);
+        wait_for(waiting, 1, 100);
+        usleep(100000);
+        try_passenger(station, false);
+        wait_for(waiting, 2, 100);
+        usleep(100000);
+        cout << "Third passenger arrives" << endl;
+        try_passenger(station, false);
+        if (!wait_for(turned_away, 1, 100)) {
+            cout << "Error: no passenger was shed" << endl;
+            exit(1);
+        }
+        cout << "Train arrives with 3 seats" << endl;
+        thread([&] {
+            station.load_train(3);
+            loaded_trains++;
+        }).detach();
+        if (!wait_for(boarding_threads, 2, 1000)) {
+            cout << "Error: expected 2 passengers to have begun boarding, "
+                    "but actual number is " << boarding_threads.load()
+                 << endl;
+            exit(1);
+        }
+        if (first_boarded) {
+            cout << "Error: the first passenger was not the one shed"
+                 << endl;
+            exit(1);
+        }
+        station.boarded();
+        station.boarded();
+        if (!wait_for(loaded_trains, 1, 100)) {
+            cout << "Error: train didn't leave" << endl;
+            exit(1);
+        }
+        cout << "Oldest passenger was shed, 2 boarded, train left" << endl;
+    }
+}
+
+/* Many passengers as fibers on a two-thread FiberRuntime, using a station
+ * instantiated with the fiber mutex and condition variable: a waiting
+ * passenger parks its fiber, not a kernel thread. A train fiber keeps
+ * loading trains until everyone has boarded.
+ */
+void fiber_passengers(void)
+{
+    const int NUM_PASSENGERS = 10000;
+    const int SEATS = 64;
+    BasicStation<FiberMutex, FiberCondVar> station;
+    atomic<int> boarded_passengers = 0;
+    FiberRuntime runtime(2);
+
+    cout << NUM_PASSENGERS << " passengers arrive as fibers" << endl;
+    for (int i = 0; i < NUM_PASSENGERS; i++) {
+        runtime.spawn([&] {
+            station.wait_for_train();
+            station.boarded();
+            boarded_passengers++;
+        });
+    }
+    runtime.spawn([&] {
+        while (boarded_passengers < NUM_PASSENGERS) {
+            station.load_train(SEATS);
+            Fiber::yield();
+        }
+    });
+    if (!wait_for(boarded_passengers, NUM_PASSENGERS, 5000)) {
+        cout << "Error: only " << boarded_passengers.load()
+             << " passengers boarded" << endl;
+        exit(1);
+    }
+    runtime.wait_idle();
+    cout << "All passengers boarded" << endl;
+}
+
+/* Passengers and trains in virtual time on the discrete-event Simulator:
+ * passengers arrive at t = 0, 1 and 2, a train with 2 seats arrives at
+ * t = 5 and one with 5 seats at t = 10. The first two passengers must
+ * board at 5 and the third at 10, and nobody may be left blocked.
+ */
+void sim_station(void)
+{
+    Simulator sim;
+    BasicStation<NullLock, FiberCondVar> station;
+    vector<double> board_times;
+
+    for (int i = 0; i < 3; i++) {
+        sim.spawn([&, i] {
+            sim.sleep_until(i);
+            station.wait_for_train();
+            board_times.push_back(sim.now());
+            station.boarded();
+        });
+    }
+    sim.spawn([&] {
+        sim.sleep_until(5);
+        station.load_train(2);
+        sim.sleep_until(10);
+        station.load_train(5);
+    });
+    size_t blocked = sim.run();
+
+    cout << "Passengers boarded at";
+    for (double t : board_times) {
+        cout << " " << t;
+    }
+    cout << endl;
+    if (board_times != vector<double>{5, 5, 10}) {
+        cout << "Error: expected boarding at 5 5 10" << endl;
+    }
+    if (blocked != 0 || sim.now() != 10) {
+        cout << "Error: " << blocked << " fibers still blocked at t = "
+             << sim.now() << endl;
+    }
+}
+
+/* A dispatcher with two 3-seat trains and the demand policy, in virtual
+ * time: three passengers for line 0 arrive at t = 0, 1 and 2 and fill a
+ * train, which is sent at once; a lone passenger for line 1 gets a train
+ * only when the 50-second maximum headway runs out. No train is sent to
+ * an empty platform.
+ */
+void sim_dispatch(void)
+{
+    typedef BasicStation<NullLock, FiberCondVar> SimStation;
+    Simulator sim;
+    SimStation station(2);
+    Dispatcher<SimStation, Simulator> dispatcher(station, sim, {3, 3},
+            demand_policy(1.0, 50), 100, 1);
+    vector<double> board_times(4);
+    int boarded = 0;
+
+    for (int i = 0; i < 4; i++) {
+        int line = i < 3 ? 0 : 1;
+        sim.spawn([&, i, line] {
+            sim.sleep_until(line == 0 ? i : 0);
+            station.wait_for_train(line);
+            board_times[i] = sim.now();
+            station.boarded(line);
+            if (++boarded == 4) {
+                dispatcher.stop();
+            }
+        });
+    }
+    sim.spawn([&] { dispatcher.run(); });
+    size_t blocked = sim.run();
+
+    cout << "Passengers boarded at";
+    for (double t : board_times) {
+        cout << " " << t;
+    }
+    cout << "; " << dispatcher.dispatched() << " trains sent" << endl;
+    if (board_times != vector<double>{2, 2, 2, 50}) {
+        cout << "Error: expected boarding at 2 2 2 50" << endl;
+    }
+    if (dispatcher.dispatched() != 2 || dispatcher.empty_dispatches() != 0) {
+        cout << "Error: expected 2 trains, none of them empty, but "
+             << dispatcher.empty_dispatches() << " were empty" << endl;
+    }
+    if (blocked != 0) {
+        cout << "Error: " << blocked << " fibers still blocked" << endl;
+    }
+}
+
+/* A station that counts the trains inside load_train on each line, to
+ * check that a Dispatcher never docks a second train at a line while the
+ * first is still loading.
+ */
+template <typename StationType>
+class DockCountingStation {
+public:
+    explicit DockCountingStation(StationType& station)
+        : station_(station)
+        , docked_(station.num_lines(), 0)
+    {}
+
+    void load_train(int line, int available)
+    {
+        docked_[line]++;
+        maxDocked_ = max(maxDocked_, docked_[line]);
+        station_.load_train(line, available);
+        docked_[line]--;
+    }
+
+    int num_lines() const { return station_.num_lines(); }
+    size_t num_waiting(int line) const { return station_.num_waiting(line); }
+
+    // The most trains ever inside load_train on one line at once.
+    int max_docked() const { return maxDocked_; }
+
+private:
+    StationType& station_;
+    vector<int> docked_;
+    int maxDocked_ = 0;
+};
+
+/* Passengers arrive at 200/s for 20 s, and take 5 s to board, while a
+ * fleet of four 400-seat trains serves the line under each policy. A
+ * train fills in 2 s but stays docked until its passengers have boarded,
+ * while more passengers wait, so a dispatcher that ignored docked trains
+ * would send another train to the line before the first had left.
+ */
+void dispatch_one_train_per_line(void)
+{
+    typedef BasicStation<NullLock, FiberCondVar> SimStation;
+    for (bool demand : {true, false}) {
+        Simulator sim;
+        SimStation station;
+        DockCountingStation<SimStation> counting(station);
+        Dispatcher<DockCountingStation<SimStation>, Simulator> dispatcher(
+                counting, sim, {400, 400, 400, 400},
+                demand ? demand_policy(0.8, 5) : fixed_interval_policy(1),
+                5, 1);
+        const int PASSENGERS = 4000;
+        int boarded = 0;
+        sim.spawn([&] {
+            for (int i = 0; i < PASSENGERS; i++) {
+                sim.spawn([&] {
+                    station.wait_for_train();
+                    sim.sleep_for(5);
+                    station.boarded();
+                    if (++boarded == PASSENGERS) {
+                        dispatcher.stop();
+                    }
+                });
+                sim.sleep_for(0.005);
+            }
+        });
+        sim.spawn([&] { dispatcher.run(); });
+        size_t blocked = sim.run();
+
+        const char *name = demand ? "demand" : "fixed-interval";
+        cout << "With the " << name << " policy, " << boarded
+             << " passengers boarded " << dispatcher.dispatched()
+             << " trains, at most " << counting.max_docked()
+             << " docked at once" << endl;
+        if (counting.max_docked() != 1) {
+            cout << "Error: " << counting.max_docked() << " trains were "
+                    "inside load_train on one line at once" << endl;
+        }
+        if (boarded != PASSENGERS || blocked != 0) {
+            cout << "Error: " << blocked << " fibers still blocked" << endl;
+        }
+    }
+}
+
+/* Records a live two-line station: four passengers arrive, three for
+ * line 0 and one for line 1, and 50 ms later a 3-seat train for line 0
+ * and a 1-seat train for line 1. The trace must hold those six arrivals
+ * in time order, and replaying it at 10x against a fresh station must
+ * board everyone with no help, taking at least a tenth of the recorded
+ * time. Replayed without its last train, the passenger that train was for
+ * must be released by a drain train.
+ */
+void arrival_trace(void)
+{
+    string path = "/tmp/arrival_trace_test." + to_string(getpid());
+    {
+        Station station(2);
+        ArrivalRecorder recorder(path);
+        RecordingStation<Station> recording(station, recorder);
+        vector<thread> threads;
+        for (int i = 0; i < 4; i++) {
+            threads.emplace_back([&recording, i] {
+                int line = i < 3 ? 0 : 1;
+                recording.wait_for_train(line);
+                recording.boarded(line);
+            });
+        }
+        // Each passenger is recorded before it counts as waiting.
+        while (station.num_waiting(0) + station.num_waiting(1) < 4) {
+            sleep_for(1);
+        }
+        sleep_for(50);
+        threads.emplace_back([&recording] { recording.load_train(0, 3); });
+        sleep_for(10);
+        threads.emplace_back([&recording] { recording.load_train(1, 1); });
+        for (thread& t : threads) {
+            t.join();
+        }
+    }
+
+    vector<ArrivalRecord> records;
+    if (!load_arrival_trace(path, &records)) {
+        cout << "Error: could not load the trace" << endl;
+        return;
+    }
+    unlink(path.c_str());
+
+    // Passengers may have arrived in any order, but before the trains.
+    vector<string> arrivals;
+    for (const ArrivalRecord& r : records) {
+        arrivals.push_back(to_string(r.kind) + ":" + to_string(r.line)
+                + ":" + to_string(r.arg));
+        cout << (arrivals.size() == 1 ? "Recorded " : " ")
+             << arrivals.back();
+    }
+    cout << endl;
+    sort(arrivals.begin(),
+            arrivals.begin() + min<size_t>(4, arrivals.size()));
+    if (arrivals != vector<string>{"1:0:0", "1:0:0", "1:0:0", "1:1:0",
+            "2:0:3", "2:1:1"}) {
+        cout << "Error: expected 4 passengers, then a 3-seat train for "
+                "line 0 and a 1-seat train for line 1" << endl;
+        return;
+    }
+    double span = (records.back().time - records.front().time) / 1e9;
+    if (span < 0.055) {
+        cout << "Error: recorded arrivals span only " << span << " s"
+             << endl;
+    }
+
+    ReplayOptions options;
+    options.speed = 10;
+    Station replayed(2);
+    ReplayResult result = replay_arrivals(records, &replayed,
+            static_cast<Party *>(nullptr), options);
+    cout << "Replayed at 10x in " << result.seconds << " s" << endl;
+    if (result.passengers != 4 || result.trains != 2
+            || result.drainTrains != 0 || result.refused != 0) {
+        cout << "Error: replay made " << result.passengers
+             << " passenger and " << result.trains << " train calls, "
+             << result.drainTrains << " drain trains and "
+             << result.refused << " refusals" << endl;
+    }
+    if (result.seconds < span / 10) {
+        cout << "Error: replay at 10x finished too soon" << endl;
+    }
+
+    records.pop_back();
+    options.speed = 0;
+    Station drained(2);
+    result = replay_arrivals(records, &drained,
+            static_cast<Party *>(nullptr), options);
+    if (result.trains != 1 || result.drainTrains != 1) {
+        cout << "Error: expected 1 train and 1 drain train, got "
+             << result.trains << " and " << result.drainTrains << endl;
+    }
+}
+
+/* A continuously served line: add_seats returns without waiting for
+ * anyone to board and wakes one passenger per seat, so 4 waiting
+ * passengers are each woken once by two add_seats(2). With a seat limit
+ * of 3, add_seats(5) returns only once passengers have taken 2 of its
+ * seats. Then 10000 fiber passengers ride on seats published 64 at a time.
+ */
+void conveyor(void)
+{
+    BasicStation<mutex, CountingCondVar> station;
+    atomic<int> waiting = 0;
+    atomic<int> boarding = 0;
+    atomic<int> total_wakeups = 0;
+
+    cout << "4 passengers arrive" << endl;
+    for (int i = 0; i < 4; i++) {
+        thread([&] {
+            waiting++;
+            station.wait_for_train();
+            total_wakeups += wakeups;
+            boarding++;
+            station.boarded();
+        }).detach();
+    }
+    wait_for(waiting, 4, 100);
+    usleep(100000);
+    for (int t = 1; t <= 2; t++) {
+        station.add_seats(2);
+        cout << "2 seats added" << endl;
+        if (!wait_for(boarding, 2 * t, 100)
+                || wait_for(boarding, 2 * t + 1, 100)) {
+            cout << "Error: expected " << 2 * t << " passengers to have "
+                 << "boarded, but actual number is " << boarding.load()
+                 << endl;
+            return;
+        }
+    }
+    if (total_wakeups != 4) {
+        cout << "Error: passengers were woken " << total_wakeups.load()
+             << " times in all, expected 4" << endl;
+        return;
+    }
+    cout << "Each passenger was woken once" << endl;
+
+    station.set_seat_limit(3);
+    atomic<int> added = 0;
+    thread producer([&] {
+        station.add_seats(5);
+        added++;
+    });
+    if (wait_for(added, 1, 100)) {
+        cout << "Error: add_seats(5) returned with a limit of 3 and "
+                "nobody waiting" << endl;
+    }
+    for (int i = 0; i < 5; i++) {
+        station.wait_for_train();
+        station.boarded();
+        if (i == 1 && !wait_for(added, 1, 100)) {
+            cout << "Error: add_seats(5) did not return once 2 seats "
+                    "were taken" << endl;
+        }
+    }
+    producer.join();
+    cout << "5 more passengers boarded with a seat limit of 3" << endl;
+
+    const int NUM_PASSENGERS = 10000;
+    BasicStation<FiberMutex, FiberCondVar> fiberStation;
+    fiberStation.set_seat_limit(128);
+    atomic<int> boarded_passengers = 0;
+    {
+        FiberRuntime runtime(2);
+        for (int i = 0; i < NUM_PASSENGERS; i++) {
+            runtime.spawn([&] {
+                fiberStation.wait_for_train();
+                fiberStation.boarded();
+                boarded_passengers++;
+            });
+        }
+        runtime.spawn([&] {
+            for (int i = 0; i < NUM_PASSENGERS; i += 64) {
+                fiberStation.add_seats(min(64, NUM_PASSENGERS - i));
+                Fiber::yield();
+            }
+        });
+        if (!wait_for(boarded_passengers, NUM_PASSENGERS, 5000)) {
+            cout << "Error: only " << boarded_passengers.load()
+                 << " fiber passengers boarded" << endl;
+            exit(1);
+        }
+        runtime.wait_idle();
+    }
+    cout << NUM_PASSENGERS << " fiber passengers boarded" << endl;
+}
+
+/* A trace in which each of two lines gets 30 passengers and then ten
+ * 3-seat trains 1 ms apart, replayed as fast as possible. Each train
+ * must wait for the one before it on its line to leave, and for the
+ * passengers recorded before it to arrive, so every passenger is seated
+ * by a recorded train, with no drain trains, as when it was recorded.
+ */
+void replay_max_speed(void)
+{
+    vector<ArrivalRecord> records;
+    auto add = [&records](uint64_t ms, ArrivalKind kind, int line,
+            uint32_t arg) {
+        ArrivalRecord r = {};
+        r.time = ms * 1000000;
+        r.kind = kind;
+        r.line = line;
+        r.arg = arg;
+        records.push_back(r);
+    };
+    for (int line = 0; line < 2; line++) {
+        for (int i = 0; i < 30; i++) {
+            add(i, ARRIVAL_PASSENGER, line, 0);
+        }
+        for (int i = 0; i < 10; i++) {
+            add(30 + i, ARRIVAL_TRAIN, line, 3);
+        }
+    }
+    stable_sort(records.begin(), records.end(),
+            [](const ArrivalRecord& a, const ArrivalRecord& b) {
+                return a.time < b.time;
+            });
+
+    for (int run = 0; run < 20; run++) {
+        ReplayOptions options;
+        options.speed = 0;
+        Station station(2);
+        ReplayResult result = replay_arrivals(records, &station,
+                static_cast<Party *>(nullptr), options);
+        if (result.passengers != 60 || result.trains != 20
+                || result.drainTrains != 0) {
+            cout << "Error: replay " << run << " made " << result.passengers
+                 << " passenger and " << result.trains << " train calls "
+                 << "and needed " << result.drainTrains << " drain trains"
+                 << endl;
+            return;
+        }
+    }
+    cout << "20 replays at full speed seated everyone with recorded trains"
+         << endl;
+}
+
+/* A soak test: passengers arrive continuously for the given number of
+ * seconds, as tasks on a bounded ThreadPool, spread over four lines. Each
+ * line has a train thread sending trains with random numbers of free
+ * seats back to back (a line takes one train at a time), so trains on
+ * different lines overlap. At most max_waiting passengers are in the
+ * station at once. Invariants are checked per line as events happen, with
+ * atomic counters rather than by polling:
+ *  - no overboarding: each passenger claims one of its train's seats as it
+ *    starts boarding, and there must be one left;
+ *  - no early departure: when load_train returns, no passenger may be
+ *    between wait_for_train and boarded on that line;
+ *  - no lost passengers: some passenger must board at least every 10
+ *    seconds, and once arrivals stop, everyone must board within 10
+ *    seconds.
+ * A progress line is printed every 10 seconds, so the test can run for
+ * hours.
+ */
+void stress(int seconds, int max_free_seats_per_train, int max_waiting)
+{
+    const int NUM_LINES = 4;
+    Station station(NUM_LINES);
+    ThreadPool pool(4, max_waiting + 8);
+    counting_semaphore<> room(max_waiting);
+
+    // The train at each line's platform: its seats not yet claimed, and
+    // its passengers between wait_for_train and boarded.
+    struct Platform {
+        atomic<int> seats_left = 0;
+        atomic<int> in_boarding = 0;
+    };
+    Platform platforms[NUM_LINES];
+
+    atomic<long> arrived = 0;
+    atomic<long> boarded_total = 0;
+    atomic<bool> arrivals_done = false;
+    atomic<long> trains = 0;
+
+    // Trains inside load_train right now, and the most there have been.
+    atomic<int> loading = 0;
+    atomic<int> max_loading = 0;
+
+    auto passenger_task = [&](int line) {
+        Platform& platform = platforms[line];
+        pool.blocking([&] { station.wait_for_train(line); });
+        platform.in_boarding++;
+        if (platform.seats_left.fetch_sub(1) <= 0) {
+            cout << "Error: passenger boarded a train on line " << line
+                 << " with no free seats" << endl;
+            exit(1);
+        }
+        platform.in_boarding--;
+        station.boarded(line);
+        boarded_total++;
+        room.release();
+    };
+
+    vector<thread> train_threads;
+    for (int line = 0; line < NUM_LINES; line++) {
+        train_threads.emplace_back([&, line] {
+            Platform& platform = platforms[line];
+            mt19937 rng(getpid() + line);
+            uniform_int_distribution<int> seats(0, max_free_seats_per_train);
+            while (!arrivals_done || boarded_total < arrived) {
+                int free_seats = seats(rng);
+                platform.seats_left = free_seats;
+                int now_loading = ++loading;
+                int most = max_loading.load();
+                while (now_loading > most
+                        && !max_loading.compare_exchange_weak(most,
+                                now_loading)) {
+                }
+                station.load_train(line, free_seats);
+                loading--;
+                if (platform.in_boarding.load() != 0) {
+                    cout << "Error: train departed line " << line << " with "
+                         << platform.in_boarding.load()
+                         << " passenger(s) still boarding" << endl;
+                    exit(1);
+                }
+                trains++;
+
+                // Headway between trains, so an empty line doesn't spin.
+                sleep_for_ns(100000);
+            }
+        });
+    }
+
+    cout << "Stress test: " << seconds << " s, up to "
+         << max_free_seats_per_train << " seats per train, up to "
+         << max_waiting << " passengers waiting" << endl;
+    uint64_t start = monotonic_ns();
+    uint64_t end = start + seconds * 1000000000ull;
+    uint64_t next_report = start + 10000000000ull;
+    while (monotonic_ns() < end) {
+        if (!room.try_acquire_for(chrono::seconds(10))) {
+            cout << "Error: no passenger boarded for 10 s, with "
+                 << arrived.load() - boarded_total.load() << " waiting"
+                 << endl;
+            exit(1);
+        }
+        // Counted as it is posted, so no train thread can see everyone
+        // boarded and leave while this passenger is still queued.
+        int line = arrived++ % NUM_LINES;
+        pool.post([&, line] { passenger_task(line); });
+        if (monotonic_ns() >= next_report) {
+            cout << (next_report - start) / 1000000000ull << " s: "
+                 << boarded_total.load() << " passengers boarded on "
+                 << trains.load() << " trains" << endl;
+            next_report += 10000000000ull;
+        }
+    }
+    arrivals_done = true;
+
+    // Everyone who arrived must board; the train threads exit once they
+    // have, and that includes passengers still queued in the pool.
+    auto drain_deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    for (int i = 0; i < max_waiting; i++) {
+        if (!room.try_acquire_until(drain_deadline)) {
+            cout << "Error: " << arrived.load() - boarded_total.load()
+                 << " passenger(s) never boarded" << endl;
+            exit(1);
+        }
+    }
+    for (thread& t : train_threads) {
+        t.join();
+    }
+    pool.wait_idle();
+
+    double elapsed = (monotonic_ns() - start) / 1e9;
+    cout << "Stress test completed with no errors: "
+         << boarded_total.load() << " passengers boarded on "
+         << trains.load() << " trains in " << elapsed << " s ("
+         << boarded_total.load() / elapsed << " passengers/s), up to "
+         << max_loading.load() << " trains loading at once" << endl;
+}
+
 /*
  * This creates a bunch of threads to simulate arriving trains and passengers.
  */
@@ -847,7 +1795,19 @@ int main(int argc, char *argv[])
     testFns["board_in_parallel"] = board_in_parallel;
     testFns["board_in_parallel_all"] = board_in_parallel_all;
     testFns["leftover"] = leftover;
-    // random is omitted, as it takes arguments
+    testFns["pool_passengers"] = pool_passengers;
+    testFns["fiber_passengers"] = fiber_passengers;
+    testFns["futex_policies"] = futex_policies;
+    testFns["multiple_lines"] = multiple_lines;
+    testFns["multiple_doors"] = multiple_doors;
+    testFns["admission_control"] = admission_control;
+    testFns["sim_station"] = sim_station;
+    testFns["sim_dispatch"] = sim_dispatch;
+    testFns["dispatch_one_train_per_line"] = dispatch_one_train_per_line;
+    testFns["arrival_trace"] = arrival_trace;
+    testFns["replay_max_speed"] = replay_max_speed;
+    testFns["conveyor"] = conveyor;
+    // random and stress are omitted, as they take arguments
 
     if (argc == 1) {
         cout << "Available tests are:" << endl;
@@ -855,6 +1815,8 @@ int main(int argc, char *argv[])
             cout << "\t" << p.first << endl;
         }
         cout << "\t" << "random [NUM_PASSENGERS] [MAX_TRAIN_SIZE]" << endl;
+        cout << "\t" << "stress [SECONDS] [MAX_TRAIN_SIZE] [MAX_WAITING]"
+             << endl;
         return 0;
     }
 
@@ -872,6 +1834,16 @@ int main(int argc, char *argv[])
             cout << "passengers must be >= 0" << endl;
             return 1;
         } else random(passengers, max_train_size);
+    } else if (string(argv[1]) == "stress") {
+        int seconds = argc > 2 ? atoi(argv[2]) : 10;
+        int max_train_size = argc > 3 ? atoi(argv[3]) : 50;
+        int max_waiting = argc > 4 ? atoi(argv[4]) : 200;
+        if (seconds < 1 || max_train_size < 1 || max_waiting < 1) {
+            cout << "seconds, max train capacity and max waiting must be "
+                    "at least 1" << endl;
+            return 1;
+        }
+        stress(seconds, max_train_size, max_waiting);
     } else {
         cout << "No test named '" << argv[1] << "'" << endl;
     }
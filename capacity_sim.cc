@@ -0,0 +1,437 @@
+/*
+ * Capacity-planning simulations of the station and the party, run in
+ * virtual time on the discrete-event Simulator (sim.hh). Passengers,
+ * trains and guests are fibers calling the real Station and Party code,
+ * so results reflect its exact boarding and matching rules. Each run
+ * prints one JSON object with queue-length and wait-time statistics;
+ * runs with the same options (including --seed) are identical.
+ *
+ * Usage: capacity_sim station [--passengers=N] [--rate=PER_SEC]
+ *                     [--arrival=poisson|uniform] [--headway=SEC]
+ *                     [--jitter=FRACTION] [--seats=MIN[,MAX]]
+ *                     [--board=SEC] [--seed=N] [--record=FILE]
+ *        capacity_sim party [--guests=N] [--rate=PER_SEC]
+ *                     [--arrival=poisson|uniform] [--signs=uniform|zipf]
+ *                     [--zipf=S] [--max-signs=N] [--seed=N]
+ *                     [--record=FILE]
+ *        capacity_sim dispatch [--passengers=N] [--rate=PER_SEC]
+ *                     [--arrival=poisson|uniform] [--lines=N] [--skew=S]
+ *                     [--fleet=SEATS,...] [--trip=SEC] [--tick=SEC]
+ *                     [--policy=fixed|demand|both] [--headway=SEC]
+ *                     [--fill=FRACTION] [--max-headway=SEC] [--board=SEC]
+ *                     [--seed=N]
+ *
+ * station: passengers arrive at --rate; trains arrive every --headway
+ *          seconds (each gap varied by up to +/- --jitter of it) with a
+ *          seat count drawn uniformly from --seats, and leave once their
+ *          passengers, who take an exponentially distributed --board
+ *          seconds on average, are seated. Runs until every passenger
+ *          has boarded.
+ * party:   guests arrive at --rate with signs drawn from --signs, and
+ *          wait until matched. Guests still unmatched at the end are
+ *          reported.
+ * dispatch: passengers arrive at --rate for one of --lines lines, chosen
+ *          with Zipf exponent --skew (default 0, uniform), and a
+ *          Dispatcher (dispatcher.hh) sends trains from --fleet (one seat
+ *          count per train), each away for --trip seconds after it
+ *          leaves. --policy=fixed sends a train to every line each
+ *          --headway seconds; demand sends one when waiting passengers
+ *          fill --fill of a train or after --max-headway (default
+ *          --headway) seconds. both (the default) runs each
+ *          policy on the same arrivals and prints one line for each.
+ *
+ * --record writes the simulated arrivals, stamped with virtual time, to
+ * an arrival trace (arrival-trace.hh) that arrival_replay can play
+ * against the real station or party.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <memory>
+#include <vector>
+
+#include "arrival-trace.hh"
+#include "caltrain.hh"
+#include "dispatcher.hh"
+#include "party.hh"
+#include "sim.hh"
+#include "sync-policies.hh"
+#include "thread-utils.h"
+
+using namespace std;
+
+typedef map<string, string> Options;
+
+static double option(const Options& opts, const string& name, double def)
+{
+    auto it = opts.find(name);
+    return it == opts.end() ? def : atof(it->second.c_str());
+}
+
+static string option(const Options& opts, const string& name,
+        const char *def)
+{
+    auto it = opts.find(name);
+    return it == opts.end() ? def : it->second;
+}
+
+/**
+ * The time-weighted mean and the maximum of a quantity, such as a queue
+ * length, that changes at discrete moments.
+ */
+class TimeWeighted {
+public:
+    void add(double now, long delta)
+    {
+        area_ += value_ * (now - last_);
+        last_ = now;
+        value_ += delta;
+        max_ = std::max(max_, value_);
+    }
+
+    double mean(double now) const
+    {
+        double area = area_ + value_ * (now - last_);
+        return now > 0 ? area / now : 0;
+    }
+
+    long max() const { return max_; }
+
+private:
+    double area_ = 0;
+    double last_ = 0;
+    long value_ = 0;
+    long max_ = 0;
+};
+
+// Prints ", "name": {mean, p50, p90, p99, max}" for a set of samples.
+static void print_distribution(const char *name, vector<double>& samples)
+{
+    sort(samples.begin(), samples.end());
+    auto pct = [&samples](double p) {
+        return samples.empty() ? 0
+                : samples[static_cast<size_t>(p / 100 * (samples.size() - 1))];
+    };
+    double sum = 0;
+    for (double s : samples) {
+        sum += s;
+    }
+    cout << ", \"" << name << "\": {\"mean\": "
+         << (samples.empty() ? 0 : sum / samples.size())
+         << ", \"p50\": " << pct(50) << ", \"p90\": " << pct(90)
+         << ", \"p99\": " << pct(99)
+         << ", \"max\": " << (samples.empty() ? 0 : samples.back()) << "}";
+}
+
+// Returns a generator of gaps between arrivals at the given rate.
+static function<double()> arrival_gaps(const Options& opts, mt19937_64& rng)
+{
+    double rate = option(opts, "rate", 0.5);
+    if (option(opts, "arrival", "poisson") == "uniform") {
+        return [rate] { return 1 / rate; };
+    }
+    return [rate, &rng] { return exponential_distribution<double>(rate)(rng); };
+}
+
+// The recorder for --record, stamping arrivals with sim's clock; null
+// without --record. Sets *ok to false if the trace cannot be created.
+static unique_ptr<ArrivalRecorder> recorder(const Options& opts,
+        Simulator& sim, bool *ok)
+{
+    string path = option(opts, "record", "");
+    *ok = true;
+    if (path.empty()) {
+        return nullptr;
+    }
+    unique_ptr<ArrivalRecorder> r(new ArrivalRecorder(path,
+            [&sim] { return static_cast<uint64_t>(sim.now() * 1e9); }));
+    *ok = r->ok();
+    return r;
+}
+
+static int simulate_station(const Options& opts)
+{
+    long n = option(opts, "passengers", 1000000);
+    double headway = option(opts, "headway", 600);
+    double jitter = option(opts, "jitter", 0.0);
+    double board = option(opts, "board", 2);
+    string seats = option(opts, "seats", "400");
+    int min_seats = atoi(seats.c_str());
+    int max_seats = seats.find(',') == string::npos ? min_seats
+            : atoi(seats.c_str() + seats.find(',') + 1);
+    if (n < 1 || headway <= 0 || jitter < 0 || jitter >= 1 || board < 0
+            || min_seats < 1 || max_seats < min_seats) {
+        cerr << "invalid station options" << endl;
+        return 1;
+    }
+
+    mt19937_64 rng(option(opts, "seed", 1));
+    function<double()> gap = arrival_gaps(opts, rng);
+    Simulator sim;
+    bool ok;
+    unique_ptr<ArrivalRecorder> trace = recorder(opts, sim, &ok);
+    if (!ok) {
+        return 1;
+    }
+    BasicStation<NullLock, FiberCondVar> station;
+    TimeWeighted queue;
+    vector<double> waits;
+    vector<double> dwells;
+    waits.reserve(n);
+    long boarded = 0;
+    long seats_offered = 0;
+
+    auto passenger = [&] {
+        double arrived = sim.now();
+        queue.add(arrived, 1);
+        if (trace) {
+            trace->record(ARRIVAL_PASSENGER, 0, 0);
+        }
+        station.wait_for_train();
+        queue.add(sim.now(), -1);
+        waits.push_back(sim.now() - arrived);
+        if (board > 0) {
+            sim.sleep_for(exponential_distribution<double>(1 / board)(rng));
+        }
+        station.boarded();
+        boarded++;
+    };
+    sim.spawn([&] {
+        for (long i = 0; i < n; i++) {
+            sim.sleep_for(gap());
+            sim.spawn(passenger);
+        }
+    });
+    sim.spawn([&] {
+        double next = headway;
+        while (boarded < n) {
+            sim.sleep_until(next);
+            int available = uniform_int_distribution<int>(min_seats,
+                    max_seats)(rng);
+            seats_offered += available;
+            double arrived = sim.now();
+            if (trace) {
+                trace->record(ARRIVAL_TRAIN, 0, available);
+            }
+            station.load_train(available);
+            dwells.push_back(sim.now() - arrived);
+            next += headway * (1 + jitter
+                    * uniform_real_distribution<double>(-1, 1)(rng));
+        }
+    });
+
+    uint64_t start = monotonic_ns();
+    size_t stuck = sim.run();
+    double wall = (monotonic_ns() - start) / 1e9;
+
+    cout << "{\"sim\": \"station\", \"passengers\": " << n
+         << ", \"trains\": " << dwells.size()
+         << ", \"sim_seconds\": " << sim.now()
+         << ", \"wall_seconds\": " << wall
+         << ", \"load_factor\": "
+         << (seats_offered ? double(n) / seats_offered : 0)
+         << ", \"queue\": {\"mean\": " << queue.mean(sim.now())
+         << ", \"max\": " << queue.max() << "}";
+    print_distribution("wait_seconds", waits);
+    print_distribution("dwell_seconds", dwells);
+    cout << ", \"stuck\": " << stuck << "}" << endl;
+    return 0;
+}
+
+static int simulate_party(const Options& opts)
+{
+    long n = option(opts, "guests", 1000000);
+    int max_signs = option(opts, "max-signs", NUM_SIGNS);
+    double zipf = option(opts, "zipf", 1.0);
+    bool use_zipf = option(opts, "signs", "uniform") == "zipf";
+    if (n < 1 || max_signs < 1 || max_signs > NUM_SIGNS) {
+        cerr << "invalid party options" << endl;
+        return 1;
+    }
+    vector<double> weights;
+    for (int i = 0; i < max_signs; i++) {
+        weights.push_back(use_zipf ? 1 / pow(i + 1, zipf) : 1);
+    }
+    discrete_distribution<int> sign(weights.begin(), weights.end());
+
+    mt19937_64 rng(option(opts, "seed", 1));
+    function<double()> gap = arrival_gaps(opts, rng);
+    Simulator sim;
+    bool ok;
+    unique_ptr<ArrivalRecorder> trace = recorder(opts, sim, &ok);
+    if (!ok) {
+        return 1;
+    }
+    BasicParty<NullLock, FiberCondVar> party;
+    TimeWeighted waiting;
+    vector<double> waits;
+    waits.reserve(n);
+
+    sim.spawn([&] {
+        for (long i = 0; i < n; i++) {
+            sim.sleep_for(gap());
+            int my_sign = sign(rng);
+            int other_sign = sign(rng);
+            sim.spawn([&, i, my_sign, other_sign] {
+                double arrived = sim.now();
+                string name = "g" + to_string(i);
+                waiting.add(arrived, 1);
+                if (trace) {
+                    trace->record(ARRIVAL_GUEST, 0,
+                            my_sign << 8 | other_sign);
+                }
+                party.meet(name, my_sign, other_sign);
+                waiting.add(sim.now(), -1);
+                waits.push_back(sim.now() - arrived);
+            });
+        }
+    });
+
+    uint64_t start = monotonic_ns();
+    size_t unmatched = sim.run();
+    double wall = (monotonic_ns() - start) / 1e9;
+
+    cout << "{\"sim\": \"party\", \"guests\": " << n
+         << ", \"matched\": " << waits.size()
+         << ", \"unmatched\": " << unmatched
+         << ", \"sim_seconds\": " << sim.now()
+         << ", \"wall_seconds\": " << wall
+         << ", \"waiting\": {\"mean\": " << waiting.mean(sim.now())
+         << ", \"max\": " << waiting.max() << "}";
+    print_distribution("wait_seconds", waits);
+    cout << "}" << endl;
+    return 0;
+}
+
+static int simulate_dispatch(const Options& opts, const string& policy)
+{
+    long n = option(opts, "passengers", 100000);
+    int lines = option(opts, "lines", 1);
+    double trip = option(opts, "trip", 1800);
+    double tick = option(opts, "tick", 1);
+    double headway = option(opts, "headway", 600);
+    double fill = option(opts, "fill", 0.8);
+    double max_headway = option(opts, "max-headway", headway);
+    double board = option(opts, "board", 2);
+    double skew = option(opts, "skew", 0.0);
+    vector<int> fleet;
+    string spec = option(opts, "fleet", "400,400,400,400");
+    for (size_t pos = 0; pos < spec.size(); ) {
+        size_t comma = spec.find(',', pos);
+        fleet.push_back(atoi(spec.substr(pos, comma - pos).c_str()));
+        pos = comma == string::npos ? spec.size() : comma + 1;
+    }
+    if (n < 1 || lines < 1 || trip < 0 || tick <= 0 || headway <= 0
+            || fill <= 0 || max_headway <= 0 || board < 0 || fleet.empty()
+            || *min_element(fleet.begin(), fleet.end()) < 1) {
+        cerr << "invalid dispatch options" << endl;
+        return 1;
+    }
+    if (policy == "both") {
+        return simulate_dispatch(opts, "fixed")
+                || simulate_dispatch(opts, "demand");
+    }
+    if (policy != "fixed" && policy != "demand") {
+        cerr << "--policy must be fixed, demand or both" << endl;
+        return 1;
+    }
+
+    vector<double> weights;
+    for (int i = 0; i < lines; i++) {
+        weights.push_back(1 / pow(i + 1, skew));
+    }
+    discrete_distribution<int> pick_line(weights.begin(), weights.end());
+
+    mt19937_64 rng(option(opts, "seed", 1));
+    function<double()> gap = arrival_gaps(opts, rng);
+    Simulator sim;
+    BasicStation<NullLock, FiberCondVar> station(lines);
+    Dispatcher<BasicStation<NullLock, FiberCondVar>, Simulator> dispatcher(
+            station, sim, fleet, policy == "fixed"
+                    ? fixed_interval_policy(headway)
+                    : demand_policy(fill, max_headway), trip, tick);
+    TimeWeighted queue;
+    vector<double> waits;
+    waits.reserve(n);
+    long boarded = 0;
+
+    // Arrivals and boarding times are drawn from their own generator, so
+    // both policies see the same passengers.
+    mt19937_64 boardRng(option(opts, "seed", 1) + 1);
+    auto passenger = [&](int line) {
+        double arrived = sim.now();
+        queue.add(arrived, 1);
+        station.wait_for_train(line);
+        queue.add(sim.now(), -1);
+        waits.push_back(sim.now() - arrived);
+        if (board > 0) {
+            sim.sleep_for(exponential_distribution<double>(1 / board)(
+                    boardRng));
+        }
+        station.boarded(line);
+        if (++boarded == n) {
+            dispatcher.stop();
+        }
+    };
+    sim.spawn([&] {
+        for (long i = 0; i < n; i++) {
+            sim.sleep_for(gap());
+            int line = pick_line(rng);
+            sim.spawn([&passenger, line] { passenger(line); });
+        }
+    });
+    sim.spawn([&] { dispatcher.run(); });
+
+    uint64_t start = monotonic_ns();
+    size_t stuck = sim.run();
+    double wall = (monotonic_ns() - start) / 1e9;
+
+    cout << "{\"sim\": \"dispatch\", \"policy\": \"" << policy
+         << "\", \"passengers\": " << n << ", \"lines\": " << lines
+         << ", \"fleet\": " << fleet.size()
+         << ", \"trains\": " << dispatcher.dispatched()
+         << ", \"empty_trains\": " << dispatcher.empty_dispatches()
+         << ", \"sim_seconds\": " << sim.now()
+         << ", \"wall_seconds\": " << wall
+         << ", \"load_factor\": " << (dispatcher.seats_offered()
+                ? double(n) / dispatcher.seats_offered() : 0)
+         << ", \"queue\": {\"mean\": " << queue.mean(sim.now())
+         << ", \"max\": " << queue.max() << "}";
+    print_distribution("wait_seconds", waits);
+    cout << ", \"stuck\": " << stuck << "}" << endl;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || (strcmp(argv[1], "station") != 0
+            && strcmp(argv[1], "party") != 0
+            && strcmp(argv[1], "dispatch") != 0)) {
+        cerr << "Usage: capacity_sim station|party|dispatch [--name=value]..."
+             << endl;
+        return 1;
+    }
+    Options opts;
+    for (int i = 2; i < argc; i++) {
+        const char *eq = strchr(argv[i], '=');
+        if (strncmp(argv[i], "--", 2) != 0 || eq == nullptr) {
+            cerr << "Unknown or invalid option '" << argv[i] << "'" << endl;
+            return 1;
+        }
+        opts[string(argv[i] + 2, eq - argv[i] - 2)] = eq + 1;
+    }
+    if (option(opts, "rate", 0.5) <= 0) {
+        cerr << "--rate must be positive" << endl;
+        return 1;
+    }
+    if (strcmp(argv[1], "dispatch") == 0) {
+        return simulate_dispatch(opts, option(opts, "policy", "both"));
+    }
+    return strcmp(argv[1], "station") == 0 ? simulate_station(opts)
+            : simulate_party(opts);
+}
@@ -0,0 +1,106 @@
+// This file contains the dispatch policies and ThreadRuntime.
+
+#include "dispatcher.hh"
+
+#include <algorithm>
+#include <numeric>
+
+using namespace std;
+
+DispatchPolicy fixed_interval_policy(double headway)
+{
+    return [headway](const DispatchView& view) {
+        vector<DispatchDecision> decisions;
+        vector<bool> idle = view.idle;
+        for (size_t line = 0; line < view.waiting.size(); line++) {
+            if (view.docked[line]
+                    || view.now - view.lastDispatch[line] < headway) {
+                continue;
+            }
+            auto train = find(idle.begin(), idle.end(), true);
+            if (train == idle.end()) {
+                break;
+            }
+            *train = false;
+            decisions.push_back({static_cast<int>(train - idle.begin()),
+                    static_cast<int>(line)});
+        }
+        return decisions;
+    };
+}
+
+DispatchPolicy demand_policy(double fill, double maxHeadway)
+{
+    return [fill, maxHeadway](const DispatchView& view) {
+        vector<DispatchDecision> decisions;
+        vector<bool> idle = view.idle;
+        double headway = min(maxHeadway,
+                view.trip * view.waiting.size() / view.capacity.size());
+        vector<size_t> lines(view.waiting.size());
+        iota(lines.begin(), lines.end(), 0);
+        stable_sort(lines.begin(), lines.end(), [&view](size_t a, size_t b) {
+            return view.waiting[a] > view.waiting[b];
+        });
+        for (size_t line : lines) {
+            size_t waiting = view.waiting[line];
+            if (waiting == 0) {
+                break;
+            } else if (view.docked[line]) {
+                continue;
+            }
+
+            // The smallest idle train that takes everyone, else the
+            // largest idle train.
+            int best = -1;
+            for (size_t t = 0; t < idle.size(); t++) {
+                if (!idle[t]) {
+                    continue;
+                }
+                int cap = view.capacity[t];
+                bool fits = static_cast<size_t>(cap) >= waiting;
+                if (best < 0) {
+                    best = t;
+                    continue;
+                }
+                int bestCap = view.capacity[best];
+                bool bestFits = static_cast<size_t>(bestCap) >= waiting;
+                if (fits ? (!bestFits || cap < bestCap)
+                        : (!bestFits && cap > bestCap)) {
+                    best = t;
+                }
+            }
+            if (best < 0) {
+                break;
+            }
+            if (waiting >= fill * view.capacity[best]
+                    || view.now - view.lastDispatch[line] >= headway) {
+                idle[best] = false;
+                decisions.push_back({best, static_cast<int>(line)});
+            }
+        }
+        return decisions;
+    };
+}
+
+ThreadRuntime::~ThreadRuntime()
+{
+    // A thread being joined may still spawn others.
+    while (true) {
+        thread t;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (threads_.empty()) {
+                break;
+            }
+            t = move(threads_.back());
+            threads_.pop_back();
+        }
+        t.join();
+    }
+}
+
+void ThreadRuntime::spawn(function<void()> fn)
+{
+    lock_guard<mutex> lock(mutex_);
+    threads_.emplace_back(move(fn));
+}
@@ -0,0 +1,214 @@
+// A dispatcher that owns a fleet of trains and decides when to send them
+// to a Station, instead of trains arriving on their own. It watches the
+// number of passengers waiting for each line through
+// BasicStation::num_waiting, which reads the waiting indicator's leaves
+// and never takes a line's lock, and every tick hands what it sees to a
+// DispatchPolicy, a pure function that picks which idle trains go to
+// which lines. A dispatched train calls load_train for its line, then
+// spends the trip time away before it is idle again, so the fleet (its
+// size, capacities and trip time) is the budget the policy works within.
+// A line takes one train at a time (a second load_train would overwrite
+// the first's seats), so no train is sent to a line while another is
+// docked there.
+//
+// The dispatcher runs on any runtime with now(), sleep_for(seconds) and
+// spawn(fn): the discrete-event Simulator (sim.hh) for capacity planning,
+// or ThreadRuntime below for real threads.
+
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "thread-utils.h"
+
+// What a policy sees at each tick.
+struct DispatchView {
+    double now;
+
+    // Per line: the estimated number of passengers waiting, when a train
+    // was last sent there (0 if never), and whether a train sent there is
+    // still in load_train; a policy must not send a train to such a line.
+    std::vector<std::size_t> waiting;
+    std::vector<double> lastDispatch;
+    std::vector<bool> docked;
+
+    // Per train: its capacity, and whether it is at the depot.
+    std::vector<int> capacity;
+    std::vector<bool> idle;
+
+    // How long a train is away after leaving the station.
+    double trip;
+};
+
+// Sends train to line.
+struct DispatchDecision {
+    int train;
+    int line;
+};
+
+// Decides, from a view, which trains to send where; each train in the
+// result must be idle and appear once, and each line at most once and
+// only if no train is docked there.
+typedef std::function<std::vector<DispatchDecision>(const DispatchView&)>
+        DispatchPolicy;
+
+// Sends an idle train to each line every headway seconds, whatever the
+// demand, unless the last one is still docked; the schedule trains keep
+// today.
+DispatchPolicy fixed_interval_policy(double headway);
+
+// Sends a train to a line once the passengers waiting there would fill
+// at least fill of the smallest idle train that can take them all (or
+// the largest idle train, if none can), and otherwise to a line with
+// anyone waiting once its last train left maxHeadway seconds ago, or
+// sooner if the fleet can sustain it: every trip * lines / fleet size
+// seconds. Lines with the most passengers waiting are served first, and
+// lines with nobody waiting or a train docked get no train.
+DispatchPolicy demand_policy(double fill, double maxHeadway);
+
+/**
+ * Class: ThreadRuntime
+ * --------------------
+ * Runs a Dispatcher and its trains on kernel threads in real time.
+ * Threads started with spawn are joined by the destructor.
+ */
+class ThreadRuntime {
+public:
+    ThreadRuntime() : start_(monotonic_ns()) {}
+    ~ThreadRuntime();
+
+    // Seconds since the runtime was created.
+    double now() const { return (monotonic_ns() - start_) / 1e9; }
+
+    void sleep_for(double seconds) { sleep_for_ns(seconds * 1e9); }
+
+    void spawn(std::function<void()> fn);
+
+private:
+    std::uint64_t start_;
+    std::mutex mutex_;
+    std::vector<std::thread> threads_;
+};
+
+/**
+ * Class: Dispatcher
+ * -----------------
+ * Drives a fleet of trains for one station. run() is the dispatch loop
+ * and must be called from one of the runtime's threads or fibers.
+ */
+template <typename StationType, typename Runtime>
+class Dispatcher {
+public:
+    // capacities gives each train's seats; a train is away for trip
+    // seconds after leaving the station, and the dispatcher looks at the
+    // station every tick seconds.
+    Dispatcher(StationType& station, Runtime& runtime,
+            std::vector<int> capacities, DispatchPolicy policy,
+            double trip, double tick)
+        : station_(station)
+        , runtime_(runtime)
+        , capacities_(std::move(capacities))
+        , policy_(std::move(policy))
+        , trip_(trip)
+        , tick_(tick)
+        , idle_(new std::atomic<bool>[capacities_.size()])
+        , docked_(new std::atomic<bool>[station.num_lines()])
+        , lastDispatch_(station.num_lines(), 0)
+    {
+        for (std::size_t i = 0; i < capacities_.size(); i++) {
+            idle_[i] = true;
+        }
+        for (int line = 0; line < station.num_lines(); line++) {
+            docked_[line] = false;
+        }
+    }
+
+    // Dispatches until stop() is called or the runtime's clock reaches
+    // until, then waits for every train to return to the depot.
+    void run(double until = std::numeric_limits<double>::infinity())
+    {
+        DispatchView view;
+        view.capacity = capacities_;
+        view.idle.resize(capacities_.size());
+        view.waiting.resize(station_.num_lines());
+        view.docked.resize(station_.num_lines());
+        view.trip = trip_;
+        while (!stopped_ && runtime_.now() < until) {
+            view.now = runtime_.now();
+            for (int line = 0; line < station_.num_lines(); line++) {
+                view.waiting[line] = station_.num_waiting(line);
+                view.docked[line] = docked_[line];
+            }
+            view.lastDispatch = lastDispatch_;
+            for (std::size_t i = 0; i < capacities_.size(); i++) {
+                view.idle[i] = idle_[i];
+            }
+            for (const DispatchDecision& d : policy_(view)) {
+                dispatch(d.train, d.line, view.waiting[d.line]);
+            }
+            runtime_.sleep_for(tick_);
+        }
+        while (awayCount_ > 0) {
+            runtime_.sleep_for(tick_);
+        }
+    }
+
+    // Makes run() return once the trains are back; may be called from
+    // any thread or fiber.
+    void stop() { stopped_ = true; }
+
+    // Trains sent so far, seats they offered, and trains that found
+    // nobody waiting when they were sent.
+    long dispatched() const { return dispatched_; }
+    long seats_offered() const { return seatsOffered_; }
+    long empty_dispatches() const { return emptyDispatches_; }
+
+private:
+    void dispatch(int train, int line, std::size_t waiting)
+    {
+        idle_[train] = false;
+        docked_[line] = true;
+        awayCount_++;
+        lastDispatch_[line] = runtime_.now();
+        dispatched_++;
+        seatsOffered_ += capacities_[train];
+        emptyDispatches_ += waiting == 0;
+        runtime_.spawn([this, train, line] {
+            station_.load_train(line, capacities_[train]);
+            docked_[line] = false;
+            runtime_.sleep_for(trip_);
+            idle_[train] = true;
+            awayCount_--;
+        });
+    }
+
+    StationType& station_;
+    Runtime& runtime_;
+    const std::vector<int> capacities_;
+    const DispatchPolicy policy_;
+    const double trip_;
+    const double tick_;
+
+    // Set by each train's own thread or fiber when it returns, and per
+    // line cleared by the docked train's when its load_train returns.
+    std::unique_ptr<std::atomic<bool>[]> idle_;
+    std::unique_ptr<std::atomic<bool>[]> docked_;
+    std::atomic<int> awayCount_ = 0;
+    std::atomic<bool> stopped_ = false;
+
+    std::vector<double> lastDispatch_;
+    long dispatched_ = 0;
+    long seatsOffered_ = 0;
+    long emptyDispatches_ = 0;
+};
+
+#endif /* DISPATCHER_H */
@@ -0,0 +1,131 @@
+// This file contains the implementation of the per-thread trace writer.
+
+#include "event-trace.hh"
+
+#ifdef EVENT_TRACE
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+/**
+ * One thread's mapped trace file. Opened on the thread's first event and
+ * unmapped when the thread exits; the kernel writes the pages back.
+ */
+class ThreadTrace {
+public:
+    ThreadTrace();
+    ~ThreadTrace();
+
+    void record(TraceEvent event, const void *object, uint64_t arg)
+    {
+        if (header_ == nullptr) {
+            return;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t index = header_->written;
+        TraceRecord& r = records_[index % header_->capacity];
+        r.timestamp = now.tv_sec * 1000000000ull + now.tv_nsec;
+        r.object = reinterpret_cast<uintptr_t>(object);
+        r.arg = arg;
+        r.tid = header_->tid;
+        r.event = event;
+        r.reserved = 0;
+        header_->written = index + 1;
+    }
+
+private:
+    TraceFileHeader *header_;
+    TraceRecord *records_;
+    size_t mappedBytes_;
+};
+
+ThreadTrace::ThreadTrace()
+    : header_(nullptr)
+    , records_(nullptr)
+    , mappedBytes_(0)
+{
+    const char *dir = getenv("EVENT_TRACE_DIR");
+    if (dir == nullptr) {
+        return;
+    }
+    uint64_t capacity = 65536;
+    const char *records = getenv("EVENT_TRACE_RECORDS");
+    if (records != nullptr && atoll(records) > 0) {
+        capacity = atoll(records);
+    }
+
+    pid_t pid = getpid();
+    pid_t tid = syscall(SYS_gettid);
+    string path = string(dir) + "/trace." + to_string(pid) + "."
+            + to_string(tid) + ".bin";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path.c_str());
+        return;
+    }
+    size_t bytes = sizeof(TraceFileHeader) + capacity * sizeof(TraceRecord);
+    if (ftruncate(fd, bytes) != 0) {
+        perror(path.c_str());
+        close(fd);
+        return;
+    }
+    void *map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path.c_str());
+        return;
+    }
+
+    mappedBytes_ = bytes;
+    header_ = static_cast<TraceFileHeader *>(map);
+    records_ = reinterpret_cast<TraceRecord *>(header_ + 1);
+    memcpy(header_->magic, "EVTRACE1", 8);
+    header_->version = 1;
+    header_->recordSize = sizeof(TraceRecord);
+    header_->capacity = capacity;
+    header_->written = 0;
+    header_->pid = pid;
+    header_->tid = tid;
+}
+
+ThreadTrace::~ThreadTrace()
+{
+    if (header_ != nullptr) {
+        munmap(header_, mappedBytes_);
+    }
+}
+
+// Checked once per process, at its first event, so untraced runs pay
+// only a branch, and a program may still set EVENT_TRACE_DIR before then.
+bool trace_enabled()
+{
+    static const bool enabled = getenv("EVENT_TRACE_DIR") != nullptr;
+    return enabled;
+}
+
+} // namespace
+
+void trace_event(TraceEvent event, const void *object, uint64_t arg)
+{
+    if (!trace_enabled()) {
+        return;
+    }
+    thread_local ThreadTrace trace;
+    trace.record(event, object, arg);
+}
+
+#endif /* EVENT_TRACE */
@@ -0,0 +1,88 @@
+// This file defines a compact binary event trace for Station and Party.
+// Each thread appends fixed-width records to its own memory-mapped ring
+// file, so recording an event is a clock read and a 32-byte store with no
+// locking and no system call. trace_decode merges the per-thread files
+// into one time-ordered stream and can export Chrome trace JSON.
+//
+// Tracing is compiled in only when EVENT_TRACE is defined (build with
+// "make EVENT_TRACE=1"), and then records only if the environment
+// variable EVENT_TRACE_DIR names a directory for the trace files.
+// EVENT_TRACE_RECORDS sets the ring capacity per thread (default 65536
+// records); once a ring wraps, its oldest records are overwritten.
+
+#ifndef EVENT_TRACE_H
+#define EVENT_TRACE_H
+
+#include <cstdint>
+
+// Kinds of traced events. The values are part of the file format.
+enum TraceEvent : uint16_t {
+    // load_train called (arg: available seats) and returned.
+    TRACE_TRAIN_ARRIVE = 1,
+    TRACE_TRAIN_DEPART = 2,
+
+    // wait_for_train called, and returned with a seat.
+    TRACE_PASSENGER_ARRIVE = 3,
+    TRACE_PASSENGER_WAKE = 4,
+
+    // boarded called (arg: door).
+    TRACE_PASSENGER_BOARD = 5,
+
+    // meet called (arg: my_sign << 8 | other_sign), matched with a
+    // waiting guest on arrival, and returned.
+    TRACE_GUEST_ARRIVE = 6,
+    TRACE_GUEST_MATCH = 7,
+    TRACE_GUEST_DEPART = 8,
+
+    // add_seats called (arg: seats).
+    TRACE_SEATS_ADD = 9,
+};
+
+// Layout of a trace file: one TraceFileHeader, then capacity records.
+struct TraceFileHeader {
+    // "EVTRACE1"
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;
+
+    // Total records ever written; the newest is at (written-1) % capacity.
+    uint64_t written;
+
+    // Process and kernel thread id of the writer.
+    uint32_t pid;
+    uint32_t tid;
+
+    char reserved[24];
+};
+
+struct TraceRecord {
+    // CLOCK_MONOTONIC time in nanoseconds.
+    uint64_t timestamp;
+
+    // Address of the Station line or Party, to tell instances apart.
+    uint64_t object;
+
+    // Event-specific argument (see TraceEvent).
+    uint64_t arg;
+
+    uint32_t tid;
+    uint16_t event;
+    uint16_t reserved;
+};
+
+static_assert(sizeof(TraceFileHeader) == 64, "trace header layout");
+static_assert(sizeof(TraceRecord) == 32, "trace record layout");
+
+#ifdef EVENT_TRACE
+
+// Records one event for the calling thread, if tracing is enabled.
+void trace_event(TraceEvent event, const void *object, uint64_t arg = 0);
+
+#else
+
+inline void trace_event(TraceEvent, const void *, uint64_t = 0) {}
+
+#endif /* EVENT_TRACE */
+
+#endif /* EVENT_TRACE_H */
@@ -0,0 +1,453 @@
+// This file contains the implementation of fibers, the fiber runtime and
+// the fiber synchronization types.
+
+#include "fiber.hh"
+
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+#if defined(__x86_64__)
+// fiber_switch_context(save, to): saves the callee-saved registers and the
+// floating-point control words on the current stack, stores the stack
+// pointer in *save, then restores the same state from the stack at to.
+// fiber_entry is where a new fiber's first switch "returns" to; it passes
+// the fiber (left in r12 by the Fiber constructor) to fiber_start.
+extern "C" void fiber_switch_context(void **save, void *to);
+extern "C" void fiber_entry();
+
+asm(R"(
+    .text
+    .globl fiber_switch_context
+    .type fiber_switch_context, @function
+fiber_switch_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size fiber_switch_context, .-fiber_switch_context
+
+    .globl fiber_entry
+    .type fiber_entry, @function
+fiber_entry:
+    movq %r12, %rdi
+    call fiber_start@PLT
+    ud2
+    .size fiber_entry, .-fiber_entry
+)");
+#endif
+
+namespace {
+
+/**
+ * Fiber stacks, kept for reuse once their fibers finish so that spawning
+ * a fiber normally costs no system calls.
+ */
+class StackPool {
+public:
+    void *allocate(size_t size);
+    void release(void *stack, size_t size);
+
+private:
+    // Stacks kept per size beyond this many are unmapped.
+    static const size_t MAX_CACHED = 16384;
+
+    SpinLock lock_;
+    unordered_map<size_t, vector<void *>> free_;
+};
+
+const size_t PAGE_SIZE = sysconf(_SC_PAGESIZE);
+
+// Returns the start of a mapping of size bytes plus a guard page; the
+// usable stack is the size bytes above the guard page.
+void *StackPool::allocate(size_t size)
+{
+    {
+        lock_guard<SpinLock> guard(lock_);
+        vector<void *>& cached = free_[size];
+        if (!cached.empty()) {
+            void *stack = cached.back();
+            cached.pop_back();
+            return stack;
+        }
+    }
+    void *stack = mmap(nullptr, size + PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        throw bad_alloc();
+    }
+    mprotect(stack, PAGE_SIZE, PROT_NONE);
+    return stack;
+}
+
+void StackPool::release(void *stack, size_t size)
+{
+    {
+        lock_guard<SpinLock> guard(lock_);
+        vector<void *>& cached = free_[size];
+        if (cached.size() < MAX_CACHED) {
+            cached.push_back(stack);
+            return;
+        }
+    }
+    munmap(stack, size + PAGE_SIZE);
+}
+
+StackPool& stack_pool()
+{
+    static StackPool *pool = new StackPool;
+    return *pool;
+}
+
+// Per-thread state, reached only through these functions. A fiber can move
+// between threads while suspended, so code running on a fiber must not
+// keep the address of a thread_local across a switch; calls the compiler
+// cannot see into guarantee that it looks the variable up again.
+thread_local Fiber *currentFiber = nullptr;
+#if defined(__x86_64__)
+thread_local void *hostStack = nullptr;
+
+__attribute__((noinline)) void **host_slot()
+{
+    return &hostStack;
+}
+#else
+thread_local ucontext_t hostContext;
+
+__attribute__((noinline)) ucontext_t *host_slot()
+{
+    return &hostContext;
+}
+#endif
+
+__attribute__((noinline)) Fiber **current_slot()
+{
+    return &currentFiber;
+}
+
+} // namespace
+
+// Fiber's entry point and switch back to the host, which need its private
+// members but must be callable from assembly and static helpers.
+struct FiberEntry {
+    static void start(Fiber *fiber)
+    {
+        fiber->fn_();
+        fiber->fn_ = nullptr;
+        fiber->finished_ = true;
+        switch_out(fiber);
+    }
+
+    // Switches from fiber, which is running on this thread, back to the
+    // resume() call that started it.
+    static void switch_out(Fiber *fiber)
+    {
+#if defined(__x86_64__)
+        fiber_switch_context(&fiber->sp_, *host_slot());
+#else
+        swapcontext(&fiber->context_, host_slot());
+#endif
+    }
+};
+
+#if defined(__x86_64__)
+extern "C" void fiber_start(Fiber *fiber)
+{
+    FiberEntry::start(fiber);
+}
+#else
+static void fiber_start_split(unsigned int high, unsigned int low)
+{
+    FiberEntry::start(reinterpret_cast<Fiber *>(
+            static_cast<uintptr_t>(high) << 32 | low));
+}
+#endif
+
+Fiber::Fiber(FiberScheduler *scheduler, function<void()> fn,
+        size_t stackSize)
+    : next(nullptr)
+    , scheduler_(scheduler)
+    , fn_(move(fn))
+    , stack_(stack_pool().allocate(stackSize))
+    , stackSize_(stackSize)
+    , release_(nullptr)
+    , yielded_(false)
+    , finished_(false)
+{
+    char *base = static_cast<char *>(stack_) + PAGE_SIZE;
+#if defined(__x86_64__)
+    // Build the frame fiber_switch_context pops: control words (default
+    // MXCSR and x87 values), r15..r12, rbx, rbp and the return address.
+    // This leaves the stack 16-byte aligned at fiber_entry's call.
+    uint64_t *frame = reinterpret_cast<uint64_t *>(base + stackSize - 80);
+    frame[0] = 0x1f80 | 0x037full << 32;
+    frame[1] = frame[2] = frame[3] = 0;
+    frame[4] = reinterpret_cast<uintptr_t>(this);
+    frame[5] = frame[6] = 0;
+    frame[7] = reinterpret_cast<uintptr_t>(fiber_entry);
+    sp_ = frame;
+#else
+    getcontext(&context_);
+    context_.uc_stack.ss_sp = base;
+    context_.uc_stack.ss_size = stackSize;
+    context_.uc_link = nullptr;
+    uintptr_t self = reinterpret_cast<uintptr_t>(this);
+    makecontext(&context_, reinterpret_cast<void (*)()>(fiber_start_split),
+            2, static_cast<unsigned int>(self >> 32),
+            static_cast<unsigned int>(self));
+#endif
+}
+
+Fiber::~Fiber()
+{
+    stack_pool().release(stack_, stackSize_);
+}
+
+bool Fiber::resume()
+{
+    *current_slot() = this;
+#if defined(__x86_64__)
+    fiber_switch_context(host_slot(), sp_);
+#else
+    swapcontext(host_slot(), &context_);
+#endif
+    *current_slot() = nullptr;
+
+    // Once release_ is unlocked or the fiber is readied, another thread
+    // may resume (or even destroy) it, so read everything first.
+    SpinLock *release = release_;
+    bool yielded = yielded_;
+    bool finished = finished_;
+    FiberScheduler *scheduler = scheduler_;
+    release_ = nullptr;
+    yielded_ = false;
+    if (release) {
+        release->unlock();
+    } else if (yielded) {
+        scheduler->ready(this);
+    }
+    return finished;
+}
+
+Fiber *Fiber::current()
+{
+    return *current_slot();
+}
+
+void Fiber::park(SpinLock& lock)
+{
+    Fiber *self = current();
+    self->release_ = &lock;
+    FiberEntry::switch_out(self);
+}
+
+void Fiber::yield()
+{
+    Fiber *self = current();
+    if (!self) {
+        this_thread::yield();
+        return;
+    }
+    self->yielded_ = true;
+    FiberEntry::switch_out(self);
+}
+
+namespace {
+
+// The runtime and worker index of the calling thread, if it is one of a
+// FiberRuntime's threads.
+thread_local FiberRuntime *currentRuntime = nullptr;
+thread_local size_t currentIndex = 0;
+
+__attribute__((noinline)) FiberRuntime *current_runtime(size_t *index)
+{
+    *index = currentIndex;
+    return currentRuntime;
+}
+
+} // namespace
+
+FiberRuntime::FiberRuntime(size_t numThreads, size_t stackSize)
+    : numThreads_(numThreads ? numThreads
+            : max<size_t>(1, thread::hardware_concurrency()))
+    , stackSize_(stackSize)
+    , workers_(new Worker[numThreads_])
+    , queued_(0)
+    , live_(0)
+    , sleeping_(0)
+    , nextQueue_(0)
+    , shutdown_(false)
+{
+    for (size_t i = 0; i < numThreads_; i++) {
+        workers_[i].thread = thread([this, i] { worker_main(i); });
+    }
+}
+
+FiberRuntime::~FiberRuntime()
+{
+    wait_idle();
+    {
+        lock_guard<mutex> lock(mutex_);
+        shutdown_ = true;
+        wakeup_.notify_all();
+    }
+    for (size_t i = 0; i < numThreads_; i++) {
+        workers_[i].thread.join();
+    }
+}
+
+void FiberRuntime::spawn(function<void()> fn)
+{
+    live_++;
+    ready(new Fiber(this, move(fn), stackSize_));
+}
+
+void FiberRuntime::ready(Fiber *fiber)
+{
+    // Count the fiber before queueing it; this pairs with the check of
+    // queued_ in worker_main after a thread has announced it is sleeping.
+    queued_++;
+    size_t index;
+    if (current_runtime(&index) != this) {
+        index = nextQueue_.fetch_add(1, memory_order_relaxed) % numThreads_;
+    }
+    {
+        lock_guard<SpinLock> guard(workers_[index].lock);
+        workers_[index].runQueue.push(fiber);
+    }
+    if (sleeping_.load() > 0) {
+        lock_guard<mutex> lock(mutex_);
+        wakeup_.notify_one();
+    }
+}
+
+Fiber *FiberRuntime::find_fiber(size_t index)
+{
+    for (size_t i = 0; i < numThreads_; i++) {
+        Worker& worker = workers_[(index + i) % numThreads_];
+        lock_guard<SpinLock> guard(worker.lock);
+        Fiber *fiber = worker.runQueue.pop();
+        if (fiber) {
+            queued_--;
+            return fiber;
+        }
+    }
+    return nullptr;
+}
+
+void FiberRuntime::worker_main(size_t index)
+{
+    currentRuntime = this;
+    currentIndex = index;
+    while (true) {
+        Fiber *fiber = find_fiber(index);
+        if (fiber) {
+            if (fiber->resume()) {
+                delete fiber;
+                if (live_.fetch_sub(1) == 1) {
+                    lock_guard<mutex> lock(mutex_);
+                    idle_.notify_all();
+                }
+            }
+            continue;
+        }
+
+        unique_lock<mutex> lock(mutex_);
+        if (shutdown_) {
+            return;
+        }
+        sleeping_++;
+        if (queued_.load() == 0) {
+            wakeup_.wait(lock);
+        }
+        sleeping_--;
+    }
+}
+
+void FiberRuntime::wait_idle()
+{
+    unique_lock<mutex> lock(mutex_);
+    while (live_.load() > 0) {
+        idle_.wait(lock);
+    }
+}
+
+void FiberMutex::lock()
+{
+    spin_.lock();
+    if (!locked_) {
+        locked_ = true;
+        spin_.unlock();
+        return;
+    }
+    waiters_.push(Fiber::current());
+
+    // unlock() hands the mutex straight to us before readying us.
+    Fiber::park(spin_);
+}
+
+bool FiberMutex::try_lock()
+{
+    lock_guard<SpinLock> guard(spin_);
+    if (locked_) {
+        return false;
+    }
+    locked_ = true;
+    return true;
+}
+
+void FiberMutex::unlock()
+{
+    spin_.lock();
+    Fiber *next = waiters_.pop();
+    if (!next) {
+        locked_ = false;
+    }
+    spin_.unlock();
+    if (next) {
+        next->ready();
+    }
+}
+
+void FiberCondVar::notify_one()
+{
+    spin_.lock();
+    Fiber *fiber = waiters_.pop();
+    spin_.unlock();
+    if (fiber) {
+        fiber->ready();
+    }
+}
+
+void FiberCondVar::notify_all()
+{
+    spin_.lock();
+    FiberQueue woken = waiters_;
+    waiters_ = FiberQueue();
+    spin_.unlock();
+    while (Fiber *fiber = woken.pop()) {
+        fiber->ready();
+    }
+}
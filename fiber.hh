@@ -0,0 +1,240 @@
+// Stackful user-space threads (fibers), an M:N work-stealing runtime that
+// runs them on a few kernel threads, and a mutex and condition variable
+// that block the calling fiber rather than its kernel thread. Station and
+// Party can be instantiated with FiberMutex and FiberCondVar so that each
+// passenger or guest costs a small stack instead of an OS thread.
+
+#ifndef FIBER_H
+#define FIBER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "thread-utils.h"
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+class Fiber;
+
+/**
+ * Something that runs fibers. ready() is how a parked fiber is handed back
+ * to be resumed; it may be called from any thread, including from another
+ * fiber.
+ */
+class FiberScheduler {
+public:
+    virtual ~FiberScheduler() {}
+    virtual void ready(Fiber *fiber) = 0;
+};
+
+/**
+ * Class: Fiber
+ * ------------
+ * One stackful coroutine. A scheduler runs it on some kernel thread with
+ * resume(), which returns when the fiber parks, yields or finishes; a
+ * parked fiber runs again only after someone calls ready() on it, and may
+ * then be resumed on a different thread.
+ *
+ * Stacks come from a shared pool of mmap'd regions with a guard page below
+ * each, so an overflow faults instead of corrupting a neighbour.
+ */
+class Fiber {
+public:
+    static const std::size_t DEFAULT_STACK_SIZE = 64 * 1024;
+
+    Fiber(FiberScheduler *scheduler, std::function<void()> fn,
+            std::size_t stackSize = DEFAULT_STACK_SIZE);
+    ~Fiber();
+
+    Fiber(const Fiber&) = delete;
+    Fiber& operator=(const Fiber&) = delete;
+
+    // Runs the fiber on the calling thread until it parks, yields or
+    // finishes; returns true once it has finished. Must not be called
+    // from a fiber.
+    bool resume();
+
+    // Hands this (parked) fiber back to its scheduler.
+    void ready() { scheduler_->ready(this); }
+
+    // The fiber running on the calling thread, or nullptr.
+    static Fiber *current();
+
+    // Suspends the current fiber until someone calls ready() on it. lock,
+    // which the caller holds, is released only once the fiber is off its
+    // stack, so a waker that takes lock cannot resume it too early.
+    static void park(SpinLock& lock);
+
+    // Lets other ready fibers run, then continues.
+    static void yield();
+
+    // Link for the intrusive queues fibers wait in (FiberQueue).
+    Fiber *next;
+
+private:
+    friend struct FiberEntry;
+
+    FiberScheduler *scheduler_;
+    std::function<void()> fn_;
+    void *stack_;
+    std::size_t stackSize_;
+
+#if defined(__x86_64__)
+    void *sp_;
+#else
+    ucontext_t context_;
+#endif
+
+    // Set by the fiber just before it switches back to resume(), which
+    // acts on them once the fiber's stack is no longer in use.
+    SpinLock *release_;
+    bool yielded_;
+    bool finished_;
+};
+
+/**
+ * A FIFO of fibers linked through Fiber::next. Not synchronized.
+ */
+class FiberQueue {
+public:
+    bool empty() const { return head_ == nullptr; }
+
+    void push(Fiber *fiber)
+    {
+        fiber->next = nullptr;
+        if (tail_) {
+            tail_->next = fiber;
+        } else {
+            head_ = fiber;
+        }
+        tail_ = fiber;
+    }
+
+    Fiber *pop()
+    {
+        Fiber *fiber = head_;
+        if (fiber) {
+            head_ = fiber->next;
+            if (!head_) {
+                tail_ = nullptr;
+            }
+        }
+        return fiber;
+    }
+
+private:
+    Fiber *head_ = nullptr;
+    Fiber *tail_ = nullptr;
+};
+
+/**
+ * Class: FiberRuntime
+ * -------------------
+ * Runs fibers on a fixed set of kernel threads. Each thread has its own
+ * run queue; a fiber made ready by code running on one of the threads
+ * goes on that thread's queue, and threads that run out of fibers steal
+ * from the others before going to sleep.
+ */
+class FiberRuntime : public FiberScheduler {
+public:
+    // numThreads = 0 means one per hardware thread.
+    explicit FiberRuntime(std::size_t numThreads = 0,
+            std::size_t stackSize = Fiber::DEFAULT_STACK_SIZE);
+
+    // Waits for every fiber to finish, then stops the threads.
+    ~FiberRuntime();
+
+    // Starts a fiber running fn. May be called from any thread.
+    void spawn(std::function<void()> fn);
+
+    // Waits until every fiber spawned so far has finished.
+    void wait_idle();
+
+    std::size_t num_threads() const { return numThreads_; }
+
+    void ready(Fiber *fiber) override;
+
+private:
+    struct Worker {
+        SpinLock lock;
+        FiberQueue runQueue;
+        std::thread thread;
+    };
+
+    void worker_main(std::size_t index);
+    Fiber *find_fiber(std::size_t index);
+
+    const std::size_t numThreads_;
+    const std::size_t stackSize_;
+    std::unique_ptr<Worker[]> workers_;
+
+    // Fibers queued in any run queue, and fibers not yet finished.
+    std::atomic<std::size_t> queued_;
+    std::atomic<std::size_t> live_;
+
+    // Threads asleep for lack of work; a thread that readies a fiber
+    // wakes one of them.
+    std::atomic<std::size_t> sleeping_;
+
+    // Round-robin choice of queue for fibers readied outside the runtime.
+    std::atomic<std::size_t> nextQueue_;
+
+    // Protects sleeping and the condition variables.
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable idle_;
+    bool shutdown_;
+};
+
+/**
+ * Class: FiberMutex
+ * -----------------
+ * A mutex whose lock() parks the calling fiber while another holds it.
+ * Ownership passes directly to the longest waiter on unlock(). Must be
+ * used from fibers.
+ */
+class FiberMutex {
+public:
+    void lock();
+    bool try_lock();
+    void unlock();
+
+private:
+    SpinLock spin_;
+    bool locked_ = false;
+    FiberQueue waiters_;
+};
+
+/**
+ * Class: FiberCondVar
+ * -------------------
+ * A condition variable for fibers, usable with any lock (normally a
+ * std::unique_lock<FiberMutex>). Must be used from fibers.
+ */
+class FiberCondVar {
+public:
+    template <typename Lock>
+    void wait(Lock& lock)
+    {
+        spin_.lock();
+        waiters_.push(Fiber::current());
+        lock.unlock();
+        Fiber::park(spin_);
+        lock.lock();
+    }
+
+    void notify_one();
+    void notify_all();
+
+private:
+    SpinLock spin_;
+    FiberQueue waiters_;
+};
+
+#endif /* FIBER_H */
@@ -0,0 +1,229 @@
+/*
+ * Benchmarks for the fiber runtime. Prints one JSON object per benchmark:
+ *
+ *   switch   bare Fiber::resume/Fiber::yield round trips on one thread,
+ *            i.e. the cost of a pair of context switches
+ *   yield    Fiber::yield through a FiberRuntime scheduler, with several
+ *            fibers taking turns
+ *   station  a large population of passenger fibers boarding trains at a
+ *            BasicStation<FiberMutex, FiberCondVar>
+ *   party    a large population of guest fibers meeting at a
+ *            BasicParty<FiberMutex, FiberCondVar>
+ *
+ * station and party include hardware and software event counts per
+ * passenger or match where perf events are available (perf-counters.hh).
+ *
+ * Usage: fiber_bench [--threads=N] [--switches=N] [--passengers=N]
+ *                    [--seats=N] [--guests=N] [--stack=BYTES] [BENCH...]
+ */
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "caltrain.hh"
+#include "fiber.hh"
+#include "party.hh"
+#include "perf-counters.hh"
+#include "thread-utils.h"
+
+using namespace std;
+
+struct Options {
+    size_t threads = 1;
+    long switches = 1000000;
+    int passengers = 100000;
+    int seats = 1000;
+    int guests = 100000;
+    size_t stack = Fiber::DEFAULT_STACK_SIZE;
+};
+
+// A scheduler for fibers that are resumed by hand.
+class NullScheduler : public FiberScheduler {
+public:
+    void ready(Fiber *) override {}
+};
+
+static long max_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void bench_switch(const Options& opts)
+{
+    NullScheduler scheduler;
+    long n = opts.switches;
+    Fiber fiber(&scheduler, [n] {
+        for (long i = 0; i < n; i++) {
+            Fiber::yield();
+        }
+    }, opts.stack);
+    uint64_t start = monotonic_ns();
+    while (!fiber.resume()) {}
+    uint64_t elapsed = monotonic_ns() - start;
+    cout << "{\"bench\": \"switch\", \"round_trips\": " << n
+         << ", \"ns_per_switch\": " << elapsed / (2.0 * n) << "}" << endl;
+}
+
+static void bench_yield(const Options& opts)
+{
+    const int FIBERS = 8;
+    long per_fiber = opts.switches / FIBERS;
+    uint64_t start = monotonic_ns();
+    {
+        FiberRuntime runtime(opts.threads, opts.stack);
+        for (int i = 0; i < FIBERS; i++) {
+            runtime.spawn([per_fiber] {
+                for (long j = 0; j < per_fiber; j++) {
+                    Fiber::yield();
+                }
+            });
+        }
+    }
+    uint64_t elapsed = monotonic_ns() - start;
+    cout << "{\"bench\": \"yield\", \"threads\": " << opts.threads
+         << ", \"fibers\": " << FIBERS
+         << ", \"ns_per_yield\": " << elapsed / double(per_fiber * FIBERS)
+         << "}" << endl;
+}
+
+static void bench_station(const Options& opts)
+{
+    BasicStation<FiberMutex, FiberCondVar> station;
+    atomic<int> boarded = 0;
+    int n = opts.passengers;
+    int seats = opts.seats;
+    PerfCounters perf;
+    perf.start();
+    uint64_t start = monotonic_ns();
+    {
+        FiberRuntime runtime(opts.threads, opts.stack);
+        for (int i = 0; i < n; i++) {
+            runtime.spawn([&station, &boarded] {
+                station.wait_for_train();
+                station.boarded();
+                boarded++;
+            });
+        }
+        runtime.spawn([&station, &boarded, n, seats] {
+            while (boarded < n) {
+                station.load_train(seats);
+                Fiber::yield();
+            }
+        });
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    perf.stop();
+    cout << "{\"bench\": \"station\", \"threads\": " << opts.threads
+         << ", \"passengers\": " << n << ", \"seats\": " << seats
+         << ", \"seconds\": " << seconds
+         << ", \"passengers_per_sec\": " << n / seconds
+         << ", \"max_rss_kb\": " << max_rss_kb();
+    perf.write_json(cout, n, "passenger");
+    cout << "}" << endl;
+}
+
+static void bench_party(const Options& opts)
+{
+    BasicParty<FiberMutex, FiberCondVar> party;
+    int pairs = opts.guests / 2;
+    PerfCounters perf;
+    perf.start();
+    uint64_t start = monotonic_ns();
+    {
+        FiberRuntime runtime(opts.threads, opts.stack);
+        for (int i = 0; i < pairs; i++) {
+            int a = i % NUM_SIGNS;
+            int b = (i / NUM_SIGNS) % NUM_SIGNS;
+            runtime.spawn([&party, a, b] {
+                string name = "a";
+                party.meet(name, a, b);
+            });
+            runtime.spawn([&party, a, b] {
+                string name = "b";
+                party.meet(name, b, a);
+            });
+        }
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    perf.stop();
+    cout << "{\"bench\": \"party\", \"threads\": " << opts.threads
+         << ", \"guests\": " << 2 * pairs
+         << ", \"seconds\": " << seconds
+         << ", \"matches_per_sec\": " << pairs / seconds
+         << ", \"max_rss_kb\": " << max_rss_kb();
+    perf.write_json(cout, pairs, "match");
+    cout << "}" << endl;
+}
+
+static bool parse(const char *arg, const char *name, long *value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+        return false;
+    }
+    *value = atol(arg + len + 1);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    vector<string> benches;
+    for (int i = 1; i < argc; i++) {
+        long value;
+        if (parse(argv[i], "--threads", &value)) {
+            opts.threads = value;
+        } else if (parse(argv[i], "--switches", &value)) {
+            opts.switches = value;
+        } else if (parse(argv[i], "--passengers", &value)) {
+            opts.passengers = value;
+        } else if (parse(argv[i], "--seats", &value)) {
+            opts.seats = value;
+        } else if (parse(argv[i], "--guests", &value)) {
+            opts.guests = value;
+        } else if (parse(argv[i], "--stack", &value)) {
+            opts.stack = value;
+        } else if (argv[i][0] != '-') {
+            benches.push_back(argv[i]);
+        } else {
+            cerr << "Usage: fiber_bench [--threads=N] [--switches=N] "
+                    "[--passengers=N] [--seats=N] [--guests=N] "
+                    "[--stack=BYTES] [switch|yield|station|party]..."
+                 << endl;
+            return 1;
+        }
+    }
+    if (opts.threads < 1 || opts.switches < 1 || opts.seats < 1
+            || opts.stack < 16384 || opts.stack % 4096 != 0) {
+        cerr << "need at least one thread, one switch and one seat, and a "
+                "stack size that is a multiple of 4096 and at least 16384"
+             << endl;
+        return 1;
+    }
+    if (benches.empty()) {
+        benches = {"switch", "yield", "station", "party"};
+    }
+
+    for (const string& bench : benches) {
+        if (bench == "switch") {
+            bench_switch(opts);
+        } else if (bench == "yield") {
+            bench_yield(opts);
+        } else if (bench == "station") {
+            bench_station(opts);
+        } else if (bench == "party") {
+            bench_party(opts);
+        } else {
+            cerr << "unknown benchmark " << bench << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
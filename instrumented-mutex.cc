@@ -0,0 +1,217 @@
+// This file contains the implementation of LockProfile.
+
+#include "instrumented-mutex.hh"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <vector>
+
+#include <execinfo.h>
+
+using namespace std;
+
+namespace {
+
+// Every live LockProfile, for report_all. Built on first use, since locks
+// in other files' static objects may be constructed before this file's.
+mutex& registry_mutex()
+{
+    static mutex *m = new mutex;
+    return *m;
+}
+
+vector<LockProfile *>& registry()
+{
+    static vector<LockProfile *> *profiles = new vector<LockProfile *>;
+    return *profiles;
+}
+
+int bucket_for(uint64_t ns)
+{
+    if (ns < 2) {
+        return 0;
+    }
+    return min(63 - __builtin_clzll(ns), LockProfile::NUM_BUCKETS - 1);
+}
+
+// Returns an upper bound on the given percentile (0-100) of a histogram,
+// or 0 if it is empty.
+uint64_t percentile(const atomic<uint64_t> *hist, double pct)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < LockProfile::NUM_BUCKETS; i++) {
+        total += hist[i].load(memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = max<uint64_t>(1, total * pct / 100);
+    uint64_t seen = 0;
+    for (int i = 0; i < LockProfile::NUM_BUCKETS; i++) {
+        seen += hist[i].load(memory_order_relaxed);
+        if (seen >= rank) {
+            return (2ull << i) - 1;
+        }
+    }
+    return (2ull << (LockProfile::NUM_BUCKETS - 1)) - 1;
+}
+
+} // namespace
+
+LockProfile::LockProfile()
+    : acquisitions_(0)
+    , contended_(0)
+    , waitNs_(0)
+    , otherCount_(0)
+    , otherWaitNs_(0)
+{
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        waitHist_[i] = 0;
+        holdHist_[i] = 0;
+    }
+    for (Site& site : sites_) {
+        site.state = 0;
+        site.count = 0;
+        site.waitNs = 0;
+    }
+    lock_guard<mutex> lock(registry_mutex());
+    registry().push_back(this);
+}
+
+LockProfile::~LockProfile()
+{
+    lock_guard<mutex> lock(registry_mutex());
+    registry().erase(find(registry().begin(), registry().end(), this));
+}
+
+uint64_t LockProfile::acquired(bool contended, int site, uint64_t waitNs)
+{
+    uint64_t n = acquisitions_.fetch_add(1, memory_order_relaxed);
+    if (!contended) {
+        return n;
+    }
+    contended_.fetch_add(1, memory_order_relaxed);
+    waitNs_.fetch_add(waitNs, memory_order_relaxed);
+    waitHist_[bucket_for(waitNs)].fetch_add(1, memory_order_relaxed);
+    if (site >= 0) {
+        sites_[site].count.fetch_add(1, memory_order_relaxed);
+        sites_[site].waitNs.fetch_add(waitNs, memory_order_relaxed);
+    } else {
+        otherCount_.fetch_add(1, memory_order_relaxed);
+        otherWaitNs_.fetch_add(waitNs, memory_order_relaxed);
+    }
+    return n;
+}
+
+void LockProfile::held(uint64_t holdNs)
+{
+    holdHist_[bucket_for(holdNs)].fetch_add(1, memory_order_relaxed);
+}
+
+int LockProfile::contended_site()
+{
+    // Frame 0 is this function; the rest identify the contended caller.
+    void *frames[SITE_DEPTH + 1];
+    int depth = backtrace(frames, SITE_DEPTH + 1) - 1;
+    void *key[SITE_DEPTH] = {};
+    memcpy(key, frames + 1, max(depth, 0) * sizeof(void *));
+    uint64_t hash = 14695981039346656037ull;
+    for (void *frame : key) {
+        hash = (hash ^ reinterpret_cast<uintptr_t>(frame)) * 1099511628211ull;
+    }
+
+    // Open addressing; slots are claimed once and never freed.
+    for (int i = 0; i < NUM_SITES; i++) {
+        Site& site = sites_[(hash + i) % NUM_SITES];
+        int state = site.state.load(memory_order_acquire);
+        if (state == 0) {
+            if (site.state.compare_exchange_strong(state, 1)) {
+                site.hash = hash;
+                memcpy(site.frames, key, sizeof(key));
+                site.state.store(2, memory_order_release);
+                return (hash + i) % NUM_SITES;
+            }
+        }
+        while (state == 1) {
+            cpu_relax();
+            state = site.state.load(memory_order_acquire);
+        }
+        if (site.hash == hash && memcmp(site.frames, key, sizeof(key)) == 0) {
+            return (hash + i) % NUM_SITES;
+        }
+    }
+    return -1;
+}
+
+void LockProfile::report(ostream& out, int topSites) const
+{
+    uint64_t acquisitions = acquisitions_.load(memory_order_relaxed);
+    uint64_t contended = contended_.load(memory_order_relaxed);
+    out << "lock " << this << ": " << acquisitions << " acquisitions, "
+        << contended << " contended (" << fixed << setprecision(1)
+        << (acquisitions ? 100.0 * contended / acquisitions : 0.0)
+        << "%), " << setprecision(3)
+        << waitNs_.load(memory_order_relaxed) / 1e6
+        << " ms waiting in total" << defaultfloat << endl;
+    out << "  contended wait ns: p50 <= " << percentile(waitHist_, 50)
+        << ", p90 <= " << percentile(waitHist_, 90)
+        << ", p99 <= " << percentile(waitHist_, 99)
+        << ", max <= " << percentile(waitHist_, 100) << endl;
+    out << "  hold ns (1 in " << InstrumentedMutex<>::HOLD_SAMPLE_RATE
+        << " sampled): p50 <= " << percentile(holdHist_, 50)
+        << ", p90 <= " << percentile(holdHist_, 90)
+        << ", p99 <= " << percentile(holdHist_, 99)
+        << ", max <= " << percentile(holdHist_, 100) << endl;
+
+    vector<const Site *> sites;
+    for (const Site& site : sites_) {
+        if (site.state.load(memory_order_acquire) == 2
+                && site.count.load(memory_order_relaxed) > 0) {
+            sites.push_back(&site);
+        }
+    }
+    if (sites.empty()) {
+        return;
+    }
+    sort(sites.begin(), sites.end(), [](const Site *a, const Site *b) {
+        return a->waitNs.load(memory_order_relaxed)
+                > b->waitNs.load(memory_order_relaxed);
+    });
+    out << "  top contended call sites (waits, ms waiting, stack):" << endl;
+    for (int i = 0; i < topSites && i < static_cast<int>(sites.size());
+            i++) {
+        const Site *site = sites[i];
+        int depth = 0;
+        while (depth < SITE_DEPTH && site->frames[depth]) {
+            depth++;
+        }
+        char **names = backtrace_symbols(site->frames, depth);
+        out << "  " << setw(10) << site->count.load(memory_order_relaxed)
+            << setw(10) << fixed << setprecision(3)
+            << site->waitNs.load(memory_order_relaxed) / 1e6
+            << defaultfloat << "  ";
+        for (int j = 0; j < depth; j++) {
+            out << (j ? " <- " : "") << (names ? names[j] : "?");
+        }
+        out << endl;
+        free(names);
+    }
+    if (otherCount_.load(memory_order_relaxed) > 0) {
+        out << "  " << setw(10) << otherCount_.load(memory_order_relaxed)
+            << setw(10) << fixed << setprecision(3)
+            << otherWaitNs_.load(memory_order_relaxed) / 1e6
+            << defaultfloat << "  (other sites)" << endl;
+    }
+}
+
+void LockProfile::report_all(ostream& out, int topSites)
+{
+    lock_guard<mutex> lock(registry_mutex());
+    for (LockProfile *profile : registry()) {
+        if (profile->acquisitions() > 0) {
+            profile->report(out, topSites);
+        }
+    }
+}
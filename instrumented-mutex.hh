@@ -0,0 +1,150 @@
+// A drop-in lock policy that profiles the lock it wraps. Instantiate
+// Station or Party with it to find out how much the lock serializes them:
+//
+//     BasicStation<InstrumentedMutex<>> station;
+//     ...
+//     LockProfile::report_all(std::cerr);
+//
+// Each InstrumentedMutex counts acquisitions and contended acquisitions,
+// keeps power-of-two histograms of wait time and hold time, and records the
+// call stacks that most often found the lock held. The uncontended path
+// adds two relaxed atomic increments and, for one acquisition in
+// HOLD_SAMPLE_RATE, a pair of clock reads to time the hold; stacks are
+// captured only on the contended path, which is about to block anyway.
+// This keeps the wrapper cheap enough to leave on in a canary build.
+
+#ifndef INSTRUMENTED_MUTEX_H
+#define INSTRUMENTED_MUTEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+
+#include "thread-utils.h"
+
+/**
+ * Class: LockProfile
+ * ------------------
+ * The statistics for one lock. All fields are relaxed atomics, so a
+ * report can be printed at any time without disturbing the lock.
+ */
+class LockProfile {
+public:
+    // Bucket i of a histogram holds times in [2^i, 2^(i+1)) ns (bucket 0
+    // also holds 0); 40 buckets reach about 18 minutes.
+    static const int NUM_BUCKETS = 40;
+
+    // Distinct contended call stacks remembered per lock; contention from
+    // further stacks is counted under "other".
+    static const int NUM_SITES = 64;
+
+    // Return addresses kept per call stack.
+    static const int SITE_DEPTH = 4;
+
+    LockProfile();
+    ~LockProfile();
+
+    LockProfile(const LockProfile&) = delete;
+    LockProfile& operator=(const LockProfile&) = delete;
+
+    // Hooks for InstrumentedMutex. acquired returns the number of earlier
+    // acquisitions; contended_site captures the calling stack and returns
+    // its index in the site table (or -1).
+    std::uint64_t acquired(bool contended, int site, std::uint64_t waitNs);
+    void held(std::uint64_t holdNs);
+    int contended_site();
+
+    std::uint64_t acquisitions() const { return acquisitions_.load(); }
+    std::uint64_t contended() const { return contended_.load(); }
+
+    // Prints this lock's counters, wait and hold percentiles and its top
+    // contended call sites. Frames are printed as backtrace_symbols gives
+    // them; "addr2line -Cfe BINARY +OFFSET" turns one into a source line.
+    void report(std::ostream& out, int topSites = 10) const;
+
+    // Prints a report for every live LockProfile that has been acquired.
+    static void report_all(std::ostream& out, int topSites = 10);
+
+private:
+    struct Site {
+        // 0 = empty, 1 = being filled in, 2 = ready.
+        std::atomic<int> state;
+        std::uint64_t hash;
+        void *frames[SITE_DEPTH];
+        std::atomic<std::uint64_t> count;
+        std::atomic<std::uint64_t> waitNs;
+    };
+
+    std::atomic<std::uint64_t> acquisitions_;
+    std::atomic<std::uint64_t> contended_;
+    std::atomic<std::uint64_t> waitNs_;
+    std::atomic<std::uint64_t> waitHist_[NUM_BUCKETS];
+    std::atomic<std::uint64_t> holdHist_[NUM_BUCKETS];
+    std::atomic<std::uint64_t> otherCount_;
+    std::atomic<std::uint64_t> otherWaitNs_;
+    Site sites_[NUM_SITES];
+};
+
+/**
+ * Class: InstrumentedMutex
+ * ------------------------
+ * Wraps any lock policy (std::mutex by default) and records its use in a
+ * LockProfile. Has the same lock/try_lock/unlock interface, so it can be
+ * passed as the LockPolicy of BasicStation or BasicParty, and works with
+ * any wait policy.
+ */
+template <typename Base = std::mutex>
+class InstrumentedMutex {
+public:
+    // Hold time is measured for one acquisition in this many.
+    static constexpr std::uint64_t HOLD_SAMPLE_RATE = 8;
+
+    void lock()
+    {
+        if (base_.try_lock()) {
+            acquired(false, -1, 0);
+            return;
+        }
+        int site = profile_.contended_site();
+        std::uint64_t start = monotonic_ns();
+        base_.lock();
+        acquired(true, site, monotonic_ns() - start);
+    }
+
+    bool try_lock()
+    {
+        if (!base_.try_lock()) {
+            return false;
+        }
+        acquired(false, -1, 0);
+        return true;
+    }
+
+    void unlock()
+    {
+        if (holdStart_) {
+            profile_.held(monotonic_ns() - holdStart_);
+        }
+        base_.unlock();
+    }
+
+    const LockProfile& profile() const { return profile_; }
+
+private:
+    void acquired(bool contended, int site, std::uint64_t waitNs)
+    {
+        std::uint64_t n = profile_.acquired(contended, site, waitNs);
+        holdStart_ = n % HOLD_SAMPLE_RATE == 0 ? monotonic_ns() : 0;
+    }
+
+    Base base_;
+
+    // When the current holder acquired the lock, if this acquisition's
+    // hold time is being sampled; only the holder touches it.
+    std::uint64_t holdStart_ = 0;
+
+    LockProfile profile_;
+};
+
+#endif /* INSTRUMENTED_MUTEX_H */
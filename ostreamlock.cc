@@ -0,0 +1,523 @@
+// This file contains the implementation of the oslock/osunlock
+// manipulators: an asynchronous logger built from per-thread formatting
+// buffers, a bounded lock-free multi-producer/single-consumer ring of
+// fixed-size slots, and one background thread that drains the ring.
+
+#include "ostreamlock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+class AsyncBuf;
+
+// Ring geometry: 1024 slots of 512 bytes. A record that doesn't fit in
+// one slot occupies several consecutive slots, up to MAX_RECORD_SLOTS.
+const size_t NUM_SLOTS = 1024;
+const size_t SLOT_BYTES = 512;
+const size_t MAX_RECORD_SLOTS = 64;
+
+struct Slot {
+    // Vyukov-style sequence number: equal to the slot's position when
+    // the slot is free for that position, position + 1 once published.
+    atomic<uint64_t> seq;
+
+    // Stream the record goes to, and the number of slots in the record
+    // (both valid only in a record's first slot).
+    AsyncBuf *target;
+    uint32_t slots;
+
+    // Bytes of data in this slot.
+    uint32_t length;
+
+    char data[SLOT_BYTES - sizeof(atomic<uint64_t>) - sizeof(AsyncBuf *)
+            - 2 * sizeof(uint32_t)];
+};
+
+const size_t PAYLOAD_BYTES = sizeof(Slot::data);
+
+class Logger {
+public:
+    Logger();
+
+    // Publishes one record; returns false if it was dropped.
+    bool publish(AsyncBuf *target, const char *data, size_t length);
+    void flush();
+    void shutdown();
+
+    atomic<OsOverflowPolicy> policy;
+
+private:
+    void drain();
+    bool drain_one();
+    void report_drops();
+    void wake_writer();
+
+    Slot ring_[NUM_SLOTS];
+
+    // Next position a producer will reserve.
+    alignas(64) atomic<uint64_t> enqueuePos_;
+
+    // Next position the writer will read, and the position up to which
+    // everything has been written and flushed (for oslock_flush).
+    alignas(64) uint64_t dequeuePos_;
+    atomic<uint64_t> writtenPos_;
+    atomic<uint64_t> dropped_;
+
+    // Used only to put the writer to sleep when the ring is empty.
+    mutex sleepMutex_;
+    condition_variable wakeup_;
+    atomic<bool> sleeping_;
+    atomic<bool> stopping_;
+
+    // Set once the writer has exited; later records are written directly
+    // (serialized by directMutex_).
+    atomic<bool> direct_;
+    mutex directMutex_;
+
+    // Streams written since the last flush (writer thread only).
+    vector<AsyncBuf *> dirty_;
+
+    thread writer_;
+};
+
+// Text a thread has inserted into one stream but not yet published.
+struct Pending {
+    AsyncBuf *buf;
+    string text;
+
+    // Nesting depth of oslock on this stream.
+    int depth;
+};
+
+/**
+ * Stream buffer installed by the first oslock on a stream. It has no put
+ * area, so every insertion reaches xsputn/overflow, which append to the
+ * calling thread's own pending text for this stream.
+ */
+class AsyncBuf : public streambuf {
+public:
+    AsyncBuf(Logger *logger, streambuf *target)
+        : logger(logger), target(target) {}
+
+    void lock();
+    void unlock();
+
+    // Publishes the calling thread's pending text for this stream.
+    void publish(string& text);
+
+    Logger *logger;
+
+    // The stream's original buffer; only the writer thread uses it.
+    streambuf *target;
+
+protected:
+    int_type overflow(int_type c) override;
+    streamsize xsputn(const char *s, streamsize n) override;
+    int sync() override;
+
+private:
+    // Returns null once the calling thread's pending text has been
+    // destroyed at exit; output is then published immediately.
+    Pending *pending();
+};
+
+// All of one thread's pending text. Whatever is left when the thread
+// exits is published, so a final line without a newline isn't lost.
+struct ThreadPending {
+    ThreadPending();
+    ~ThreadPending();
+
+    void publish_all()
+    {
+        for (Pending& p : streams) {
+            p.buf->publish(p.text);
+        }
+    }
+
+    vector<Pending> streams;
+};
+
+thread_local ThreadPending threadPending;
+
+// Points to threadPending while it is alive. It is trivially
+// destructible, so it can still be checked after threadPending has been
+// destroyed (a stream may be flushed by static destructors at exit).
+thread_local ThreadPending *livePending = nullptr;
+thread_local bool pendingDestroyed = false;
+
+ThreadPending::ThreadPending()
+{
+    livePending = this;
+}
+
+ThreadPending::~ThreadPending()
+{
+    publish_all();
+    livePending = nullptr;
+    pendingDestroyed = true;
+}
+
+atomic<Logger *> logger;
+once_flag loggerOnce;
+
+// Serializes installing AsyncBufs into streams.
+mutex installMutex;
+
+Logger::Logger()
+    : policy(OsOverflowPolicy::Block)
+    , enqueuePos_(0)
+    , dequeuePos_(0)
+    , writtenPos_(0)
+    , dropped_(0)
+    , sleeping_(false)
+    , stopping_(false)
+    , direct_(false)
+{
+    for (size_t i = 0; i < NUM_SLOTS; i++) {
+        ring_[i].seq.store(i, memory_order_relaxed);
+    }
+    const char *env = getenv("OSLOCK_OVERFLOW");
+    if (env != nullptr && strcmp(env, "drop") == 0) {
+        policy = OsOverflowPolicy::Drop;
+    }
+    writer_ = thread([this] { drain(); });
+    atexit([] { logger.load()->shutdown(); });
+}
+
+bool Logger::publish(AsyncBuf *target, const char *data, size_t length)
+{
+    if (length == 0) {
+        return true;
+    }
+    if (direct_.load(memory_order_acquire)) {
+        lock_guard<mutex> lock(directMutex_);
+        target->target->sputn(data, length);
+        target->target->pubsync();
+        return true;
+    }
+
+    size_t slots = (length + PAYLOAD_BYTES - 1) / PAYLOAD_BYTES;
+    if (slots > MAX_RECORD_SLOTS) {
+        slots = MAX_RECORD_SLOTS;
+        length = slots * PAYLOAD_BYTES;
+    }
+
+    // Reserve slots consecutive positions. The writer frees slots in
+    // order, so if the last one is free for us, all of them are.
+    uint64_t pos = enqueuePos_.load(memory_order_relaxed);
+    while (true) {
+        Slot& last = ring_[(pos + slots - 1) % NUM_SLOTS];
+        int64_t diff = static_cast<int64_t>(
+                last.seq.load(memory_order_acquire) - (pos + slots - 1));
+        if (diff == 0) {
+            if (enqueuePos_.compare_exchange_weak(pos, pos + slots,
+                    memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Ring full.
+            if (policy.load(memory_order_relaxed) == OsOverflowPolicy::Drop) {
+                dropped_.fetch_add(1, memory_order_relaxed);
+                return false;
+            }
+            wake_writer();
+            this_thread::yield();
+            pos = enqueuePos_.load(memory_order_relaxed);
+        } else {
+            pos = enqueuePos_.load(memory_order_relaxed);
+        }
+    }
+
+    for (size_t i = 0; i < slots; i++) {
+        Slot& slot = ring_[(pos + i) % NUM_SLOTS];
+        size_t n = min(length, PAYLOAD_BYTES);
+        memcpy(slot.data, data, n);
+        slot.length = n;
+        slot.target = target;
+        slot.slots = i == 0 ? slots : 0;
+        slot.seq.store(pos + i + 1, memory_order_release);
+        data += n;
+        length -= n;
+    }
+    if (sleeping_.load()) {
+        wake_writer();
+    }
+    return true;
+}
+
+void Logger::wake_writer()
+{
+    lock_guard<mutex> lock(sleepMutex_);
+    wakeup_.notify_one();
+}
+
+// Writes out the record at dequeuePos_, if it has been published.
+bool Logger::drain_one()
+{
+    Slot& first = ring_[dequeuePos_ % NUM_SLOTS];
+    if (first.seq.load(memory_order_acquire) != dequeuePos_ + 1) {
+        return false;
+    }
+
+    report_drops();
+
+    size_t slots = first.slots;
+    for (size_t i = 0; i < slots; i++) {
+        uint64_t pos = dequeuePos_ + i;
+        Slot& slot = ring_[pos % NUM_SLOTS];
+
+        // The producer reserved all slots at once but may still be
+        // filling in the later ones.
+        while (slot.seq.load(memory_order_acquire) != pos + 1) {
+            this_thread::yield();
+        }
+        first.target->target->sputn(slot.data, slot.length);
+    }
+    if (find(dirty_.begin(), dirty_.end(), first.target) == dirty_.end()) {
+        dirty_.push_back(first.target);
+    }
+    for (size_t i = 0; i < slots; i++) {
+        uint64_t pos = dequeuePos_ + i;
+        ring_[pos % NUM_SLOTS].seq.store(pos + NUM_SLOTS,
+                memory_order_release);
+    }
+    dequeuePos_ += slots;
+
+    // Flush when the ring is momentarily empty, or every so often under
+    // sustained load, rather than after every record.
+    if (ring_[dequeuePos_ % NUM_SLOTS].seq.load(memory_order_acquire)
+            != dequeuePos_ + 1
+            || dequeuePos_ - writtenPos_.load(memory_order_relaxed) >= 64) {
+        for (AsyncBuf *buf : dirty_) {
+            buf->target->pubsync();
+        }
+        dirty_.clear();
+        writtenPos_.store(dequeuePos_, memory_order_release);
+    }
+    return true;
+}
+
+// Notes any records dropped since the last call on stderr. The drops
+// may have been meant for any stream, so the note doesn't go to the
+// stream of whichever record comes next; it is written straight to the
+// file, bypassing cerr and any AsyncBuf installed there.
+void Logger::report_drops()
+{
+    uint64_t dropped = dropped_.exchange(0, memory_order_relaxed);
+    if (dropped > 0) {
+        fprintf(stderr, "[oslock: %llu records dropped]\n",
+                static_cast<unsigned long long>(dropped));
+    }
+}
+
+void Logger::drain()
+{
+    while (true) {
+        if (drain_one()) {
+            continue;
+        }
+        report_drops();
+        if (stopping_.load()) {
+            break;
+        }
+        unique_lock<mutex> lock(sleepMutex_);
+        sleeping_.store(true);
+        if (ring_[dequeuePos_ % NUM_SLOTS].seq.load() != dequeuePos_ + 1
+                && !stopping_.load()) {
+            // The timeout covers a producer that published between our
+            // check and its read of sleeping_.
+            wakeup_.wait_for(lock, chrono::milliseconds(10));
+        }
+        sleeping_.store(false);
+    }
+}
+
+void Logger::flush()
+{
+    uint64_t target = enqueuePos_.load();
+    while (writtenPos_.load(memory_order_acquire) < target
+            && !direct_.load()) {
+        wake_writer();
+        this_thread::sleep_for(chrono::microseconds(50));
+    }
+}
+
+void Logger::shutdown()
+{
+    // exit() destroys only the calling thread's thread_locals, and may
+    // already have done so.
+    if (livePending != nullptr) {
+        livePending->publish_all();
+    }
+    stopping_.store(true);
+    wake_writer();
+    writer_.join();
+
+    // Records reserved but not yet published by other threads are
+    // abandoned; anything published from now on is written directly.
+    direct_.store(true, memory_order_release);
+}
+
+Pending *AsyncBuf::pending()
+{
+    if (pendingDestroyed) {
+        return nullptr;
+    }
+    for (Pending& p : threadPending.streams) {
+        if (p.buf == this) {
+            return &p;
+        }
+    }
+    threadPending.streams.push_back({this, string(), 0});
+    return &threadPending.streams.back();
+}
+
+void AsyncBuf::lock()
+{
+    Pending *p = pending();
+    if (p != nullptr) {
+        p->depth++;
+    }
+}
+
+void AsyncBuf::unlock()
+{
+    Pending *p = pending();
+    if (p != nullptr && p->depth > 0 && --p->depth == 0) {
+        publish(p->text);
+    }
+}
+
+void AsyncBuf::publish(string& text)
+{
+    logger->publish(this, text.data(), text.size());
+    text.clear();
+}
+
+AsyncBuf::int_type AsyncBuf::overflow(int_type c)
+{
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+        return traits_type::not_eof(c);
+    }
+    char ch = traits_type::to_char_type(c);
+    Pending *p = pending();
+    if (p == nullptr) {
+        logger->publish(this, &ch, 1);
+        return c;
+    }
+    p->text.push_back(ch);
+    if (p->depth == 0 && ch == '\n') {
+        publish(p->text);
+    }
+    return c;
+}
+
+streamsize AsyncBuf::xsputn(const char *s, streamsize n)
+{
+    Pending *p = pending();
+    if (p == nullptr) {
+        logger->publish(this, s, n);
+        return n;
+    }
+    p->text.append(s, n);
+    if (p->depth == 0 && memchr(s, '\n', n) != nullptr) {
+        publish(p->text);
+    }
+    return n;
+}
+
+int AsyncBuf::sync()
+{
+    Pending *p = pending();
+    if (p != nullptr && p->depth == 0) {
+        publish(p->text);
+    }
+    return 0;
+}
+
+// Streams that have an AsyncBuf installed. The table is searched without
+// a lock; publishing an entry with a release store makes the install
+// (which writes the stream's rdbuf pointer) visible to every thread that
+// later finds the entry.
+const int MAX_STREAMS = 16;
+struct Installed {
+    const ostream *stream;
+    AsyncBuf *buf;
+};
+Installed installed[MAX_STREAMS];
+atomic<int> numInstalled;
+
+// Returns the AsyncBuf for os, installing one if necessary.
+AsyncBuf *async_buf(ostream& os)
+{
+    int n = numInstalled.load(memory_order_acquire);
+    for (int i = 0; i < n; i++) {
+        if (installed[i].stream == &os) {
+            return installed[i].buf;
+        }
+    }
+    call_once(loggerOnce, [] { logger = new Logger(); });
+    lock_guard<mutex> lock(installMutex);
+    AsyncBuf *buf = dynamic_cast<AsyncBuf *>(os.rdbuf());
+    if (buf == nullptr) {
+        // Never deleted: the stream may be used until the very end.
+        buf = new AsyncBuf(logger.load(), os.rdbuf());
+        os.rdbuf(buf);
+        n = numInstalled.load(memory_order_relaxed);
+        if (n < MAX_STREAMS) {
+            installed[n] = {&os, buf};
+            numInstalled.store(n + 1, memory_order_release);
+        }
+    }
+    return buf;
+}
+
+} // namespace
+
+ostream& oslock(ostream& os)
+{
+    async_buf(os)->lock();
+    return os;
+}
+
+ostream& osunlock(ostream& os)
+{
+    AsyncBuf *buf = dynamic_cast<AsyncBuf *>(os.rdbuf());
+    if (buf != nullptr) {
+        buf->unlock();
+    }
+    return os;
+}
+
+void oslock_set_overflow_policy(OsOverflowPolicy policy)
+{
+    call_once(loggerOnce, [] { logger = new Logger(); });
+    logger.load()->policy = policy;
+}
+
+size_t oslock_max_record_bytes()
+{
+    return MAX_RECORD_SLOTS * PAYLOAD_BYTES;
+}
+
+void oslock_flush()
+{
+    Logger *l = logger.load();
+    if (l != nullptr) {
+        l->flush();
+    }
+}
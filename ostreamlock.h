@@ -6,9 +6,51 @@
  *
  *   Thread safe: cout << oslock << 1 << 2 << 3 << 4 << endl << osunlock;
  *   Not thread safe: cout << 1 << 2 << 3 << 4 << endl;
+ *
+ * The first oslock on a stream replaces its buffer with an asynchronous
+ * one: text inserted between oslock and osunlock is collected in a
+ * per-thread buffer and published at osunlock as a single record into a
+ * lock-free ring, and a background thread writes records to the original
+ * stream buffer in order. Inserting into the stream never waits for the
+ * underlying device, and no thread ever blocks another while formatting.
+ * Text inserted without oslock is published a line at a time.
+ *
+ * This applies to cerr too: once cerr has been used with oslock, error
+ * output is no longer written synchronously, but when the writer thread
+ * gets to it. Call oslock_flush() where it must be out at once, such as
+ * before abort().
  */
 
+#ifndef _ostreamlock_
+#define _ostreamlock_
+
+#include <cstddef>
 #include <ostream>
 
 std::ostream& oslock(std::ostream& os);
 std::ostream& osunlock(std::ostream& os);
+
+/**
+ * What happens when a record is published while the ring is full:
+ * Block waits (yielding the processor) until the writer thread frees
+ * space, so no output is lost; Drop discards the record and the writer
+ * later writes a note saying how many records were dropped straight to
+ * stderr, whichever streams they were meant for. The default is Block,
+ * or Drop if the environment variable OSLOCK_OVERFLOW is set to "drop".
+ * Records longer than oslock_max_record_bytes() are truncated under
+ * either policy, so memory use is bounded.
+ */
+enum class OsOverflowPolicy { Block, Drop };
+void oslock_set_overflow_policy(OsOverflowPolicy policy);
+std::size_t oslock_max_record_bytes();
+
+/**
+ * Function: oslock_flush
+ * Usage: oslock_flush();
+ * ----------------------
+ * Waits until every record published so far (by any thread) has been
+ * written to its stream. Output is also flushed automatically at exit.
+ */
+void oslock_flush();
+
+#endif
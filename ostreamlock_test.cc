@@ -0,0 +1,318 @@
+/*
+ * This file tests the asynchronous oslock/osunlock logger in
+ * ostreamlock.cc: that records stay whole however many threads publish
+ * them, what each overflow policy does when the ring is full, that long
+ * records are truncated, and that records still pending at exit are
+ * written. Every test writes to a stream of its own, whose original
+ * buffer it then inspects, so the results aren't mixed with the test's
+ * own report on cout.
+ *
+ * Usage: ostreamlock_test TEST
+ */
+
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ostreamlock.h"
+
+using namespace std;
+
+/**
+ * Class: GatedBuf
+ * ---------------
+ * A string buffer whose writes wait until the gate is opened, so a test
+ * can hold up the logger's writer thread and let the ring fill.
+ */
+class GatedBuf : public stringbuf {
+public:
+    void open()
+    {
+        lock_guard<mutex> lock(mutex_);
+        open_ = true;
+        opened_.notify_all();
+    }
+
+protected:
+    streamsize xsputn(const char *s, streamsize n) override
+    {
+        unique_lock<mutex> lock(mutex_);
+        opened_.wait(lock, [this] { return open_; });
+        return stringbuf::xsputn(s, n);
+    }
+
+private:
+    mutex mutex_;
+    condition_variable opened_;
+    bool open_ = false;
+};
+
+// Splits text into lines, without their newlines; text after the last
+// newline is dropped.
+static vector<string> lines_of(const string& text)
+{
+    vector<string> lines;
+    size_t start = 0;
+    size_t end;
+    while ((end = text.find('\n', start)) != string::npos) {
+        lines.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    return lines;
+}
+
+// The payload of record i from thread t: up to three ring slots of one
+// letter, so a record torn apart or interleaved with another shows.
+static string payload(int t, int i)
+{
+    return string((i * 37) % 1500, 'a' + t);
+}
+
+void many_threads()
+{
+    // Threads that each publish records built from many insertions;
+    // every record must come out whole, on a line of its own, and each
+    // thread's records in the order it published them.
+    const int NUM_THREADS = 8;
+    const int NUM_RECORDS = 500;
+    stringbuf sink;
+    ostream os(&sink);
+
+    vector<thread> threads;
+    for (int t = 0; t < NUM_THREADS; t++) {
+        threads.emplace_back([&os, t] {
+            for (int i = 0; i < NUM_RECORDS; i++) {
+                string text = payload(t, i);
+                os << oslock << t << ':' << i << ':';
+                for (size_t pos = 0; pos < text.size(); pos += 100) {
+                    os << text.substr(pos, 100);
+                }
+                os << endl << osunlock;
+            }
+        });
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+    oslock_flush();
+
+    vector<string> lines = lines_of(sink.str());
+    if (lines.size() != NUM_THREADS * NUM_RECORDS) {
+        cout << "Error: expected " << NUM_THREADS * NUM_RECORDS
+             << " records, got " << lines.size() << endl;
+    }
+    vector<int> next(NUM_THREADS, 0);
+    for (const string& line : lines) {
+        int t = -1;
+        int i = -1;
+        istringstream in(line);
+        char colon1 = 0;
+        char colon2 = 0;
+        in >> t >> colon1 >> i >> colon2;
+        string rest;
+        getline(in, rest);
+        if (colon1 != ':' || colon2 != ':' || t < 0 || t >= NUM_THREADS
+                || rest != payload(t, i)) {
+            cout << "Error: torn or interleaved record: "
+                 << line.substr(0, 60) << endl;
+            return;
+        }
+        if (i != next[t]) {
+            cout << "Error: thread " << t << " record " << i
+                 << " came out when record " << next[t]
+                 << " was expected" << endl;
+            return;
+        }
+        next[t]++;
+    }
+    cout << lines.size() << " records from " << NUM_THREADS
+         << " threads came out whole" << endl;
+}
+
+void drop_overflow()
+{
+    // With the writer held up on its first record, the ring fills; under
+    // Drop the records that don't fit are discarded at once, and once the
+    // writer runs again it notes how many on stderr, not on the stream
+    // they were meant for. Written and dropped records must add up to
+    // those published.
+    const int NUM_RECORDS = 3000;
+    char errPath[] = "/tmp/ostreamlock_test.XXXXXX";
+    int errFd = mkstemp(errPath);
+    if (errFd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(errPath);
+    int savedErr = dup(STDERR_FILENO);
+    dup2(errFd, STDERR_FILENO);
+
+    oslock_set_overflow_policy(OsOverflowPolicy::Drop);
+    GatedBuf sink;
+    ostream os(&sink);
+    for (int i = 0; i < NUM_RECORDS; i++) {
+        os << oslock << "record " << i << endl << osunlock;
+    }
+    sink.open();
+    oslock_flush();
+    oslock_set_overflow_policy(OsOverflowPolicy::Block);
+    dup2(savedErr, STDERR_FILENO);
+    close(savedErr);
+
+    int written = 0;
+    for (const string& line : lines_of(sink.str())) {
+        if (line.rfind("record ", 0) == 0) {
+            written++;
+        } else {
+            cout << "Error: unexpected output: " << line << endl;
+        }
+    }
+    string errors;
+    char buffer[4096];
+    ssize_t n;
+    lseek(errFd, 0, SEEK_SET);
+    while ((n = read(errFd, buffer, sizeof(buffer))) > 0) {
+        errors.append(buffer, n);
+    }
+    close(errFd);
+    int dropped = 0;
+    int notes = 0;
+    for (const string& line : lines_of(errors)) {
+        int count;
+        if (sscanf(line.c_str(), "[oslock: %d records dropped]",
+                &count) == 1) {
+            dropped += count;
+            notes++;
+        } else {
+            cout << "Error: unexpected error output: " << line << endl;
+        }
+    }
+    cout << written << " records written, " << dropped << " dropped, in "
+         << notes << " notes" << endl;
+    if (dropped == 0 || notes == 0) {
+        cout << "Error: expected records to be dropped with a note" << endl;
+    }
+    if (written + dropped != NUM_RECORDS) {
+        cout << "Error: " << written << " written and " << dropped
+             << " dropped, but " << NUM_RECORDS << " published" << endl;
+    }
+}
+
+void truncation()
+{
+    // A record longer than oslock_max_record_bytes() keeps only its
+    // first oslock_max_record_bytes() bytes; the next record follows it
+    // intact.
+    size_t max = oslock_max_record_bytes();
+    string record;
+    for (size_t i = 0; i < max + 1000; i++) {
+        record.push_back('a' + i % 26);
+    }
+    stringbuf sink;
+    ostream os(&sink);
+    os << oslock << record << osunlock;
+    os << oslock << "next record" << endl << osunlock;
+    oslock_flush();
+
+    string expected = record.substr(0, max) + "next record\n";
+    if (sink.str() != expected) {
+        cout << "Error: expected " << expected.size() << " bytes, got "
+             << sink.str().size() << endl;
+        return;
+    }
+    cout << "A " << record.size() << "-byte record was truncated to "
+         << max << " bytes" << endl;
+}
+
+void exit_flush()
+{
+    // A child process publishes records to stdout, a pipe, and leaves a
+    // final line unterminated, then exits at once without oslock_flush;
+    // everything must still reach the pipe.
+    const int NUM_RECORDS = 2000;
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        for (int i = 0; i < NUM_RECORDS; i++) {
+            cout << oslock << "record " << i << endl << osunlock;
+        }
+        cout << "last line";
+        exit(0);
+    }
+    close(fds[1]);
+    string output;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        output.append(buffer, n);
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cout << "Error: the child process failed" << endl;
+    }
+
+    vector<string> lines = lines_of(output);
+    int expected = 0;
+    for (const string& line : lines) {
+        if (line != "record " + to_string(expected)) {
+            cout << "Error: expected record " << expected << ", got "
+                 << line << endl;
+            return;
+        }
+        expected++;
+    }
+    if (expected != NUM_RECORDS) {
+        cout << "Error: only " << expected << " of " << NUM_RECORDS
+             << " records were written before exit" << endl;
+    }
+    if (output.size() < 9
+            || output.compare(output.size() - 9, 9, "last line") != 0) {
+        cout << "Error: the unterminated last line was lost" << endl;
+    }
+    cout << expected << " records and the last line were written at exit"
+         << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    map<string, void (*)()> tests;
+    tests["many_threads"] = many_threads;
+    tests["drop_overflow"] = drop_overflow;
+    tests["truncation"] = truncation;
+    tests["exit_flush"] = exit_flush;
+
+    if (argc == 1) {
+        cout << "Available tests are:" << endl;
+        for (auto& t : tests) {
+            cout << "\t" << t.first << endl;
+        }
+        return 0;
+    }
+    auto test = tests.find(argv[1]);
+    if (test == tests.end()) {
+        cout << "No test named '" << argv[1] << "'" << endl;
+        return 1;
+    }
+    test->second();
+    return 0;
+}
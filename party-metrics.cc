@@ -0,0 +1,140 @@
+// This file contains the implementation of the PartyMetrics methods.
+
+#include "party-metrics.hh"
+
+#ifdef PARTY_METRICS
+
+#include <iomanip>
+
+using namespace std;
+
+// Returns the histogram bucket for a latency: floor(log2(ns)).
+static int bucket_for(uint64_t ns)
+{
+    int bucket = 0;
+    while (ns > 1 && bucket < PartyMetrics::NUM_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+PartyMetrics::PartyMetrics()
+{
+    for (int i = 0; i < NUM_SIGNS; i++) {
+        for (int j = 0; j < NUM_SIGNS; j++) {
+            waiting_[i][j] = 0;
+            matches_[i][j] = 0;
+            latencyNs_[i][j] = 0;
+            for (int b = 0; b < NUM_BUCKETS; b++) {
+                latency_[i][j][b] = 0;
+            }
+        }
+    }
+    lockAcquisitions_ = 0;
+    lockContended_ = 0;
+    lockWaitNs_ = 0;
+    lockRelocks_ = 0;
+}
+
+void PartyMetrics::matched(int my_sign, int other_sign, time_point arrival)
+{
+    uint64_t ns = elapsed_ns(arrival);
+    latency_[my_sign][other_sign][bucket_for(ns)].fetch_add(1,
+            memory_order_relaxed);
+    matches_[my_sign][other_sign].fetch_add(1, memory_order_relaxed);
+    latencyNs_[my_sign][other_sign].fetch_add(ns, memory_order_relaxed);
+}
+
+PartyMetrics::Snapshot PartyMetrics::snapshot() const
+{
+    Snapshot s;
+    for (int i = 0; i < NUM_SIGNS; i++) {
+        for (int j = 0; j < NUM_SIGNS; j++) {
+            s.waiting[i][j] = waiting_[i][j].load(memory_order_relaxed);
+            s.matches[i][j] = matches_[i][j].load(memory_order_relaxed);
+            s.latencyNs[i][j] = latencyNs_[i][j].load(memory_order_relaxed);
+            for (int b = 0; b < NUM_BUCKETS; b++) {
+                s.latency[i][j][b] =
+                        latency_[i][j][b].load(memory_order_relaxed);
+            }
+        }
+    }
+    s.lockAcquisitions = lockAcquisitions_.load(memory_order_relaxed);
+    s.lockContended = lockContended_.load(memory_order_relaxed);
+    s.lockWaitNs = lockWaitNs_.load(memory_order_relaxed);
+    s.lockRelocks = lockRelocks_.load(memory_order_relaxed);
+    return s;
+}
+
+uint64_t PartyMetrics::Snapshot::percentile(int my_sign, int other_sign,
+        double pct) const
+{
+    const uint64_t *hist = latency[my_sign][other_sign];
+    uint64_t total = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+        total += hist[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    // Smallest bucket whose cumulative count reaches the target rank.
+    uint64_t rank = static_cast<uint64_t>(pct / 100.0 * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank) {
+            return (uint64_t(2) << b) - 1;
+        }
+    }
+    return (uint64_t(2) << (NUM_BUCKETS - 1)) - 1;
+}
+
+void PartyMetrics::print_heatmap(ostream& os) const
+{
+    Snapshot s = snapshot();
+    os << "waiting guests (row: my_sign, column: other_sign)" << endl;
+    os << "    ";
+    for (int j = 0; j < NUM_SIGNS; j++) {
+        os << setw(5) << j;
+    }
+    os << endl;
+    for (int i = 0; i < NUM_SIGNS; i++) {
+        os << setw(4) << i;
+        for (int j = 0; j < NUM_SIGNS; j++) {
+            os << setw(5) << s.waiting[i][j];
+        }
+        os << endl;
+    }
+}
+
+void PartyMetrics::print_report(ostream& os) const
+{
+    Snapshot s = snapshot();
+    os << "lock: " << s.lockAcquisitions << " acquisitions, "
+       << s.lockContended << " contended, " << s.lockWaitNs
+       << " ns waiting, " << s.lockRelocks << " relocks on waking"
+       << endl;
+    os << "pair     matches   mean_ns    p50_ns    p99_ns   waiting" << endl;
+    for (int i = 0; i < NUM_SIGNS; i++) {
+        for (int j = 0; j < NUM_SIGNS; j++) {
+            if (s.matches[i][j] == 0 && s.waiting[i][j] == 0) {
+                continue;
+            }
+            uint64_t mean = s.matches[i][j]
+                    ? s.latencyNs[i][j] / s.matches[i][j] : 0;
+            os << setw(2) << i << "->" << setw(2) << j
+               << setw(12) << s.matches[i][j]
+               << setw(10) << mean
+               << setw(10) << s.percentile(i, j, 50)
+               << setw(10) << s.percentile(i, j, 99)
+               << setw(10) << s.waiting[i][j] << endl;
+        }
+    }
+}
+
+#endif /* PARTY_METRICS */
@@ -0,0 +1,152 @@
+// This file defines the optional metrics layer for Party: gauges for the
+// number of guests waiting on each sign pair, per-pair histograms of how
+// long guests wait for a match, and counters for contention on the
+// matching lock. All values are relaxed atomics, so another thread can
+// read them at any time without taking the Party's lock.
+//
+// The layer is compiled in only when PARTY_METRICS is defined (build with
+// "make PARTY_METRICS=1"). Otherwise PartyMetrics is an empty class whose
+// hooks are empty inline functions, so Party pays nothing for it.
+
+#ifndef PARTY_METRICS_H
+#define PARTY_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#include "zodiac.hh"
+
+#ifdef PARTY_METRICS
+
+class PartyMetrics {
+public:
+    // Match latencies are kept in power-of-two nanosecond buckets:
+    // bucket i holds latencies in [2^i, 2^(i+1)) ns (bucket 0 also
+    // holds 0). 40 buckets reach about 18 minutes.
+    static const int NUM_BUCKETS = 40;
+
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    // A copy of all metrics at one moment. Individual values are read
+    // independently, so a snapshot taken while guests are arriving may
+    // be slightly inconsistent across pairs.
+    struct Snapshot {
+        // waiting[a][b] is the number of guests with sign a waiting
+        // for a guest with sign b.
+        int waiting[NUM_SIGNS][NUM_SIGNS];
+
+        // Match latency histograms, indexed by [my_sign][other_sign].
+        uint64_t latency[NUM_SIGNS][NUM_SIGNS][NUM_BUCKETS];
+        uint64_t matches[NUM_SIGNS][NUM_SIGNS];
+        uint64_t latencyNs[NUM_SIGNS][NUM_SIGNS];
+
+        // Acquisitions of the matching lock on arrival, how many of them
+        // found the lock held, and the total time spent waiting for it.
+        uint64_t lockAcquisitions;
+        uint64_t lockContended;
+        uint64_t lockWaitNs;
+
+        // Reacquisitions of the matching lock by waiting guests' condition
+        // variables on waking. These happen inside the wait policy, so
+        // they are counted but not timed, and their contention is not
+        // known.
+        uint64_t lockRelocks;
+
+        // Returns an upper bound (in ns) on the given percentile
+        // (0-100) of match latency for one sign pair, or 0 if no guest
+        // with that pair has matched yet.
+        uint64_t percentile(int my_sign, int other_sign, double pct) const;
+    };
+
+    PartyMetrics();
+
+    static time_point now() { return std::chrono::steady_clock::now(); }
+
+    // Acquires lock (a std::unique_lock constructed with defer_lock),
+    // counting the acquisition and timing it if it is contended. Only a
+    // guest's first acquisition goes through here; see relocked().
+    template <typename Lock>
+    void lock(Lock& lock)
+    {
+        lockAcquisitions_.fetch_add(1, std::memory_order_relaxed);
+        if (lock.try_lock()) {
+            return;
+        }
+        time_point start = now();
+        lock.lock();
+        lockContended_.fetch_add(1, std::memory_order_relaxed);
+        lockWaitNs_.fetch_add(elapsed_ns(start), std::memory_order_relaxed);
+    }
+
+    // Invoked when a guest's wait on its condition variable returns,
+    // having reacquired the lock.
+    void relocked()
+    {
+        lockRelocks_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Invoked when a guest starts waiting on guestsWaiting[my][other]
+    // and when one is taken off that queue.
+    void enqueued(int my_sign, int other_sign)
+    {
+        waiting_[my_sign][other_sign].fetch_add(1, std::memory_order_relaxed);
+    }
+    void dequeued(int my_sign, int other_sign)
+    {
+        waiting_[my_sign][other_sign].fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Invoked when a guest who arrived at the given time has been matched.
+    void matched(int my_sign, int other_sign, time_point arrival);
+
+    Snapshot snapshot() const;
+
+    // Prints the current waiting counts as a NUM_SIGNS x NUM_SIGNS grid
+    // (rows are my_sign, columns other_sign).
+    void print_heatmap(std::ostream& os) const;
+
+    // Prints lock counters and per-pair latency percentiles for every
+    // pair that has matched at least once.
+    void print_report(std::ostream& os) const;
+
+private:
+    static uint64_t elapsed_ns(time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now() - start).count();
+    }
+
+    std::atomic<int> waiting_[NUM_SIGNS][NUM_SIGNS];
+    std::atomic<uint64_t> latency_[NUM_SIGNS][NUM_SIGNS][NUM_BUCKETS];
+    std::atomic<uint64_t> matches_[NUM_SIGNS][NUM_SIGNS];
+    std::atomic<uint64_t> latencyNs_[NUM_SIGNS][NUM_SIGNS];
+    std::atomic<uint64_t> lockAcquisitions_;
+    std::atomic<uint64_t> lockContended_;
+    std::atomic<uint64_t> lockWaitNs_;
+    std::atomic<uint64_t> lockRelocks_;
+};
+
+#else /* PARTY_METRICS */
+
+// Metrics disabled: same hooks, no state, no code.
+class PartyMetrics {
+public:
+    struct time_point {};
+
+    static time_point now() { return time_point(); }
+
+    template <typename Lock>
+    void lock(Lock& lock) { lock.lock(); }
+
+    void relocked() {}
+
+    void enqueued(int, int) {}
+    void dequeued(int, int) {}
+    void matched(int, int, time_point) {}
+};
+
+#endif /* PARTY_METRICS */
+
+#endif /* PARTY_METRICS_H */
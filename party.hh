@@ -1,18 +1,37 @@
 // This class represents one party, which is capable of matching guests
 // according to their zodiac signs.
+//
+// Like Station, the party is a template on a lock policy and a wait policy
+// (see sync-policies.hh); Party uses the standard mutex and condition
+// variable.
+//
+// The number of guests waiting for each sign pair can be capped (see
+// admission.hh); SHED_OLDEST sheds the longest-waiting try_meet caller
+// with the arriving guest's own pair of signs.
 
 #ifndef PARTY_H
 #define PARTY_H
 
 #include <condition_variable>
+#include <deque>
 #include <mutex>
-#include <queue>
+#include <optional>
+#include <string>
 
-// The total number of Zodiac signs
-static const int NUM_SIGNS = 12;
+#include "admission.hh"
+#include "event-trace.hh"
+#include "party-metrics.hh"
+#include "sync-policies.hh"
+#include "zodiac.hh"
 
-class Party {
+template <typename LockPolicy = std::mutex,
+          typename WaitPolicy = std::condition_variable_any>
+class BasicParty {
 public:
+    // A party admitting guests as given by admission, whose cap applies
+    // to each (my_sign, other_sign) pair separately.
+    explicit BasicParty(Admission admission = Admission());
+
     // Invoked by newly arriving guests; my_name is the guest's name,
     // my_sign is the guest's Zodiac sign, and other_sign is the sign
     // of another guest that this guest would like to meet. Returns
@@ -21,9 +40,27 @@ public:
     // other guest).
     std::string meet(std::string &my_name, int my_sign, int other_sign);
 
+    // Like meet, but if the cap on guests waiting with these signs has
+    // been reached, the Overload policy applies: returns no name if the
+    // guest was rejected or later shed.
+    std::optional<std::string> try_meet(std::string &my_name, int my_sign,
+            int other_sign);
+
+    // Returns this party's metrics; safe to read from any thread without
+    // holding the matching lock. Empty unless built with PARTY_METRICS.
+    const PartyMetrics& metrics() const { return metrics_; }
+
+    // Returns what the wait policy has learned from guests waiting with
+    // these signs; see WaitStats.
+    const typename WaitStats<WaitPolicy>::type& wait_stats(int my_sign,
+            int other_sign) const
+    {
+        return waitStats_[my_sign][other_sign];
+    }
+
 private:
     // Synchronizes access to this structure.
-    std::mutex mutex_;
+    LockPolicy mutex_;
 
     typedef struct Guest {
         std::string name;
@@ -33,10 +70,154 @@ private:
         bool *isMatched;
 
         // condition variables can't be copied, so use ptr
-        std::condition_variable_any *match_found;
+        WaitPolicy *match_found;
+
+        // Set to shed the guest; null if it came through meet, which
+        // cannot be shed.
+        bool *shed;
     } Guest;
 
-    std::queue<Guest> guestsWaiting[NUM_SIGNS][NUM_SIGNS];
+    // Matches a guest once admitted; returns no name if the guest was
+    // shed instead.
+    std::optional<std::string> meet_admitted(std::string &my_name,
+            int my_sign, int other_sign, bool sheddable);
+
+    // Sheds the oldest sheddable guest waiting with these signs, whose
+    // admission then passes to the caller; returns false if there is
+    // none.
+    bool shed_oldest(int my_sign, int other_sign);
+
+    std::deque<Guest> guestsWaiting[NUM_SIGNS][NUM_SIGNS];
+
+    Overload overload_;
+    // One count per sign pair, at my_sign * NUM_SIGNS + other_sign.
+    BasicAdmissionGate<LockPolicy, WaitPolicy> gate_;
+
+    // Each guest waits on its own condition variable, so what the wait
+    // policy learns is kept here, to carry over to the next guest.
+    typename WaitStats<WaitPolicy>::type waitStats_[NUM_SIGNS][NUM_SIGNS];
+
+    // Updated without mutex_ so readers never contend with meet.
+    [[no_unique_address]] PartyMetrics metrics_;
 };
 
+typedef BasicParty<> Party;
+
+template <typename LockPolicy, typename WaitPolicy>
+BasicParty<LockPolicy, WaitPolicy>::BasicParty(Admission admission)
+    : overload_(admission.overload)
+    , gate_(NUM_SIGNS * NUM_SIGNS)
+{
+    gate_.set_cap(admission.cap);
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+std::string BasicParty<LockPolicy, WaitPolicy>::meet(std::string &my_name,
+        int my_sign, int other_sign)
+{
+    gate_.enter(my_sign * NUM_SIGNS + other_sign);
+    return *meet_admitted(my_name, my_sign, other_sign, false);
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+std::optional<std::string> BasicParty<LockPolicy, WaitPolicy>::try_meet(
+        std::string &my_name, int my_sign, int other_sign)
+{
+    int pair = my_sign * NUM_SIGNS + other_sign;
+    if (overload_ == Overload::BLOCK) {
+        gate_.enter(pair);
+    } else if (!gate_.try_enter(pair)) {
+        if (overload_ == Overload::REJECT
+                || !shed_oldest(my_sign, other_sign)) {
+            return std::nullopt;
+        }
+    }
+    return meet_admitted(my_name, my_sign, other_sign, true);
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+std::optional<std::string>
+BasicParty<LockPolicy, WaitPolicy>::meet_admitted(std::string &my_name,
+        int my_sign, int other_sign, bool sheddable)
+{
+    trace_event(TRACE_GUEST_ARRIVE, this, my_sign << 8 | other_sign);
+    PartyMetrics::time_point arrival = PartyMetrics::now();
+    std::unique_lock<LockPolicy> lock(mutex_, std::defer_lock);
+    metrics_.lock(lock);
+
+    // initialize guest struct for my_name
+    std::string match_name = "";
+    bool status = false;
+    WaitPolicy cv_ = make_wait_policy<WaitPolicy>(
+            waitStats_[my_sign][other_sign]);
+    bool shed = false;
+    Guest my = {my_name, &match_name, &status, &cv_,
+            sheddable ? &shed : nullptr};
+
+    // take match off queue if available
+    std::deque<Guest> *matchQueue = &guestsWaiting[other_sign][my_sign];
+    if (!matchQueue->empty()) {
+        Guest other_guest = matchQueue->front();
+        matchQueue->pop_front();
+        metrics_.dequeued(other_sign, my_sign);
+
+        // update match with other guest's name
+        *my.match = other_guest.name;
+        *my.isMatched = true;
+
+        // update guest's match with my_name
+        *other_guest.match = my_name;
+        *other_guest.isMatched = true;
+        other_guest.match_found->notify_all();
+        trace_event(TRACE_GUEST_MATCH, this, other_sign << 8 | my_sign);
+
+        metrics_.matched(my_sign, other_sign, arrival);
+        trace_event(TRACE_GUEST_DEPART, this);
+        lock.unlock();
+        gate_.leave(my_sign * NUM_SIGNS + other_sign);
+        return match_name;
+    }
+
+    // if no matches, add guest to respective queue in 2d array
+    guestsWaiting[my_sign][other_sign].push_back(my);
+    metrics_.enqueued(my_sign, other_sign);
+    while (!*my.isMatched && !shed) {
+        my.match_found->wait(lock);
+        metrics_.relocked();
+    }
+
+    // a shed guest's admission now belongs to the guest that shed it
+    if (shed) {
+        trace_event(TRACE_GUEST_DEPART, this);
+        return std::nullopt;
+    }
+    metrics_.matched(my_sign, other_sign, arrival);
+    trace_event(TRACE_GUEST_DEPART, this);
+    lock.unlock();
+    gate_.leave(my_sign * NUM_SIGNS + other_sign);
+    return match_name;
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+bool BasicParty<LockPolicy, WaitPolicy>::shed_oldest(int my_sign,
+        int other_sign)
+{
+    std::unique_lock<LockPolicy> lock(mutex_, std::defer_lock);
+    metrics_.lock(lock);
+    std::deque<Guest>& queue = guestsWaiting[my_sign][other_sign];
+    for (auto it = queue.begin(); it != queue.end(); it++) {
+        if (it->shed) {
+            *it->shed = true;
+            it->match_found->notify_all();
+            queue.erase(it);
+            metrics_.dequeued(my_sign, other_sign);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Party is compiled once, in party.cc.
+extern template class BasicParty<>;
+
 #endif /* PARTY_H */
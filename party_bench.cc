@@ -0,0 +1,432 @@
+/*
+ * Benchmark for the Party class. Guests are generated in complementary
+ * couples (one guest with signs (a, b) and one with (b, a)), so every guest
+ * eventually matches, and are fed to a fixed set of worker threads that
+ * call meet. Results are printed as a single JSON object on stdout so runs
+ * of different implementations can be compared directly.
+ *
+ * Usage: party_bench [--arrival=closed|poisson|bursty] [--signs=uniform|zipf]
+ *                    [--guests=N] [--threads=N] [--rate=GUESTS_PER_SEC]
+ *                    [--burst=COUPLES] [--zipf=S] [--max-signs=N] [--seed=N]
+ *                    [--lock=std|spin|futex|morphing|instrumented]
+ *                    [--wait=std|futex|adaptive|morphing] [--max-spin-us=N]
+ *                    [--shards=node|llc|N] [--pin]
+ *
+ * closed:  all guests are queued up front; each worker starts its next
+ *          guest as soon as the previous one has matched.
+ * poisson: couples arrive with exponentially distributed gaps at --rate.
+ * bursty:  --burst couples arrive at once, with exponential gaps between
+ *          bursts, for the same average --rate.
+ *
+ * Match latency is measured from a guest's arrival (its scheduled arrival
+ * time for the open-loop processes, the start of meet for closed) until
+ * meet returns.
+ *
+ * --lock and --wait choose the party's lock and wait policies (see
+ * sync-policies.hh); every combination is compiled in (morphing goes only
+ * with morphing, and adaptive with futex). With --lock=instrumented, the
+ * lock's contention profile is printed on stderr. --max-spin-us sets
+ * AdaptiveCondVar's spin cap, so repeated runs trace out its latency
+ * against CPU time.
+ * Hardware and software event counts per match are included where perf
+ * events are available (see perf-counters.hh).
+ *
+ * --shards runs a ShardedParty (sharded-party.hh) instead, with one shard
+ * per NUMA node or last-level cache, or with N shards by CPU number, and
+ * reports how many matches were made within a shard and across shards.
+ * --pin pins worker i to the i-th CPU the process may use (round robin),
+ * so that guests arrive at a fixed shard.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "instrumented-mutex.hh"
+#include "party.hh"
+#include "perf-counters.hh"
+#include "sharded-party.hh"
+#include "sync-policies.hh"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct Options {
+    string arrival = "closed";
+    string signs = "uniform";
+    int guests = 100000;
+    int threads = 8;
+    double rate = 100000;
+    int burst = 64;
+    double zipf = 1.0;
+    int max_signs = NUM_SIGNS;
+    unsigned seed = 1;
+    string lock = "std";
+    string wait = "std";
+    string shards;
+    bool pin = false;
+};
+
+// One guest waiting to be handed to a worker.
+struct Arrival {
+    int id;
+    int my_sign;
+    int other_sign;
+    Clock::time_point time;
+};
+
+/**
+ * A queue of arrivals feeding one half of the workers. Guests with signs
+ * (a, b) go to the left lane and their complements (b, a) to the right
+ * lane in the same order; because each lane is served in FIFO order, a
+ * guest blocked in meet always has its complement either already waiting
+ * or still ahead in the other lane, so a fixed number of workers can
+ * never deadlock.
+ */
+class Lane {
+public:
+    void push(const Arrival& a)
+    {
+        lock_guard<mutex> lock(mutex_);
+        arrivals_.push_back(a);
+        ready_.notify_one();
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lock(mutex_);
+        closed_ = true;
+        ready_.notify_all();
+    }
+
+    // Returns false once the lane is closed and drained.
+    bool pop(Arrival *a)
+    {
+        unique_lock<mutex> lock(mutex_);
+        while (arrivals_.empty() && !closed_) {
+            ready_.wait(lock);
+        }
+        if (arrivals_.empty()) {
+            return false;
+        }
+        *a = arrivals_.front();
+        arrivals_.pop_front();
+        return true;
+    }
+
+private:
+    mutex mutex_;
+    condition_variable ready_;
+    deque<Arrival> arrivals_;
+    bool closed_ = false;
+};
+
+/**
+ * Draws signs from either a uniform or a Zipf distribution over the
+ * first max_signs signs.
+ */
+class SignSampler {
+public:
+    SignSampler(const Options& opts)
+    {
+        double total = 0;
+        for (int i = 0; i < opts.max_signs; i++) {
+            total += opts.signs == "zipf" ? 1.0 / pow(i + 1, opts.zipf) : 1.0;
+            cdf_.push_back(total);
+        }
+        for (double& c : cdf_) {
+            c /= total;
+        }
+    }
+
+    int sample(mt19937_64& rng)
+    {
+        double u = uniform_real_distribution<double>(0, 1)(rng);
+        auto it = lower_bound(cdf_.begin(), cdf_.end(), u);
+        return min<int>(it - cdf_.begin(), cdf_.size() - 1);
+    }
+
+private:
+    vector<double> cdf_;
+};
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static bool parse_option(const char *arg, Options *opts)
+{
+    if (strcmp(arg, "--pin") == 0) {
+        opts->pin = true;
+        return true;
+    }
+    const char *eq = strchr(arg, '=');
+    if (strncmp(arg, "--", 2) != 0 || eq == nullptr) {
+        return false;
+    }
+    string name(arg + 2, eq - arg - 2);
+    string value(eq + 1);
+    if (name == "arrival") {
+        opts->arrival = value;
+        return value == "closed" || value == "poisson" || value == "bursty";
+    } else if (name == "signs") {
+        opts->signs = value;
+        return value == "uniform" || value == "zipf";
+    } else if (name == "guests") {
+        opts->guests = atoi(value.c_str());
+    } else if (name == "threads") {
+        opts->threads = atoi(value.c_str());
+    } else if (name == "rate") {
+        opts->rate = atof(value.c_str());
+    } else if (name == "burst") {
+        opts->burst = atoi(value.c_str());
+    } else if (name == "zipf") {
+        opts->zipf = atof(value.c_str());
+    } else if (name == "max-signs") {
+        opts->max_signs = atoi(value.c_str());
+    } else if (name == "lock") {
+        opts->lock = value;
+    } else if (name == "wait") {
+        opts->wait = value;
+    } else if (name == "max-spin-us") {
+        AdaptiveCondVar::set_max_spin_ns(atof(value.c_str()) * 1000);
+    } else if (name == "shards") {
+        opts->shards = value;
+        return value == "node" || value == "llc" || atoi(value.c_str()) > 0;
+    } else if (name == "seed") {
+        opts->seed = strtoul(value.c_str(), nullptr, 10);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static uint64_t percentile(const vector<uint64_t>& sorted, double pct)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(pct / 100.0 * (sorted.size() - 1));
+    return sorted[index];
+}
+
+// Prints the sharded party's JSON fields; an unsharded one has none.
+template <typename LockPolicy, typename WaitPolicy>
+static void print_shards(const BasicParty<LockPolicy, WaitPolicy>&) {}
+
+template <typename LockPolicy, typename WaitPolicy>
+static void print_shards(
+        const BasicShardedParty<LockPolicy, WaitPolicy>& party)
+{
+    cout << ", \"shards\": " << party.num_shards()
+         << ", \"local_matches\": " << party.local_matches()
+         << ", \"remote_matches\": " << party.remote_matches();
+}
+
+/**
+ * Runs the benchmark against the given party and prints the results.
+ */
+template <typename PartyType>
+static void measure(const Options& opts, PartyType& party)
+{
+    Lane lanes[2];
+    vector<CpuInfo> cpus = cpu_topology();
+
+    // Opened before the workers start, so that it counts them too.
+    PerfCounters perf;
+    vector<vector<uint64_t>> latencies(opts.threads);
+    bool closed_loop = opts.arrival == "closed";
+
+    vector<thread> workers;
+    for (int t = 0; t < opts.threads; t++) {
+        workers.emplace_back([&, t] {
+            if (opts.pin && !cpus.empty()) {
+                pin_thread(cpus[t % cpus.size()].cpu);
+            }
+            Lane& lane = lanes[t % 2];
+            vector<uint64_t>& latency = latencies[t];
+            Arrival a;
+            while (lane.pop(&a)) {
+                if (closed_loop) {
+                    a.time = Clock::now();
+                }
+                string name = to_string(a.id);
+                party.meet(name, a.my_sign, a.other_sign);
+                latency.push_back(chrono::duration_cast<chrono::nanoseconds>(
+                        Clock::now() - a.time).count());
+            }
+        });
+    }
+
+    mt19937_64 rng(opts.seed);
+    SignSampler sampler(opts);
+    int couples = opts.guests / 2;
+    int per_event = opts.arrival == "bursty" ? opts.burst : 1;
+    exponential_distribution<double> gap(opts.rate / (2.0 * per_event));
+
+    perf.start();
+    double cpu_start = cpu_seconds();
+    Clock::time_point start = Clock::now();
+    Clock::time_point next = start;
+    for (int c = 0; c < couples; ) {
+        if (!closed_loop) {
+            this_thread::sleep_until(next);
+        }
+        for (int i = 0; i < per_event && c < couples; i++, c++) {
+            int a = sampler.sample(rng);
+            int b = sampler.sample(rng);
+            lanes[0].push({2 * c, a, b, next});
+            lanes[1].push({2 * c + 1, b, a, next});
+        }
+        if (!closed_loop) {
+            next += chrono::duration_cast<Clock::duration>(
+                    chrono::duration<double>(gap(rng)));
+        }
+    }
+    lanes[0].close();
+    lanes[1].close();
+    for (thread& w : workers) {
+        w.join();
+    }
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+    double cpu = cpu_seconds() - cpu_start;
+    perf.stop();
+
+    vector<uint64_t> all;
+    for (vector<uint64_t>& l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    sort(all.begin(), all.end());
+
+    cout << "{\"bench\": \"party\""
+         << ", \"lock\": \"" << opts.lock << "\""
+         << ", \"wait\": \"" << opts.wait << "\"";
+    print_shards(party);
+    if (opts.pin) {
+        cout << ", \"pinned\": true";
+    }
+    if (opts.wait == "adaptive") {
+        cout << ", \"max_spin_us\": " << AdaptiveCondVar::max_spin_ns() / 1e3;
+    }
+    cout << ", \"arrival\": \"" << opts.arrival << "\""
+         << ", \"signs\": \"" << opts.signs << "\""
+         << ", \"max_signs\": " << opts.max_signs
+         << ", \"threads\": " << opts.threads
+         << ", \"guests\": " << opts.guests
+         << ", \"matches\": " << couples
+         << ", \"seconds\": " << seconds
+         << ", \"matches_per_sec\": " << couples / seconds
+         << ", \"cpu_ns_per_match\": " << cpu * 1e9 / couples
+         << ", \"latency_ns\": {\"p50\": " << percentile(all, 50)
+         << ", \"p90\": " << percentile(all, 90)
+         << ", \"p99\": " << percentile(all, 99)
+         << ", \"p999\": " << percentile(all, 99.9)
+         << ", \"max\": " << (all.empty() ? 0 : all.back()) << "}";
+    perf.write_json(cout, couples, "match");
+    cout << "}" << endl;
+    LockProfile::report_all(cerr);
+}
+
+/**
+ * Runs the benchmark against a party, sharded or not, built with the
+ * given policies.
+ */
+template <typename LockPolicy, typename WaitPolicy>
+static void run(const Options& opts)
+{
+    if (opts.shards.empty()) {
+        BasicParty<LockPolicy, WaitPolicy> party;
+        measure(opts, party);
+    } else if (opts.shards == "node" || opts.shards == "llc") {
+        BasicShardedParty<LockPolicy, WaitPolicy> party(opts.shards == "node"
+                ? ShardDomain::NODE : ShardDomain::LLC);
+        measure(opts, party);
+    } else {
+        BasicShardedParty<LockPolicy, WaitPolicy> party(
+                atoi(opts.shards.c_str()));
+        measure(opts, party);
+    }
+}
+
+typedef void (*RunFn)(const Options&);
+
+// Every combination of the thread-safe policies, each its own instance.
+static const struct {
+    const char *lock;
+    const char *wait;
+    RunFn run;
+} CONFIGS[] = {
+    {"std", "std", run<mutex, condition_variable_any>},
+    {"std", "futex", run<mutex, FutexCondVar>},
+    {"spin", "std", run<SpinLock, condition_variable_any>},
+    {"spin", "futex", run<SpinLock, FutexCondVar>},
+    {"futex", "std", run<FutexLock, condition_variable_any>},
+    {"futex", "futex", run<FutexLock, FutexCondVar>},
+    {"futex", "adaptive", run<FutexLock, AdaptiveCondVar>},
+    {"morphing", "morphing", run<MorphingMutex, MorphingCondVar>},
+    {"instrumented", "std",
+            run<InstrumentedMutex<>, condition_variable_any>},
+    {"instrumented", "futex", run<InstrumentedMutex<>, FutexCondVar>},
+};
+
+static RunFn find_config(const string& lock, const string& wait)
+{
+    for (const auto& config : CONFIGS) {
+        if (lock == config.lock && wait == config.wait) {
+            return config.run;
+        }
+    }
+    return nullptr;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    for (int i = 1; i < argc; i++) {
+        if (!parse_option(argv[i], &opts)) {
+            cerr << "Unknown or invalid option '" << argv[i] << "'" << endl;
+            return 1;
+        }
+    }
+    if (opts.guests < 2 || opts.guests % 2 != 0) {
+        cerr << "--guests must be even and at least 2" << endl;
+        return 1;
+    }
+    if (opts.threads < 2 || opts.threads % 2 != 0) {
+        cerr << "--threads must be even and at least 2" << endl;
+        return 1;
+    }
+    if (opts.max_signs < 1 || opts.max_signs > NUM_SIGNS) {
+        cerr << "--max-signs must be between 1 and " << NUM_SIGNS << endl;
+        return 1;
+    }
+    if (opts.rate <= 0 || opts.burst < 1) {
+        cerr << "--rate and --burst must be positive" << endl;
+        return 1;
+    }
+
+    RunFn run = find_config(opts.lock, opts.wait);
+    if (run == nullptr) {
+        cerr << "unknown --lock/--wait combination " << opts.lock << "/"
+             << opts.wait << endl;
+        return 1;
+    }
+    run(opts);
+    return 0;
+}
@@ -12,13 +12,23 @@
 #include <cstdarg>
 #include <functional>
 #include <iostream>
+#include <sstream>
 #include <thread>
+#include <vector>
 
+#include <dirent.h>
 #include <string.h>
 #include <unistd.h>
 #include <map>
 
+#include "arrival-trace.hh"
+#include "caltrain.hh"
+#include "event-trace.hh"
+#include "fiber.hh"
+#include "instrumented-mutex.hh"
 #include "party.hh"
+#include "sharded-party.hh"
+#include "sync-policies.hh"
 
 // Interval for nanosleep corresponding to 1 ms.
 struct timespec one_ms = {.tv_sec = 0, .tv_nsec = 1000000};
@@ -186,6 +196,73 @@ void guest(Party *party, std::string name, int my_sign, int other_sign,
     matched++;
 }
 
+// Like guest, but through try_meet; a guest turned away gets "(none)" as
+// its match.
+void try_guest(Party *party, std::string name, int my_sign, int other_sign,
+        std::string *other_name)
+{
+    started++;
+    *other_name = party->try_meet(name, my_sign, other_sign)
+            .value_or("(none)");
+    matched++;
+}
+
+#ifdef EVENT_TRACE
+/*
+ * Starts tracing this process into a new temporary directory, which is
+ * returned. Must be called before the first traced event.
+ */
+std::string start_trace(void)
+{
+    char dir[] = "/tmp/party_test_trace.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    setenv("EVENT_TRACE_DIR", dir, 1);
+    return dir;
+}
+
+/*
+ * Returns the records in every trace file in dir, in no particular order,
+ * and removes the directory.
+ */
+std::vector<TraceRecord> read_trace(const std::string& dir)
+{
+    std::vector<TraceRecord> records;
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        perror(dir.c_str());
+        exit(1);
+    }
+    while (struct dirent *entry = readdir(d)) {
+        if (strncmp(entry->d_name, "trace.", 6) != 0) {
+            continue;
+        }
+        std::string path = dir + "/" + entry->d_name;
+        FILE *f = fopen(path.c_str(), "rb");
+        TraceFileHeader header;
+        if (f != nullptr && fread(&header, sizeof(header), 1, f) == 1) {
+            uint64_t count = std::min(header.written, header.capacity);
+            for (uint64_t i = 0; i < count; i++) {
+                TraceRecord r;
+                if (fread(&r, sizeof(r), 1, f) != 1) {
+                    break;
+                }
+                records.push_back(r);
+            }
+        }
+        if (f != nullptr) {
+            fclose(f);
+        }
+        unlink(path.c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+    return records;
+}
+#endif /* EVENT_TRACE */
+
 // Each method below tests a particular scenario.
 
 void two_guests_perfect_match(void)
@@ -508,6 +585,481 @@ void same_name(void)
     check_match("Guest (clone 4)", "Guest", match4);
 }
 
+#ifdef PARTY_METRICS
+void metrics(void)
+{
+    // One guest waits, then is matched; the gauges and histograms should
+    // reflect that without touching the party's lock.
+
+    Party party1;
+    std::string match_a, match_b;
+
+    matched = 0;
+    started = 0;
+    std::cout << "guest_a arrives: my_sign 2, other_sign 7" << std::endl;
+    std::thread guest_a([&party1, &match_a] {
+        guest(&party1, "guest_a", 2, 7, &match_a);
+    });
+    guest_a.detach();
+    while (started < 1) /* Do nothing */;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    PartyMetrics::Snapshot s = party1.metrics().snapshot();
+    if (s.waiting[2][7] != 1) {
+        std::cout << "Error: waiting[2][7] is " << s.waiting[2][7]
+                << ", expected 1" << std::endl;
+    }
+    party1.metrics().print_heatmap(std::cout);
+
+    std::cout << "guest_b arrives: my_sign 7, other_sign 2" << std::endl;
+    std::thread guest_b([&party1, &match_b] {
+        guest(&party1, "guest_b", 7, 2, &match_b);
+    });
+    guest_b.detach();
+    while (started < 2) /* Do nothing */;
+    wait_for_matches(2, 100);
+    check_match("guest_a", "guest_b", match_a);
+    check_match("guest_b", "guest_a", match_b);
+
+    s = party1.metrics().snapshot();
+    if (s.waiting[2][7] != 0) {
+        std::cout << "Error: waiting[2][7] is " << s.waiting[2][7]
+                << " after match, expected 0" << std::endl;
+    }
+    if (s.matches[2][7] != 1 || s.matches[7][2] != 1) {
+        std::cout << "Error: expected one match recorded for each of 2->7"
+                << " and 7->2" << std::endl;
+    }
+    if (s.percentile(2, 7, 50) < 50000000) {
+        std::cout << "Error: guest_a's latency should be at least 50 ms"
+                << std::endl;
+    }
+    if (s.lockAcquisitions != 2) {
+        std::cout << "Error: expected 2 lock acquisitions, saw "
+                << s.lockAcquisitions << std::endl;
+    }
+    if (s.lockRelocks < 1) {
+        std::cout << "Error: guest_a's relock on waking wasn't counted"
+                << std::endl;
+    }
+    party1.metrics().print_report(std::cout);
+}
+#endif
+
+void instrumented_lock(void)
+{
+    // A party built on InstrumentedMutex: one guest waits and is matched by
+    // a second, which takes the lock three times (the second guest, and the
+    // first guest on arrival and again on waking).
+
+    BasicParty<InstrumentedMutex<>> party1;
+    std::string match_a, match_b;
+
+    matched = 0;
+    started = 0;
+    std::cout << "guest_a arrives: my_sign 3, other_sign 9" << std::endl;
+    std::thread guest_a([&party1, &match_a] {
+        started++;
+        std::string name = "guest_a";
+        match_a = party1.meet(name, 3, 9);
+        matched++;
+    });
+    guest_a.detach();
+    while (started < 1) /* Do nothing */;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::cout << "guest_b arrives: my_sign 9, other_sign 3" << std::endl;
+    std::thread guest_b([&party1, &match_b] {
+        started++;
+        std::string name = "guest_b";
+        match_b = party1.meet(name, 9, 3);
+        matched++;
+    });
+    guest_b.detach();
+    while (started < 2) /* Do nothing */;
+    wait_for_matches(2, 100);
+    check_match("guest_a", "guest_b", match_a);
+    check_match("guest_b", "guest_a", match_b);
+
+    std::ostringstream report;
+    LockProfile::report_all(report);
+    std::cout << report.str();
+    if (report.str().find(" 3 acquisitions") == std::string::npos) {
+        std::cout << "Error: expected the report to show 3 acquisitions"
+                << std::endl;
+    }
+}
+
+// Pairs of complementary guests as threads on a party instantiated with
+// the given policies; every guest should match.
+template <typename LockPolicy, typename WaitPolicy>
+void thread_guests(void)
+{
+    const int NUM_PAIRS = 200;
+    BasicParty<LockPolicy, WaitPolicy> party1;
+    matched = 0;
+
+    std::cout << 2 * NUM_PAIRS << " guests arrive as threads" << std::endl;
+    std::vector<std::thread> guests;
+    for (int i = 0; i < NUM_PAIRS; i++) {
+        int sign_a = i % NUM_SIGNS;
+        int sign_b = (i * 5 + 1) % NUM_SIGNS;
+        guests.emplace_back([&party1, i, sign_a, sign_b] {
+            std::string name = "a" + std::to_string(i);
+            party1.meet(name, sign_a, sign_b);
+            matched++;
+        });
+        guests.emplace_back([&party1, i, sign_a, sign_b] {
+            std::string name = "b" + std::to_string(i);
+            party1.meet(name, sign_b, sign_a);
+            matched++;
+        });
+    }
+    if (!wait_for_matches(2 * NUM_PAIRS, 5000)) {
+        std::cout << "Error: only " << matched.load() << " of "
+                << 2 * NUM_PAIRS << " guests matched" << std::endl;
+        exit(1);
+    }
+    for (std::thread& guest : guests) {
+        guest.join();
+    }
+    std::cout << "All guests matched" << std::endl;
+}
+
+void morphing_guests(void)
+{
+    // The wait-morphing mutex and condition variable, where each match's
+    // notification is deferred to the unlock and moves the waiter onto
+    // the mutex.
+    thread_guests<MorphingMutex, MorphingCondVar>();
+}
+
+void adaptive_guests(void)
+{
+    // The spin-then-park condition variable, where a guest matched soon
+    // after arriving never parks in the kernel.
+    thread_guests<FutexLock, AdaptiveCondVar>();
+}
+
+void adaptive_budget(void)
+{
+    // Each guest waits on a condition variable of its own, yet the wait
+    // time AdaptiveCondVar learns from one guest should carry over to the
+    // next with the same signs: after a few guests that each wait 20 ms,
+    // the moving average is past the spin cap, so later guests with
+    // these signs park without spinning.
+    const int NUM_WAITS = 5;
+    BasicParty<FutexLock, AdaptiveCondVar> party1;
+    matched = 0;
+
+    std::uint64_t before = party1.wait_stats(1, 2).average_ns();
+    std::uint64_t previous = before;
+    for (int i = 0; i < NUM_WAITS; i++) {
+        std::atomic<int> started = 0;
+        std::thread guest_a([&party1, &started, i] {
+            std::string name = "a" + std::to_string(i);
+            started++;
+            party1.meet(name, 1, 2);
+            matched++;
+        });
+        while (started < 1) /* Do nothing */;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::string name = "b" + std::to_string(i);
+        party1.meet(name, 2, 1);
+        guest_a.join();
+
+        std::uint64_t average = party1.wait_stats(1, 2).average_ns();
+        std::cout << "after guest " << i << " waited: average wait "
+                << average << " ns" << std::endl;
+        if (average <= previous) {
+            std::cout << "Error: the average wait did not grow from "
+                    << previous << " ns" << std::endl;
+        }
+        previous = average;
+    }
+    if (previous <= AdaptiveCondVar::max_spin_ns()) {
+        std::cout << "Error: expected the average wait to pass the "
+                << AdaptiveCondVar::max_spin_ns() << " ns spin cap"
+                << std::endl;
+    }
+    if (party1.wait_stats(2, 1).average_ns() != before) {
+        std::cout << "Error: guests that never waited changed the average "
+                << "for their signs" << std::endl;
+    }
+}
+
+void admission_control(void)
+{
+    // Parties that admit one waiting guest per sign pair. guest_a waits
+    // for a match, then guest_b arrives with the same signs through
+    // try_meet: with REJECT it is turned away at once, with SHED_OLDEST it
+    // takes guest_a's place, and with BLOCK it waits at the gate until
+    // guest_a has been matched by guest_c. When traced, every guest that
+    // entered the party, the shed guest included, must be traced leaving.
+#ifdef EVENT_TRACE
+    std::string trace_dir = start_trace();
+#endif
+
+    struct {
+        const char *name;
+        Overload overload;
+        const char *match_a;
+        const char *match_b;
+    } cases[] = {
+        {"REJECT", Overload::REJECT, "guest_c", "(none)"},
+        {"SHED_OLDEST", Overload::SHED_OLDEST, "(none)", "guest_c"},
+        {"BLOCK", Overload::BLOCK, "guest_c", "guest_d"},
+    };
+    for (auto& c : cases) {
+        Party party1(Admission{1, c.overload});
+        std::string match_a, match_b, match_c, match_d;
+        started = 0;
+        matched = 0;
+
+        std::cout << c.name << ": guest_a waits with signs 0, 1" << std::endl;
+        std::thread([&] {
+            try_guest(&party1, "guest_a", 0, 1, &match_a);
+        }).detach();
+        while (started < 1) /* Do nothing */;
+        wait_for_matches(1, 100);
+        std::cout << "guest_b arrives with the same signs" << std::endl;
+        std::thread([&] {
+            try_guest(&party1, "guest_b", 0, 1, &match_b);
+        }).detach();
+        while (started < 2) /* Do nothing */;
+        wait_for_matches(1, 100);
+        if (c.overload == Overload::REJECT
+                && check_match("guest_b", "(none)", match_b)) {
+            return;
+        }
+        if (c.overload == Overload::SHED_OLDEST
+                && check_match("guest_a", "(none)", match_a)) {
+            return;
+        }
+        if (c.overload == Overload::BLOCK
+                && (check_match("guest_a", "", match_a)
+                        + check_match("guest_b", "", match_b))) {
+            return;
+        }
+
+        std::cout << "guest_c arrives with signs 1, 0" << std::endl;
+        std::thread([&] {
+            guest(&party1, "guest_c", 1, 0, &match_c);
+        }).detach();
+        int expected = 3;
+        if (c.overload == Overload::BLOCK) {
+            wait_for_matches(2, 100);
+            usleep(100000);
+            std::cout << "guest_d arrives with signs 1, 0" << std::endl;
+            std::thread([&] {
+                guest(&party1, "guest_d", 1, 0, &match_d);
+            }).detach();
+            expected = 4;
+        }
+        if (!wait_for_matches(expected, 1000)) {
+            std::cout << "Error: only " << matched.load() << " of "
+                    << expected << " guests returned" << std::endl;
+            exit(1);
+        }
+        if (check_match("guest_a", c.match_a, match_a)
+                + check_match("guest_b", c.match_b, match_b)) {
+            return;
+        }
+    }
+
+#ifdef EVENT_TRACE
+    // Two guests with REJECT, three with SHED_OLDEST and four with BLOCK
+    // get as far as meeting; each runs on a thread of its own.
+    std::map<uint32_t, int> open_meets;
+    int meets = 0;
+    for (const TraceRecord& r : read_trace(trace_dir)) {
+        if (r.event == TRACE_GUEST_ARRIVE) {
+            open_meets[r.tid]++;
+            meets++;
+        } else if (r.event == TRACE_GUEST_DEPART) {
+            open_meets[r.tid]--;
+        }
+    }
+    if (meets != 9) {
+        std::cout << "Error: expected 9 traced meets, saw " << meets
+                << std::endl;
+    }
+    for (auto& [tid, open] : open_meets) {
+        if (open != 0) {
+            std::cout << "Error: thread " << tid << " left " << open
+                    << " meet(s) without a depart event" << std::endl;
+        }
+    }
+    std::cout << meets << " traced meets, all departed" << std::endl;
+#endif
+}
+
+void fiber_guests(void)
+{
+    // Thousands of guests as fibers on a party instantiated with the fiber
+    // mutex and condition variable; every guest has a partner with the
+    // opposite signs, so all of them should match.
+
+    const int NUM_PAIRS = 2000;
+    BasicParty<FiberMutex, FiberCondVar> party1;
+    matched = 0;
+
+    std::cout << 2 * NUM_PAIRS << " guests arrive as fibers" << std::endl;
+    FiberRuntime runtime(2);
+    for (int i = 0; i < NUM_PAIRS; i++) {
+        int sign_a = i % NUM_SIGNS;
+        int sign_b = (i * 5 + 1) % NUM_SIGNS;
+        runtime.spawn([&party1, i, sign_a, sign_b] {
+            std::string name = "a" + std::to_string(i);
+            party1.meet(name, sign_a, sign_b);
+            matched++;
+        });
+        runtime.spawn([&party1, i, sign_a, sign_b] {
+            std::string name = "b" + std::to_string(i);
+            party1.meet(name, sign_b, sign_a);
+            matched++;
+        });
+    }
+    if (!wait_for_matches(2 * NUM_PAIRS, 5000)) {
+        std::cout << "Error: only " << matched.load() << " of "
+                << 2 * NUM_PAIRS << " guests matched" << std::endl;
+        exit(1);
+    }
+    runtime.wait_idle();
+    std::cout << "All guests matched" << std::endl;
+}
+
+void replay_guests(void)
+{
+    // Three pairs of guests meet at a recorded party. Replaying the trace
+    // as fast as possible against a fresh party must match all six with
+    // no help; with an extra guest added to the end, who has no partner,
+    // the replayer must add one guest to release them.
+
+    std::string path = "/tmp/replay_guests_test." + std::to_string(getpid());
+    {
+        Party party1;
+        ArrivalRecorder recorder(path);
+        RecordingParty<Party> recording(party1, recorder);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 6; i++) {
+            threads.emplace_back([&recording, i] {
+                std::string name = "guest_" + std::to_string(i);
+                int pair = i / 2;
+                recording.meet(name, i % 2 ? pair : pair + 1,
+                        i % 2 ? pair + 1 : pair);
+            });
+        }
+        for (std::thread& t : threads) {
+            t.join();
+        }
+    }
+
+    std::vector<ArrivalRecord> records;
+    if (!load_arrival_trace(path, &records)) {
+        std::cout << "Error: could not load the trace" << std::endl;
+        return;
+    }
+    unlink(path.c_str());
+    if (records.size() != 6) {
+        std::cout << "Error: expected 6 guests in the trace, found "
+                << records.size() << std::endl;
+        return;
+    }
+
+    ReplayOptions options;
+    options.speed = 0;
+    Party party2;
+    ReplayResult result = replay_arrivals(records,
+            static_cast<Station *>(nullptr), &party2, options);
+    if (result.guests != 6 || result.drainGuests != 0) {
+        std::cout << "Error: replayed " << result.guests << " guests with "
+                << result.drainGuests << " added" << std::endl;
+    }
+
+    ArrivalRecord lonely = records.back();
+    lonely.arg = 4 << 8 | 5;
+    records.push_back(lonely);
+    Party party3;
+    result = replay_arrivals(records, static_cast<Station *>(nullptr),
+            &party3, options);
+    std::cout << "Replayed " << result.guests << " guests, "
+            << result.drainGuests << " added" << std::endl;
+    if (result.guests != 7 || result.drainGuests != 1) {
+        std::cout << "Error: expected 7 guests and 1 added" << std::endl;
+    }
+}
+
+void sharded_guests(void)
+{
+    // A guest waits in shard 0 of a sharded party, and its complement
+    // arrives at shard 1, where nobody is waiting: it must find the guest
+    // in shard 0.
+    ShardedParty party1(2);
+    std::string name_a = "guest_a";
+    std::string match_a;
+    std::thread a([&] { match_a = party1.meet_at(0, name_a, 1, 2); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::string name_b = "guest_b";
+    std::string match_b = party1.meet_at(1, name_b, 2, 1);
+    a.join();
+    if (match_a != "guest_b" || match_b != "guest_a"
+            || party1.remote_matches() != 1) {
+        std::cout << "Error: guest_a matched '" << match_a
+                << "' and guest_b matched '" << match_b << "' with "
+                << party1.remote_matches() << " remote matches" << std::endl;
+    }
+
+    // Thousands of fiber guests arrive at four shards, half of them at
+    // the same shard as their complement and half at another, so matches
+    // are made both locally and across shards. Everyone must match, and
+    // in pairs with complementary signs.
+    const int NUM_PAIRS = 2000;
+    auto signs = [](int i) {
+        int sign_a = i / 2 % NUM_SIGNS;
+        int sign_b = (i / 2 * 5 + 1) % NUM_SIGNS;
+        return i % 2 ? std::make_pair(sign_b, sign_a)
+                : std::make_pair(sign_a, sign_b);
+    };
+    BasicShardedParty<FiberMutex, FiberCondVar> party2(4);
+    std::vector<std::string> matches(2 * NUM_PAIRS);
+    matched = 0;
+    {
+        FiberRuntime runtime(2);
+        for (int i = 0; i < 2 * NUM_PAIRS; i++) {
+            runtime.spawn([&party2, &matches, i, s = signs(i)] {
+                std::string name = std::to_string(i);
+                int pair = i / 2;
+                int shard = (pair + (i % 2) * (pair % 2)) % 4;
+                matches[i] = party2.meet_at(shard, name, s.first, s.second);
+                matched++;
+            });
+        }
+        if (!wait_for_matches(2 * NUM_PAIRS, 5000)) {
+            std::cout << "Error: only " << matched.load() << " of "
+                    << 2 * NUM_PAIRS << " guests matched" << std::endl;
+            exit(1);
+        }
+        runtime.wait_idle();
+    }
+    for (int i = 0; i < 2 * NUM_PAIRS; i++) {
+        int other = atoi(matches[i].c_str());
+        if (matches[other] != std::to_string(i)
+                || signs(other) != std::make_pair(signs(i).second,
+                        signs(i).first)) {
+            std::cout << "Error: guest " << i << " matched " << other
+                    << ", who matched " << matches[other] << std::endl;
+            return;
+        }
+    }
+    if (party2.local_matches() == 0 || party2.remote_matches() == 0) {
+        std::cout << "Error: expected matches both within and across "
+                "shards" << std::endl;
+    }
+    std::cout << "All guests matched, " << party2.local_matches()
+            << " locally and " << party2.remote_matches()
+            << " across shards" << std::endl;
+}
+
 void random(int num_people, int max_signs)
 {
     // Generate a random collection of guests, such that everyone can
@@ -601,6 +1153,17 @@ main(int argc, char *argv[])
     testFns["single_sign_many"] = single_sign_many;
     testFns["same_name"] = same_name;
     testFns["cond_fifo"] = cond_fifo;
+    testFns["fiber_guests"] = fiber_guests;
+    testFns["morphing_guests"] = morphing_guests;
+    testFns["adaptive_guests"] = adaptive_guests;
+    testFns["adaptive_budget"] = adaptive_budget;
+    testFns["admission_control"] = admission_control;
+    testFns["replay_guests"] = replay_guests;
+    testFns["sharded_guests"] = sharded_guests;
+    testFns["instrumented_lock"] = instrumented_lock;
+#ifdef PARTY_METRICS
+    testFns["metrics"] = metrics;
+#endif
     // random is omitted, as it takes arguments
 
     if (argc == 1) {
@@ -0,0 +1,130 @@
+// This file contains the implementation of PerfCounters.
+
+#include "perf-counters.hh"
+
+#include <cerrno>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} EVENTS[PerfCounters::NUM_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"cpu_migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+};
+
+// Opens one disabled, inherited counter for this process on any CPU;
+// returns -1 if the kernel refuses it.
+int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+        // Unprivileged processes may still count user-mode events.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    return fd;
+}
+
+} // namespace
+
+PerfCounters::PerfCounters()
+{
+    for (int i = 0; i < NUM_EVENTS; i++) {
+        fds_[i] = open_counter(EVENTS[i].type, EVENTS[i].config);
+        values_[i] = -1;
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int fd : fds_) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void PerfCounters::start()
+{
+    for (int fd : fds_) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void PerfCounters::stop()
+{
+    for (int fd : fds_) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (int i = 0; i < NUM_EVENTS; i++) {
+        // value, time enabled, time running
+        uint64_t data[3];
+        values_[i] = -1;
+        if (fds_[i] < 0 || read(fds_[i], data, sizeof(data))
+                != static_cast<ssize_t>(sizeof(data))) {
+            continue;
+        }
+        if (data[2] == 0) {
+            // Never scheduled onto the PMU (all counters taken).
+            continue;
+        }
+        values_[i] = data[2] < data[1]
+                ? static_cast<double>(data[0]) * data[1] / data[2]
+                : data[0];
+    }
+}
+
+double PerfCounters::value(Event event) const
+{
+    return values_[event];
+}
+
+void PerfCounters::write_json(ostream& out, double ops, const char *unit) const
+{
+    out << ", \"perf\": {";
+    for (int i = 0; i < NUM_EVENTS; i++) {
+        out << (i ? ", " : "") << "\"" << EVENTS[i].name << "_per_" << unit
+            << "\": ";
+        if (values_[i] < 0 || ops <= 0) {
+            out << "null";
+        } else {
+            out << values_[i] / ops;
+        }
+    }
+    out << "}";
+}
+
+const char *PerfCounters::name(Event event)
+{
+    return EVENTS[event].name;
+}
@@ -0,0 +1,76 @@
+// Hardware and software event counts for a benchmark region, read through
+// perf_event_open(2), so a benchmark can say why a variant is slow and not
+// just that it is:
+//
+//     PerfCounters perf;          // before starting the region's threads
+//     perf.start();
+//     ... run the workload ...
+//     perf.stop();
+//     cout << "{..." ;
+//     perf.write_json(cout, rides, "ride");
+//     cout << "}" << endl;
+//
+// Counters follow the calling thread and every thread it starts after the
+// PerfCounters is constructed (they are opened with inherit set), so a
+// region's worker threads are included. Where perf events are unavailable
+// (no kernel support, a restrictive perf_event_paranoid, a container that
+// filters the system call) each missing event simply reads as null; if
+// the kernel multiplexes counters, counts are scaled up by the fraction of
+// the region they were running.
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <ostream>
+
+/**
+ * Class: PerfCounters
+ * -------------------
+ * One set of counters for the calling process. Not thread-safe: start,
+ * stop and the readers belong to the thread that constructed it.
+ */
+class PerfCounters {
+public:
+    enum Event {
+        CYCLES,
+        INSTRUCTIONS,
+        CACHE_MISSES,
+        BRANCH_MISSES,
+        CONTEXT_SWITCHES,
+        CPU_MIGRATIONS,
+        NUM_EVENTS
+    };
+
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Zeroes the counters and starts counting.
+    void start();
+
+    // Stops counting and reads the counters.
+    void stop();
+
+    // Whether event could be opened at all.
+    bool available(Event event) const { return fds_[event] >= 0; }
+
+    // The count for event between start() and stop(), or -1 if it is
+    // unavailable.
+    double value(Event event) const;
+
+    // Writes ", "perf": {...}" with each event's count divided by ops, as
+    // "<event>_per_<unit>", or null for unavailable events.
+    void write_json(std::ostream& out, double ops, const char *unit) const;
+
+    // The event's name in JSON output, such as "cache_misses".
+    static const char *name(Event event);
+
+private:
+    int fds_[NUM_EVENTS];
+    double values_[NUM_EVENTS];
+};
+
+#endif /* PERF_COUNTERS_H */
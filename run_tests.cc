@@ -0,0 +1,247 @@
+/*
+ * Runs every test registered in the test binaries, concurrently. Tests are
+ * discovered by running each binary with no arguments and reading its
+ * "Available tests are:" listing (entries that take arguments, such as
+ * random, are skipped). Each test runs in its own process group with its
+ * output captured; it passes if it exits with status 0 and prints no line
+ * containing "Error". A test still running after --timeout seconds is
+ * killed and fails. Most tests spend their time sleeping, so with enough
+ * jobs the suite takes about as long as its slowest test.
+ *
+ * Usage: run_tests [--jobs=N] [--timeout=SECONDS] [BINARY...]
+ *
+ * BINARY defaults to caltrain_test, party_test, party_layers_test (party_test
+ * with PARTY_METRICS and EVENT_TRACE), schedule_test and ostreamlock_test;
+ * --jobs defaults to running every test at once.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "thread-utils.h"
+
+using namespace std;
+
+struct Test {
+    string binary;
+    string name;
+    pid_t pid = -1;
+
+    // Read end of the test's output pipe, or -1 once it has closed.
+    int fd = -1;
+    string output;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    bool timedOut = false;
+    int status = 0;
+};
+
+// Starts argv in a new process group with stdout and stderr going to a
+// pipe, whose read end is returned in *fd.
+static pid_t start_process(const vector<string>& argv, int *fd)
+{
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) != 0) {
+        perror("pipe2");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        dup2(pipeFds[1], STDOUT_FILENO);
+        dup2(pipeFds[1], STDERR_FILENO);
+        vector<char *> args;
+        for (const string& arg : argv) {
+            args.push_back(const_cast<char *>(arg.c_str()));
+        }
+        args.push_back(nullptr);
+        execv(args[0], args.data());
+        perror(args[0]);
+        _exit(127);
+    }
+
+    // Also done here so a timeout kill cannot race with the child's call.
+    setpgid(pid, pid);
+    close(pipeFds[1]);
+    *fd = pipeFds[0];
+    return pid;
+}
+
+// Appends whatever is available on fd to out; returns false at EOF.
+static bool read_some(int fd, string *out)
+{
+    char buffer[4096];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n > 0) {
+        out->append(buffer, n);
+        return true;
+    }
+    return n < 0 && errno == EINTR;
+}
+
+// Returns the tests listed by running binary with no arguments.
+static vector<string> discover(const string& binary)
+{
+    int fd;
+    pid_t pid = start_process({binary}, &fd);
+    string output;
+    while (read_some(fd, &output)) {}
+    close(fd);
+    waitpid(pid, nullptr, 0);
+
+    vector<string> names;
+    size_t pos = output.find("Available tests are:");
+    if (pos == string::npos) {
+        return names;
+    }
+    size_t lineStart = output.find('\n', pos);
+    while (lineStart != string::npos && lineStart + 1 < output.size()
+            && output[lineStart + 1] == '\t') {
+        size_t lineEnd = output.find('\n', lineStart + 1);
+        string name = output.substr(lineStart + 2,
+                lineEnd == string::npos ? string::npos
+                        : lineEnd - lineStart - 2);
+        if (name.find(' ') == string::npos) {
+            names.push_back(name);
+        }
+        lineStart = lineEnd;
+    }
+    return names;
+}
+
+// Prints one finished test's result; returns true if it passed.
+static bool report(const Test& test)
+{
+    bool error = test.output.find("Error") != string::npos;
+    bool passed = !test.timedOut && !error && WIFEXITED(test.status)
+            && WEXITSTATUS(test.status) == 0;
+    cout << (passed ? "PASS " : "FAIL ") << test.binary << " " << test.name
+         << " (" << (test.end - test.start) / 1e9 << " s";
+    if (test.timedOut) {
+        cout << ", timed out";
+    } else if (WIFSIGNALED(test.status)) {
+        cout << ", " << strsignal(WTERMSIG(test.status));
+    } else if (WEXITSTATUS(test.status) != 0) {
+        cout << ", exit status " << WEXITSTATUS(test.status);
+    }
+    cout << ")" << endl;
+    if (!passed) {
+        size_t lineStart = 0;
+        while (lineStart < test.output.size()) {
+            size_t lineEnd = test.output.find('\n', lineStart);
+            if (lineEnd == string::npos) {
+                lineEnd = test.output.size();
+            }
+            cout << "    " << test.output.substr(lineStart,
+                    lineEnd - lineStart) << endl;
+            lineStart = lineEnd + 1;
+        }
+    }
+    return passed;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t jobs = 0;
+    double timeout = 60;
+    vector<string> binaries;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+            timeout = atof(argv[i] + 10);
+        } else if (argv[i][0] == '-') {
+            cerr << "Usage: run_tests [--jobs=N] [--timeout=SECONDS] "
+                    "[BINARY...]" << endl;
+            return 1;
+        } else {
+            binaries.push_back(argv[i]);
+        }
+    }
+    if (binaries.empty()) {
+        binaries = {"caltrain_test", "party_test", "party_layers_test",
+                "schedule_test", "ostreamlock_test"};
+    }
+
+    vector<Test> tests;
+    for (string& binary : binaries) {
+        if (binary.find('/') == string::npos) {
+            binary = "./" + binary;
+        }
+        vector<string> names = discover(binary);
+        if (names.empty()) {
+            cerr << binary << ": no tests found" << endl;
+            return 1;
+        }
+        for (const string& name : names) {
+            tests.emplace_back();
+            tests.back().binary = binary;
+            tests.back().name = name;
+        }
+    }
+    if (jobs == 0) {
+        jobs = tests.size();
+    }
+
+    uint64_t suiteStart = monotonic_ns();
+    uint64_t timeoutNs = timeout * 1e9;
+    size_t next = 0;
+    size_t failed = 0;
+    vector<Test *> running;
+    while (next < tests.size() || !running.empty()) {
+        while (running.size() < jobs && next < tests.size()) {
+            Test& test = tests[next++];
+            test.start = monotonic_ns();
+            test.pid = start_process({test.binary, test.name}, &test.fd);
+            running.push_back(&test);
+        }
+
+        vector<pollfd> fds;
+        for (Test *test : running) {
+            fds.push_back({test->fd, POLLIN, 0});
+        }
+        poll(fds.data(), fds.size(), 100);
+
+        uint64_t now = monotonic_ns();
+        for (size_t i = 0; i < running.size(); i++) {
+            Test& test = *running[i];
+            if (fds[i].revents != 0 && !read_some(test.fd, &test.output)) {
+                // Output closed: the test has exited (or been killed).
+                close(test.fd);
+                test.fd = -1;
+                waitpid(test.pid, &test.status, 0);
+                test.end = monotonic_ns();
+                failed += !report(test);
+            } else if (!test.timedOut && now - test.start > timeoutNs) {
+                kill(-test.pid, SIGKILL);
+                test.timedOut = true;
+            }
+        }
+        running.erase(remove_if(running.begin(), running.end(),
+                [](Test *test) { return test->fd < 0; }), running.end());
+    }
+
+    const Test& slowest = *max_element(tests.begin(), tests.end(),
+            [](const Test& a, const Test& b) {
+                return a.end - a.start < b.end - b.start;
+            });
+    cout << tests.size() - failed << " of " << tests.size()
+         << " tests passed in " << (monotonic_ns() - suiteStart) / 1e9
+         << " s (slowest: " << slowest.binary << " " << slowest.name
+         << ", " << (slowest.end - slowest.start) / 1e9 << " s)" << endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,220 @@
+// This file contains the implementation of the controlled scheduler and
+// the schedule exploration built on it.
+
+#include "schedule.hh"
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+
+// The ControlledScheduler whose run() is executing on this thread. Its
+// fibers never leave the thread, so reading this from a fiber is safe.
+thread_local ControlledScheduler *running = nullptr;
+
+// Picks uniformly among the ready fibers.
+class RandomStrategy : public Strategy {
+public:
+    explicit RandomStrategy(uint64_t seed) : rng_(seed) {}
+
+    size_t choose(size_t numReady) override
+    {
+        return uniform_int_distribution<size_t>(0, numReady - 1)(rng_);
+    }
+
+private:
+    mt19937_64 rng_;
+};
+
+// Makes a recorded sequence of choices, then runs the oldest fiber.
+class ReplayStrategy : public Strategy {
+public:
+    explicit ReplayStrategy(vector<size_t> choices)
+        : choices_(move(choices))
+        , next_(0)
+    {}
+
+    size_t choose(size_t) override
+    {
+        return next_ < choices_.size() ? choices_[next_++] : 0;
+    }
+
+private:
+    vector<size_t> choices_;
+    size_t next_;
+};
+
+// Enumerates schedules depth first: each execution replays the previous
+// one's choices up to its last step with an untried alternative, takes
+// that alternative, and then runs the oldest fiber at every new step.
+// Choosing any other fiber is a delay; schedules with more than
+// delayBound delays are skipped.
+class DfsStrategy : public Strategy {
+public:
+    explicit DfsStrategy(size_t delayBound)
+        : delayBound_(delayBound)
+        , delays_(0)
+        , depth_(0)
+    {}
+
+    size_t choose(size_t numReady) override
+    {
+        if (depth_ == path_.size()) {
+            path_.push_back({0, numReady});
+        }
+        return path_[depth_++].choice;
+    }
+
+    // Sets up the next schedule; returns false once all have been run.
+    bool next()
+    {
+        path_.resize(depth_);
+        depth_ = 0;
+        while (!path_.empty()) {
+            Step& step = path_.back();
+            if (step.choice > 0) {
+                delays_--;
+            }
+            if (step.choice + 1 < step.numReady && delays_ < delayBound_) {
+                step.choice++;
+                delays_++;
+                return true;
+            }
+            path_.pop_back();
+        }
+        return false;
+    }
+
+private:
+    struct Step {
+        size_t choice;
+        size_t numReady;
+    };
+
+    const size_t delayBound_;
+    vector<Step> path_;
+
+    // Steps in path_ with a nonzero choice.
+    size_t delays_;
+
+    // Steps of path_ replayed so far in the current execution.
+    size_t depth_;
+};
+
+string format_choices(const vector<size_t>& choices)
+{
+    ostringstream out;
+    out << "--schedule=";
+    for (size_t i = 0; i < choices.size(); i++) {
+        out << (i ? "," : "") << choices[i];
+    }
+    return out.str();
+}
+
+} // namespace
+
+ControlledScheduler::ControlledScheduler(Strategy& strategy)
+    : strategy_(strategy)
+{}
+
+ControlledScheduler::~ControlledScheduler()
+{
+    for (Fiber *fiber : live_) {
+        delete fiber;
+    }
+}
+
+void ControlledScheduler::spawn(function<void()> fn)
+{
+    Fiber *fiber = new Fiber(this, move(fn), 32 * 1024);
+    live_.insert(fiber);
+    ready_.push_back(fiber);
+}
+
+void ControlledScheduler::ready(Fiber *fiber)
+{
+    ready_.push_back(fiber);
+}
+
+size_t ControlledScheduler::run()
+{
+    ControlledScheduler *outer = running;
+    running = this;
+    while (!ready_.empty()) {
+        size_t i = 0;
+        if (ready_.size() > 1) {
+            i = min(strategy_.choose(ready_.size()), ready_.size() - 1);
+            choices_.push_back(i);
+        }
+        Fiber *fiber = ready_[i];
+        ready_.erase(ready_.begin() + i);
+        if (fiber->resume()) {
+            live_.erase(fiber);
+            delete fiber;
+        }
+    }
+    running = outer;
+    return live_.size();
+}
+
+void ControlledScheduler::preempt()
+{
+    if (running && Fiber::current()) {
+        Fiber::yield();
+    }
+}
+
+ExploreResult explore(const Scenario& scenario, const ExploreOptions& options)
+{
+    ExploreResult result;
+    for (size_t i = 0; i < options.randomRuns; i++) {
+        RandomStrategy strategy(options.seed + i);
+        ControlledScheduler scheduler(strategy);
+        result.executions++;
+        result.error = scenario(scheduler);
+        if (!result.error.empty()) {
+            result.replay = "--seed=" + to_string(options.seed + i);
+            return result;
+        }
+    }
+
+    DfsStrategy strategy(options.delayBound);
+    for (size_t i = 0; i < options.dfsRuns; i++) {
+        ControlledScheduler scheduler(strategy);
+        result.executions++;
+        result.error = scenario(scheduler);
+        if (!result.error.empty()) {
+            result.replay = format_choices(scheduler.choices());
+            return result;
+        }
+        if (!strategy.next()) {
+            result.exhaustive = true;
+            break;
+        }
+    }
+    return result;
+}
+
+string replay(const Scenario& scenario, const string& schedule)
+{
+    if (schedule.rfind("--seed=", 0) == 0) {
+        RandomStrategy strategy(stoull(schedule.substr(7)));
+        ControlledScheduler scheduler(strategy);
+        return scenario(scheduler);
+    }
+    if (schedule.rfind("--schedule=", 0) == 0) {
+        vector<size_t> choices;
+        istringstream list(schedule.substr(11));
+        string item;
+        while (getline(list, item, ',')) {
+            choices.push_back(stoul(item));
+        }
+        ReplayStrategy strategy(move(choices));
+        ControlledScheduler scheduler(strategy);
+        return scenario(scheduler);
+    }
+    return "unrecognized schedule '" + schedule + "'";
+}
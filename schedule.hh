@@ -0,0 +1,166 @@
+// A deterministic, controlled scheduler for testing Station and Party
+// without sleeps. Each actor in a test is a fiber, and all of them run on
+// the calling thread; at every synchronization operation (locking or
+// notifying through ControlledMutex and ControlledCondVar) the running
+// fiber yields and a Strategy picks which ready fiber runs next. A test
+// drives the actors in phases, calling run() to let them go until none
+// can make progress and then checking the state directly, so "did the
+// passenger board yet?" needs no timeout.
+//
+// explore() runs a scenario many times: first under seeded random
+// schedules, then by depth-first search over schedules that deviate from
+// round-robin order at most a few times (delay bounding). A failure is
+// reported with the seed or the choice sequence that produced it, and
+// replay() runs exactly that schedule again.
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "fiber.hh"
+
+/**
+ * Decides which ready fiber runs next. choose() is called only when more
+ * than one fiber is ready, and returns an index into them, oldest first.
+ */
+class Strategy {
+public:
+    virtual ~Strategy() {}
+    virtual std::size_t choose(std::size_t numReady) = 0;
+};
+
+/**
+ * Class: ControlledScheduler
+ * --------------------------
+ * Runs fibers on the calling thread, one at a time, in the order chosen
+ * by a Strategy. Records every choice so the schedule can be replayed.
+ */
+class ControlledScheduler : public FiberScheduler {
+public:
+    explicit ControlledScheduler(Strategy& strategy);
+
+    // Destroys any fibers still blocked; they are never resumed.
+    ~ControlledScheduler();
+
+    // Starts a fiber running fn; it runs during the next run().
+    void spawn(std::function<void()> fn);
+
+    // Runs fibers until none is ready. Returns the number of fibers that
+    // have not finished, all of which are blocked.
+    std::size_t run();
+
+    // The choices made so far, in order.
+    const std::vector<std::size_t>& choices() const { return choices_; }
+
+    void ready(Fiber *fiber) override;
+
+    // Called by synchronization operations: if the caller is a fiber of
+    // a running ControlledScheduler, lets the strategy switch to another
+    // ready fiber before continuing. Does nothing otherwise.
+    static void preempt();
+
+private:
+    Strategy& strategy_;
+    std::vector<Fiber *> ready_;
+    std::unordered_set<Fiber *> live_;
+    std::vector<std::size_t> choices_;
+};
+
+/**
+ * Class: ControlledMutex
+ * ----------------------
+ * A FiberMutex that is a preemption point for ControlledScheduler before
+ * every acquisition.
+ */
+class ControlledMutex {
+public:
+    void lock()
+    {
+        ControlledScheduler::preempt();
+        mutex_.lock();
+    }
+
+    bool try_lock()
+    {
+        ControlledScheduler::preempt();
+        return mutex_.try_lock();
+    }
+
+    // Not a preemption point: FiberCondVar::wait unlocks while holding
+    // its internal spin lock, and the next lock() is one anyway.
+    void unlock() { mutex_.unlock(); }
+
+private:
+    FiberMutex mutex_;
+};
+
+/**
+ * Class: ControlledCondVar
+ * ------------------------
+ * A FiberCondVar that is a preemption point for ControlledScheduler
+ * before every notification.
+ */
+class ControlledCondVar {
+public:
+    template <typename Lock>
+    void wait(Lock& lock) { cond_.wait(lock); }
+
+    void notify_one()
+    {
+        ControlledScheduler::preempt();
+        cond_.notify_one();
+    }
+
+    void notify_all()
+    {
+        ControlledScheduler::preempt();
+        cond_.notify_all();
+    }
+
+private:
+    FiberCondVar cond_;
+};
+
+// Runs one execution of a test on the given scheduler: spawns actors,
+// calls run() and checks what happened. Returns an error message, or an
+// empty string if the execution was correct.
+typedef std::function<std::string(ControlledScheduler&)> Scenario;
+
+struct ExploreOptions {
+    // Executions under random schedules, with seeds seed, seed + 1, ...
+    std::size_t randomRuns = 1000;
+    std::uint64_t seed = 1;
+
+    // Limit on depth-first executions, and on how many times each of
+    // them may choose other than the oldest ready fiber.
+    std::size_t dfsRuns = 10000;
+    std::size_t delayBound = 2;
+};
+
+struct ExploreResult {
+    std::size_t executions = 0;
+
+    // Whether depth-first search ran out of schedules within dfsRuns.
+    bool exhaustive = false;
+
+    // From the first failing execution, if any: its error message and
+    // the replay() argument that reproduces it ("--seed=N" or
+    // "--schedule=c,c,...").
+    std::string error;
+    std::string replay;
+};
+
+ExploreResult explore(const Scenario& scenario,
+        const ExploreOptions& options = ExploreOptions());
+
+// Runs the single execution identified by an ExploreResult::replay string;
+// returns its error message, or an empty string if it passed.
+std::string replay(const Scenario& scenario, const std::string& schedule);
+
+#endif /* SCHEDULE_H */
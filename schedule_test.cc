@@ -0,0 +1,354 @@
+/*
+ * This file runs Station and Party scenarios under the controlled
+ * scheduler in schedule.hh. The scenarios follow the ones in
+ * caltrain_test.cc and party_test.cc, but instead of sleeping and polling
+ * to guess whether an actor is blocked, each phase runs the actors until
+ * none can make progress and then checks the state exactly. Every test
+ * runs its scenario under 1000 random schedules followed by a bounded
+ * depth-first search, which takes milliseconds.
+ *
+ * Usage: schedule_test TEST                 explore TEST's schedules
+ *        schedule_test TEST --seed=N        replay one random schedule
+ *        schedule_test TEST --schedule=C,.. replay one depth-first schedule
+ */
+
+#include <iostream>
+#include <map>
+#include <string>
+
+#include "caltrain.hh"
+#include "party.hh"
+#include "schedule.hh"
+
+using namespace std;
+
+typedef BasicStation<ControlledMutex, ControlledCondVar> TestStation;
+typedef BasicParty<ControlledMutex, ControlledCondVar> TestParty;
+
+/**
+ * A station and its actors for one execution. Errors are recorded rather
+ * than returned so a scenario reads as a list of phases; only the first
+ * is kept.
+ */
+struct StationWorld {
+    ControlledScheduler& scheduler;
+    TestStation station;
+
+    // Passengers that have returned from wait_for_train, and trains that
+    // have returned from load_train.
+    int boarding = 0;
+    int loaded = 0;
+
+    string error;
+
+    explicit StationWorld(ControlledScheduler& scheduler)
+        : scheduler(scheduler)
+    {}
+
+    // A passenger that waits for a train; boarded() is left to the test.
+    void passenger()
+    {
+        scheduler.spawn([this] {
+            station.wait_for_train();
+            boarding++;
+        });
+    }
+
+    void train(int seats)
+    {
+        scheduler.spawn([this, seats] {
+            station.load_train(seats);
+            loaded++;
+        });
+    }
+
+    void boarded()
+    {
+        scheduler.spawn([this] { station.boarded(); });
+    }
+
+    void check(bool ok, const string& what)
+    {
+        if (!ok && error.empty()) {
+            error = what;
+        }
+    }
+
+    // Runs until no actor can make progress, then checks the counts and
+    // the number of actors still blocked.
+    void expect(const string& phase, int expectBoarding, int expectLoaded,
+            size_t expectBlocked)
+    {
+        size_t blocked = scheduler.run();
+        check(boarding == expectBoarding && loaded == expectLoaded
+                && blocked == expectBlocked, "after " + phase + ": expected "
+                + to_string(expectBoarding) + " boarding, "
+                + to_string(expectLoaded) + " trains departed and "
+                + to_string(expectBlocked) + " blocked, but got "
+                + to_string(boarding) + ", " + to_string(loaded) + " and "
+                + to_string(blocked));
+    }
+};
+
+string no_waiting_passengers(ControlledScheduler& scheduler)
+{
+    StationWorld w(scheduler);
+    w.train(0);
+    w.expect("full train arrives", 0, 1, 0);
+    w.train(10);
+    w.expect("train with 10 seats arrives", 0, 2, 0);
+    return w.error;
+}
+
+string train_wait_until_boarded(ControlledScheduler& scheduler)
+{
+    StationWorld w(scheduler);
+    w.passenger();
+    w.expect("passenger arrives", 0, 0, 1);
+    w.train(3);
+    w.expect("train with 3 seats arrives", 1, 0, 1);
+    w.boarded();
+    w.expect("passenger finishes boarding", 1, 1, 0);
+    return w.error;
+}
+
+string full_train_departs(ControlledScheduler& scheduler)
+{
+    StationWorld w(scheduler);
+    w.passenger();
+    w.expect("passenger arrives", 0, 0, 1);
+    w.train(0);
+    w.expect("full train arrives", 0, 1, 1);
+    w.train(3);
+    w.expect("train with 3 seats arrives", 1, 1, 1);
+    w.boarded();
+    w.expect("passenger finishes boarding", 1, 2, 0);
+    return w.error;
+}
+
+string passenger_arrives_during_boarding(ControlledScheduler& scheduler)
+{
+    StationWorld w(scheduler);
+    w.passenger();
+    w.expect("passenger arrives", 0, 0, 1);
+    w.train(3);
+    w.expect("train with 3 seats arrives", 1, 0, 1);
+    w.passenger();
+    w.expect("second passenger arrives", 2, 0, 1);
+    w.boarded();
+    w.expect("first passenger finishes boarding", 2, 0, 1);
+    w.boarded();
+    w.expect("second passenger finishes boarding", 2, 1, 0);
+    return w.error;
+}
+
+string board_in_parallel(ControlledScheduler& scheduler)
+{
+    StationWorld w(scheduler);
+    for (int i = 0; i < 4; i++) {
+        w.passenger();
+    }
+    w.expect("4 passengers arrive", 0, 0, 4);
+    w.train(3);
+    w.expect("train with 3 seats arrives", 3, 0, 2);
+    w.boarded();
+    w.boarded();
+    w.expect("2 passengers finish boarding", 3, 0, 2);
+    w.boarded();
+    w.expect("third passenger finishes boarding", 3, 1, 1);
+    w.train(10);
+    w.expect("train with 10 seats arrives", 4, 1, 1);
+    w.boarded();
+    w.expect("last passenger finishes boarding", 4, 2, 0);
+    return w.error;
+}
+
+string leftover(ControlledScheduler& scheduler)
+{
+    StationWorld w(scheduler);
+    w.train(10);
+    w.expect("train with 10 seats arrives", 0, 1, 0);
+    w.passenger();
+    w.expect("passenger arrives", 0, 1, 1);
+    w.train(1);
+    w.expect("train with 1 seat arrives", 1, 1, 1);
+    w.boarded();
+    w.expect("passenger finishes boarding", 1, 2, 0);
+    return w.error;
+}
+
+/* Passengers and a train arrive at the same time, so the train may find
+ * any number of them waiting; passengers board as soon as they get a
+ * seat. However the arrivals interleave, the train must leave with at
+ * most its 3 seats filled, and a second, larger train must take everyone
+ * else.
+ */
+string concurrent_arrivals(ControlledScheduler& scheduler)
+{
+    StationWorld w(scheduler);
+    for (int i = 0; i < 4; i++) {
+        scheduler.spawn([&w] {
+            w.station.wait_for_train();
+            w.boarding++;
+            w.station.boarded();
+        });
+    }
+    w.train(3);
+    size_t blocked = scheduler.run();
+    w.check(w.loaded == 1 && w.boarding <= 3
+            && blocked == static_cast<size_t>(4 - w.boarding),
+            "first train left with " + to_string(w.boarding)
+            + " passengers and " + to_string(blocked) + " blocked");
+    w.train(10);
+    w.expect("train with 10 seats arrives", 4, 2, 0);
+    return w.error;
+}
+
+/**
+ * A party and its guests for one execution; like StationWorld.
+ */
+struct PartyWorld {
+    ControlledScheduler& scheduler;
+    TestParty party;
+
+    // Each guest's match, once meet has returned.
+    map<string, string> matches;
+
+    string error;
+
+    explicit PartyWorld(ControlledScheduler& scheduler)
+        : scheduler(scheduler)
+    {}
+
+    void guest(const string& name, int my_sign, int other_sign)
+    {
+        scheduler.spawn([this, name, my_sign, other_sign] {
+            string my_name = name;
+            string match = party.meet(my_name, my_sign, other_sign);
+            matches[name] = match;
+        });
+    }
+
+    void expect(const string& phase, const map<string, string>& expected,
+            size_t expectBlocked)
+    {
+        size_t blocked = scheduler.run();
+        if (error.empty() && (matches != expected
+                || blocked != expectBlocked)) {
+            error = "after " + phase + ": matches are";
+            for (auto& m : matches) {
+                error += " " + m.first + "=" + m.second;
+            }
+            error += ", " + to_string(blocked) + " blocked";
+        }
+    }
+};
+
+string two_guests_perfect_match(ControlledScheduler& scheduler)
+{
+    PartyWorld w(scheduler);
+    w.guest("guest_a", 0, 5);
+    w.expect("guest_a arrives", {}, 1);
+    w.guest("guest_b", 5, 0);
+    w.expect("guest_b arrives", {{"guest_a", "guest_b"},
+            {"guest_b", "guest_a"}}, 0);
+    return w.error;
+}
+
+string return_in_order(ControlledScheduler& scheduler)
+{
+    PartyWorld w(scheduler);
+    w.guest("guest_a", 1, 3);
+    w.expect("guest_a arrives", {}, 1);
+    w.guest("guest_b", 1, 3);
+    w.expect("guest_b arrives", {}, 2);
+    w.guest("guest_c", 1, 3);
+    w.expect("guest_c arrives", {}, 3);
+    map<string, string> expected = {{"guest_a", "guest_d"},
+            {"guest_d", "guest_a"}};
+    w.guest("guest_d", 3, 1);
+    w.expect("guest_d arrives", expected, 2);
+    expected.insert({{"guest_b", "guest_e"}, {"guest_e", "guest_b"}});
+    w.guest("guest_e", 3, 1);
+    w.expect("guest_e arrives", expected, 1);
+    expected.insert({{"guest_c", "guest_f"}, {"guest_f", "guest_c"}});
+    w.guest("guest_f", 3, 1);
+    w.expect("guest_f arrives", expected, 0);
+    return w.error;
+}
+
+/* Three guests of each of two complementary signs arrive at once. In any
+ * interleaving everyone must be matched, with a guest of the other sign
+ * who was matched with them in turn.
+ */
+string crowd(ControlledScheduler& scheduler)
+{
+    PartyWorld w(scheduler);
+    for (int i = 0; i < 3; i++) {
+        w.guest("aries_" + to_string(i), 0, 1);
+        w.guest("taurus_" + to_string(i), 1, 0);
+    }
+    size_t blocked = scheduler.run();
+    if (blocked != 0 || w.matches.size() != 6) {
+        return to_string(w.matches.size()) + " guests matched and "
+                + to_string(blocked) + " blocked";
+    }
+    for (auto& m : w.matches) {
+        auto other = w.matches.find(m.second);
+        if (m.first.substr(0, 5) == m.second.substr(0, 5)
+                || other == w.matches.end() || other->second != m.first) {
+            return m.first + " matched " + m.second;
+        }
+    }
+    return "";
+}
+
+int main(int argc, char *argv[])
+{
+    map<string, Scenario> tests;
+    tests["no_waiting_passengers"] = no_waiting_passengers;
+    tests["train_wait_until_boarded"] = train_wait_until_boarded;
+    tests["full_train_departs"] = full_train_departs;
+    tests["passenger_arrives_during_boarding"] =
+            passenger_arrives_during_boarding;
+    tests["board_in_parallel"] = board_in_parallel;
+    tests["leftover"] = leftover;
+    tests["concurrent_arrivals"] = concurrent_arrivals;
+    tests["two_guests_perfect_match"] = two_guests_perfect_match;
+    tests["return_in_order"] = return_in_order;
+    tests["crowd"] = crowd;
+
+    if (argc == 1) {
+        cout << "Available tests are:" << endl;
+        for (auto& t : tests) {
+            cout << "\t" << t.first << endl;
+        }
+        return 0;
+    }
+    auto test = tests.find(argv[1]);
+    if (test == tests.end()) {
+        cout << "No test named '" << argv[1] << "'" << endl;
+        return 1;
+    }
+
+    if (argc > 2) {
+        string error = replay(test->second, argv[2]);
+        if (!error.empty()) {
+            cout << "Error: " << error << endl;
+            return 1;
+        }
+        cout << "Schedule " << argv[2] << " passed" << endl;
+        return 0;
+    }
+
+    ExploreResult result = explore(test->second);
+    if (!result.error.empty()) {
+        cout << "Error: " << result.error << endl;
+        cout << "Replay with: " << argv[0] << " " << argv[1] << " "
+             << result.replay << endl;
+        return 1;
+    }
+    cout << result.executions << " schedules passed"
+         << (result.exhaustive ? " (search complete)" : "") << endl;
+    return 0;
+}
@@ -0,0 +1,6 @@
+// This file contains the compiled instance of the ShardedParty methods,
+// which are defined as templates in sharded-party.hh.
+
+#include "sharded-party.hh"
+
+template class BasicShardedParty<>;
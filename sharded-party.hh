@@ -0,0 +1,255 @@
+// A party split into shards, one per NUMA node or last-level cache, for
+// hosts where a single Party's lock and waiting lists would bounce
+// between sockets. Each shard has its own lock and waiting lists, and a
+// guest arrives at the shard of the CPU it is running on. A guest first
+// looks for a match in its own shard, exactly as in Party. Only if there
+// is none does it look in other shards.
+//
+// A guest that finds no match locally joins its shard's waiting list and
+// counts itself in the shard's presence counter for its sign pair, then
+// reads the counters of the complementary pair in every other shard,
+// without their locks. If one is nonzero, it takes that shard's lock and
+// its own, in shard order, and matches itself with the oldest guest
+// waiting there. Two complementary guests arriving at different shards at
+// the same time each count themselves before reading the other's counter,
+// so at least one of them sees the other, and no match is lost.
+//
+// There is no admission control, and metrics are not kept.
+
+#ifndef SHARDED_PARTY_H
+#define SHARDED_PARTY_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "event-trace.hh"
+#include "party.hh"
+#include "thread-utils.h"
+
+// What a BasicShardedParty keeps one shard for.
+enum class ShardDomain {
+    NODE,
+    LLC,
+};
+
+template <typename LockPolicy = std::mutex,
+          typename WaitPolicy = std::condition_variable_any>
+class BasicShardedParty {
+public:
+    // One shard per NUMA node or last-level cache among the CPUs the
+    // calling thread may run on. CPUs whose node or cache the kernel does
+    // not report share one shard.
+    explicit BasicShardedParty(ShardDomain domain = ShardDomain::NODE);
+
+    // numShards shards, with CPU i arriving at shard i % numShards.
+    explicit BasicShardedParty(int numShards);
+
+    // Like Party::meet, arriving at the shard of the calling thread's CPU.
+    std::string meet(std::string &my_name, int my_sign, int other_sign)
+    {
+        return meet_at(shard_of(current_cpu()), my_name, my_sign,
+                other_sign);
+    }
+
+    // Like meet, arriving at the given shard.
+    std::string meet_at(int shard, std::string &my_name, int my_sign,
+            int other_sign);
+
+    int num_shards() const { return numShards_; }
+
+    // The shard a guest running on cpu arrives at.
+    int shard_of(int cpu) const
+    {
+        return static_cast<std::size_t>(cpu) < cpuShard_.size()
+                ? cpuShard_[cpu] : cpu % numShards_;
+    }
+
+    // Matches made within one shard, and with a guest from another shard.
+    long local_matches() const;
+    long remote_matches() const;
+
+private:
+    struct Guest {
+        std::string name;
+        std::string *match;
+        bool *isMatched;
+        WaitPolicy *match_found;
+    };
+
+    // Each part on its own cache lines: the lock and the lists it
+    // protects are written by this shard's guests, while the presence
+    // counters are also read by other shards' guests.
+    struct Shard {
+        alignas(64) LockPolicy mutex_;
+
+        alignas(64) std::deque<Guest> guestsWaiting[NUM_SIGNS][NUM_SIGNS];
+        long localMatches = 0;
+        long remoteMatches = 0;
+
+        // The size of each list in guestsWaiting; changed under mutex_.
+        alignas(64) std::atomic<int> present[NUM_SIGNS][NUM_SIGNS];
+
+        // What the wait policy has learned from this shard's guests,
+        // each of which waits on its own condition variable.
+        alignas(64) typename WaitStats<WaitPolicy>::type
+                waitStats[NUM_SIGNS][NUM_SIGNS];
+    };
+
+    // Records a match between guests a and b and wakes b.
+    static void match(Guest& a, Guest& b);
+
+    // Matches my, waiting in home with these signs, with the oldest
+    // complementary guest waiting in remote. Returns true if my is now
+    // matched, whether by this call or by another guest.
+    bool steal(int home, int remote, int my_sign, int other_sign,
+            Guest& my);
+
+    std::vector<int> cpuShard_;
+    int numShards_;
+    std::unique_ptr<Shard[]> shards_;
+};
+
+typedef BasicShardedParty<> ShardedParty;
+
+template <typename LockPolicy, typename WaitPolicy>
+BasicShardedParty<LockPolicy, WaitPolicy>::BasicShardedParty(
+        ShardDomain domain)
+{
+    std::map<int, int> shardOfDomain;
+    for (const CpuInfo& cpu : cpu_topology()) {
+        int id = domain == ShardDomain::NODE ? cpu.node : cpu.llc;
+        int shard = shardOfDomain.emplace(id, shardOfDomain.size())
+                .first->second;
+        cpuShard_.resize(std::max<std::size_t>(cpuShard_.size(),
+                cpu.cpu + 1), 0);
+        cpuShard_[cpu.cpu] = shard;
+    }
+    numShards_ = std::max<int>(1, shardOfDomain.size());
+    shards_.reset(new Shard[numShards_]);
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+BasicShardedParty<LockPolicy, WaitPolicy>::BasicShardedParty(int numShards)
+    : numShards_(numShards)
+    , shards_(new Shard[numShards])
+{}
+
+template <typename LockPolicy, typename WaitPolicy>
+std::string BasicShardedParty<LockPolicy, WaitPolicy>::meet_at(int shard,
+        std::string &my_name, int my_sign, int other_sign)
+{
+    Shard& home = shards_[shard];
+    trace_event(TRACE_GUEST_ARRIVE, &home, my_sign << 8 | other_sign);
+    std::unique_lock<LockPolicy> lock(home.mutex_);
+
+    std::string match_name;
+    bool matched = false;
+    WaitPolicy match_found = make_wait_policy<WaitPolicy>(
+            home.waitStats[my_sign][other_sign]);
+    Guest my = {my_name, &match_name, &matched, &match_found};
+
+    std::deque<Guest>& local = home.guestsWaiting[other_sign][my_sign];
+    if (!local.empty()) {
+        Guest other = local.front();
+        local.pop_front();
+        home.present[other_sign][my_sign]--;
+        match(my, other);
+        home.localMatches++;
+        trace_event(TRACE_GUEST_MATCH, &home, other_sign << 8 | my_sign);
+        trace_event(TRACE_GUEST_DEPART, &home);
+        return match_name;
+    }
+
+    // Counted before looking at other shards (see the top of this file).
+    home.guestsWaiting[my_sign][other_sign].push_back(my);
+    home.present[my_sign][other_sign]++;
+    lock.unlock();
+
+    for (int i = 1; i < numShards_; i++) {
+        int remote = (shard + i) % numShards_;
+        if (shards_[remote].present[other_sign][my_sign].load() > 0
+                && steal(shard, remote, my_sign, other_sign, my)) {
+            break;
+        }
+    }
+
+    lock.lock();
+    while (!matched) {
+        match_found.wait(lock);
+    }
+    trace_event(TRACE_GUEST_DEPART, &home);
+    return match_name;
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+void BasicShardedParty<LockPolicy, WaitPolicy>::match(Guest& a, Guest& b)
+{
+    *a.match = b.name;
+    *a.isMatched = true;
+    *b.match = a.name;
+    *b.isMatched = true;
+    b.match_found->notify_all();
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+bool BasicShardedParty<LockPolicy, WaitPolicy>::steal(int home, int remote,
+        int my_sign, int other_sign, Guest& my)
+{
+    Shard& h = shards_[home];
+    Shard& r = shards_[remote];
+    std::unique_lock<LockPolicy> first(home < remote ? h.mutex_ : r.mutex_);
+    std::unique_lock<LockPolicy> second(home < remote ? r.mutex_ : h.mutex_);
+    if (*my.isMatched) {
+        return true;
+    }
+    std::deque<Guest>& theirs = r.guestsWaiting[other_sign][my_sign];
+    if (theirs.empty()) {
+        return false;
+    }
+
+    std::deque<Guest>& mine = h.guestsWaiting[my_sign][other_sign];
+    mine.erase(std::find_if(mine.begin(), mine.end(),
+            [&my](const Guest& g) { return g.isMatched == my.isMatched; }));
+    h.present[my_sign][other_sign]--;
+    Guest other = theirs.front();
+    theirs.pop_front();
+    r.present[other_sign][my_sign]--;
+    match(my, other);
+    h.remoteMatches++;
+    trace_event(TRACE_GUEST_MATCH, &r, other_sign << 8 | my_sign);
+    return true;
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+long BasicShardedParty<LockPolicy, WaitPolicy>::local_matches() const
+{
+    long total = 0;
+    for (int i = 0; i < numShards_; i++) {
+        std::lock_guard<LockPolicy> lock(shards_[i].mutex_);
+        total += shards_[i].localMatches;
+    }
+    return total;
+}
+
+template <typename LockPolicy, typename WaitPolicy>
+long BasicShardedParty<LockPolicy, WaitPolicy>::remote_matches() const
+{
+    long total = 0;
+    for (int i = 0; i < numShards_; i++) {
+        std::lock_guard<LockPolicy> lock(shards_[i].mutex_);
+        total += shards_[i].remoteMatches;
+    }
+    return total;
+}
+
+// ShardedParty is compiled once, in sharded-party.cc.
+extern template class BasicShardedParty<>;
+
+#endif /* SHARDED_PARTY_H */
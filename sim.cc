@@ -0,0 +1,61 @@
+// This file contains the implementation of the discrete-event simulator.
+
+#include "sim.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+Simulator::Simulator(size_t stackSize)
+    : stackSize_(stackSize)
+    , now_(0)
+    , nextSeq_(0)
+{}
+
+Simulator::~Simulator()
+{
+    for (Fiber *fiber : live_) {
+        delete fiber;
+    }
+}
+
+void Simulator::spawn(function<void()> fn)
+{
+    Fiber *fiber = new Fiber(this, move(fn), stackSize_);
+    live_.insert(fiber);
+    ready_.push(fiber);
+}
+
+void Simulator::sleep_until(double time)
+{
+    parkLock_.lock();
+    wakeups_.push({max(time, now_), nextSeq_++, Fiber::current()});
+    Fiber::park(parkLock_);
+}
+
+void Simulator::ready(Fiber *fiber)
+{
+    ready_.push(fiber);
+}
+
+size_t Simulator::run(double until)
+{
+    while (true) {
+        if (Fiber *fiber = ready_.pop()) {
+            if (fiber->resume()) {
+                live_.erase(fiber);
+                delete fiber;
+            }
+        } else if (!wakeups_.empty() && wakeups_.top().time <= until) {
+            now_ = wakeups_.top().time;
+            ready_.push(wakeups_.top().fiber);
+            wakeups_.pop();
+        } else {
+            break;
+        }
+    }
+    if (!wakeups_.empty() && until != FOREVER) {
+        now_ = until;
+    }
+    return live_.size() - wakeups_.size();
+}
@@ -0,0 +1,86 @@
+// A deterministic discrete-event simulator built on fibers. Every actor
+// (passenger, train, guest) is a fiber that runs ordinary blocking code
+// against a BasicStation or BasicParty instantiated with NullLock and
+// FiberCondVar, so it exercises the same Station and Party logic as the
+// threaded programs. Time is virtual: sleeping schedules a wakeup event
+// instead of waiting, and the clock jumps straight to the next event, so
+// days of traffic take seconds to simulate and every run with the same
+// inputs produces the same results.
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <unordered_set>
+#include <vector>
+
+#include "fiber.hh"
+
+/**
+ * Class: Simulator
+ * ----------------
+ * Runs fibers one at a time on the calling thread in virtual time. Fibers
+ * made ready at the current time run in the order they were readied;
+ * wakeups at equal times run in the order they were scheduled.
+ */
+class Simulator : public FiberScheduler {
+public:
+    static constexpr double FOREVER = std::numeric_limits<double>::infinity();
+
+    explicit Simulator(std::size_t stackSize = 32 * 1024);
+
+    // Destroys any fibers still blocked; objects they were waiting on
+    // must not be used to wake them afterwards.
+    ~Simulator();
+
+    // The current virtual time, in seconds.
+    double now() const { return now_; }
+
+    // Starts a fiber running fn at the current time.
+    void spawn(std::function<void()> fn);
+
+    // Called from one of this simulator's fibers: suspends it until the
+    // virtual clock reaches time (or for duration seconds).
+    void sleep_until(double time);
+    void sleep_for(double duration) { sleep_until(now_ + duration); }
+
+    // Runs events until none remain at or before until, leaving the clock
+    // at the last event (or at until, if later events are pending).
+    // Returns the number of fibers blocked on something other than a
+    // sleep; once all events have run, those can never wake.
+    std::size_t run(double until = FOREVER);
+
+    // Fibers started and not yet finished.
+    std::size_t live() const { return live_.size(); }
+
+    void ready(Fiber *fiber) override;
+
+private:
+    struct Wakeup {
+        double time;
+        std::uint64_t seq;
+        Fiber *fiber;
+
+        bool operator>(const Wakeup& other) const
+        {
+            return time != other.time ? time > other.time : seq > other.seq;
+        }
+    };
+
+    const std::size_t stackSize_;
+    double now_;
+    std::uint64_t nextSeq_;
+    FiberQueue ready_;
+    std::priority_queue<Wakeup, std::vector<Wakeup>, std::greater<Wakeup>>
+            wakeups_;
+    std::unordered_set<Fiber *> live_;
+
+    // Held across Fiber::park by a sleeping fiber; never contended.
+    SpinLock parkLock_;
+};
+
+#endif /* SIM_H */
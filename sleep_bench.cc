@@ -0,0 +1,104 @@
+/*
+ * Measures how late sleeps wake up. For each requested duration it times
+ * --samples sleeps with std::this_thread::sleep_for, clock_nanosleep and
+ * the hybrid sleep_for_ns from thread-utils, and prints one JSON object
+ * per (method, duration) with the distribution of wakeup overshoot and
+ * the CPU time each sleep consumed.
+ *
+ * Usage: sleep_bench [--samples=N] [--durations=NS,NS,...]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+#include "thread-utils.h"
+
+using namespace std;
+
+static uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_std(uint64_t ns)
+{
+    this_thread::sleep_for(chrono::nanoseconds(ns));
+}
+
+static void sleep_nanosleep(uint64_t ns)
+{
+    struct timespec ts = {static_cast<time_t>(ns / 1000000000),
+            static_cast<long>(ns % 1000000000)};
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, nullptr);
+}
+
+static void run(const char *method, void (*sleep)(uint64_t),
+        uint64_t request, int samples)
+{
+    vector<uint64_t> overshoot;
+    uint64_t cpu_start = thread_cpu_ns();
+    for (int i = 0; i < samples; i++) {
+        uint64_t start = monotonic_ns();
+        sleep(request);
+        overshoot.push_back(monotonic_ns() - start - request);
+    }
+    uint64_t cpu = thread_cpu_ns() - cpu_start;
+    sort(overshoot.begin(), overshoot.end());
+    auto pct = [&overshoot](double p) {
+        return overshoot[static_cast<size_t>(p / 100 * (overshoot.size() - 1))];
+    };
+    cout << "{\"bench\": \"sleep\", \"method\": \"" << method << "\""
+         << ", \"request_ns\": " << request
+         << ", \"samples\": " << samples
+         << ", \"overshoot_ns\": {\"p50\": " << pct(50)
+         << ", \"p90\": " << pct(90) << ", \"p99\": " << pct(99)
+         << ", \"max\": " << overshoot.back() << "}"
+         << ", \"cpu_ns_per_sleep\": " << cpu / samples << "}" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int samples = 200;
+    vector<uint64_t> durations = {1000, 10000, 50000, 100000, 500000,
+            1000000};
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--samples=", 10) == 0) {
+            samples = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--durations=", 12) == 0) {
+            durations.clear();
+            stringstream list(argv[i] + 12);
+            string item;
+            while (getline(list, item, ',')) {
+                durations.push_back(stoull(item));
+            }
+        } else {
+            cerr << "Usage: sleep_bench [--samples=N] "
+                    "[--durations=NS,NS,...]" << endl;
+            return 1;
+        }
+    }
+    if (samples < 1 || durations.empty()) {
+        cerr << "need at least one sample and one duration" << endl;
+        return 1;
+    }
+
+    // Calibrate the hybrid sleep before timing anything.
+    sleep_for_ns(1);
+
+    for (uint64_t request : durations) {
+        run("std", sleep_std, request, samples);
+        run("nanosleep", sleep_nanosleep, request, samples);
+        run("hybrid", sleep_for_ns, request, samples);
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+// A scalable non-zero indicator (SNZI), after Ellen, Lev, Luchangco and
+// Moir, "SNZI: Scalable NonZero Indicators" (PODC 2007). It answers only
+// "has anyone arrived who has not yet departed?", which is all Station
+// needs to know about waiting passengers, and in exchange spreads arrivals
+// and departures over per-CPU leaves so they rarely touch a shared line.
+//
+// The tree has two levels. Each leaf counts the arrivals made through it;
+// the root counts the leaves that are non-zero. A leaf touches the root
+// only when it goes from zero to non-zero or back, so with many arrivals
+// in flight almost all traffic stays on the leaves, and nonzero() is one
+// load of the root. A leaf leaving zero passes through a "half" state in
+// which it has announced itself to the root but not yet to other arrivals
+// at the same leaf; an arrival that finds a half leaf helps finish the
+// transition, so no arrival can return before the root is non-zero.
+
+#ifndef SNZI_H
+#define SNZI_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include <sched.h>
+
+class alignas(64) Snzi {
+public:
+    // numLeaves = 0 means one per hardware thread, up to 64.
+    explicit Snzi(std::size_t numLeaves = 0)
+        : numLeaves_(numLeaves ? numLeaves
+                : std::clamp<std::size_t>(std::thread::hardware_concurrency(),
+                        1, 64))
+        , leaves_(new Leaf[numLeaves_])
+        , root_(0)
+    {}
+
+    Snzi(const Snzi&) = delete;
+    Snzi& operator=(const Snzi&) = delete;
+
+    // Records an arrival at the calling CPU's leaf and returns the leaf,
+    // which must be passed to the matching depart().
+    std::size_t arrive()
+    {
+        int cpu = sched_getcpu();
+        std::size_t leaf = (cpu >= 0 ? cpu : 0) % numLeaves_;
+        arrive_at(leaves_[leaf].state);
+        return leaf;
+    }
+
+    void depart(std::size_t leaf)
+    {
+        std::atomic<std::uint64_t>& state = leaves_[leaf].state;
+        std::uint64_t x = state.load(std::memory_order_relaxed);
+        while (!state.compare_exchange_weak(x, pack(count(x) - 2, version(x)),
+                std::memory_order_release, std::memory_order_relaxed)) {}
+        if (count(x) == 2) {
+            root_.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    // True if some arrival has not yet departed.
+    bool nonzero() const
+    {
+        return root_.load(std::memory_order_acquire) != 0;
+    }
+
+    // The number of arrivals not yet departed, from one relaxed load of
+    // each leaf; exact when nobody is arriving or departing, and cheap
+    // enough to poll, but it reads every leaf, unlike nonzero().
+    std::size_t estimate() const
+    {
+        std::size_t halves = 0;
+        for (std::size_t i = 0; i < numLeaves_; i++) {
+            halves += count(leaves_[i].state.load(
+                    std::memory_order_relaxed));
+        }
+        return (halves + 1) / 2;
+    }
+
+private:
+    // A leaf's state packs its count, in halves (so 1 is the half state),
+    // with a version that changes every time the leaf leaves zero.
+    struct alignas(64) Leaf {
+        std::atomic<std::uint64_t> state = 0;
+    };
+
+    static std::uint32_t count(std::uint64_t x) { return x; }
+    static std::uint32_t version(std::uint64_t x) { return x >> 32; }
+    static std::uint64_t pack(std::uint32_t count, std::uint32_t version)
+    {
+        return static_cast<std::uint64_t>(version) << 32 | count;
+    }
+
+    void arrive_at(std::atomic<std::uint64_t>& state)
+    {
+        int undo = 0;
+        bool done = false;
+        while (!done) {
+            std::uint64_t x = state.load(std::memory_order_acquire);
+            std::uint32_t c = count(x);
+            std::uint32_t v = version(x);
+            if (c >= 2) {
+                done = state.compare_exchange_strong(x, pack(c + 2, v));
+                continue;
+            }
+            if (c == 0) {
+                if (!state.compare_exchange_strong(x, pack(1, v + 1))) {
+                    continue;
+                }
+                x = pack(1, v + 1);
+                done = true;
+            }
+
+            // The leaf is half way out of zero (by us or by someone we are
+            // helping): make sure the root counts it, then complete the
+            // transition. If someone else completed it first, our root
+            // arrival was surplus.
+            root_.fetch_add(1);
+            if (!state.compare_exchange_strong(x, pack(2, version(x)))) {
+                undo++;
+            }
+        }
+        while (undo-- > 0) {
+            root_.fetch_sub(1);
+        }
+    }
+
+    const std::size_t numLeaves_;
+    const std::unique_ptr<Leaf[]> leaves_;
+
+    // Number of non-zero leaves; on its own cache line.
+    alignas(64) std::atomic<std::int64_t> root_;
+};
+
+#endif /* SNZI_H */
@@ -0,0 +1,118 @@
+/*
+ * Compares ways of tracking "is anyone waiting?" under concurrent arrivals:
+ * the Snzi indicator Station uses, a single shared atomic counter, and an
+ * int guarded by a std::mutex (what Station did before). For each thread
+ * count, every thread performs --ops arrive/depart pairs while one more
+ * thread polls the indicator, as a train would. Prints one JSON object per
+ * (indicator, threads).
+ *
+ * Usage: snzi_bench [--ops=N] [--threads=N,N,...]
+ */
+
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "snzi.hh"
+#include "thread-utils.h"
+
+using namespace std;
+
+class AtomicIndicator {
+public:
+    size_t arrive() { count_.fetch_add(1); return 0; }
+    void depart(size_t) { count_.fetch_sub(1); }
+    bool nonzero() const { return count_.load() != 0; }
+
+private:
+    alignas(64) atomic<long> count_ = 0;
+};
+
+class MutexIndicator {
+public:
+    size_t arrive() { lock_guard<mutex> lock(mutex_); count_++; return 0; }
+    void depart(size_t) { lock_guard<mutex> lock(mutex_); count_--; }
+    bool nonzero()
+    {
+        lock_guard<mutex> lock(mutex_);
+        return count_ != 0;
+    }
+
+private:
+    mutex mutex_;
+    long count_ = 0;
+};
+
+template <typename Indicator>
+static void run(const char *name, int threads, long ops)
+{
+    Indicator indicator;
+    atomic<bool> done = false;
+    long queries = 0;
+    thread poller([&] {
+        while (!done.load(memory_order_relaxed)) {
+            indicator.nonzero();
+            queries++;
+        }
+    });
+
+    uint64_t start = monotonic_ns();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&indicator, ops] {
+            for (long i = 0; i < ops; i++) {
+                indicator.depart(indicator.arrive());
+            }
+        });
+    }
+    for (thread& w : workers) {
+        w.join();
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    done = true;
+    poller.join();
+
+    cout << "{\"bench\": \"indicator\", \"indicator\": \"" << name << "\""
+         << ", \"threads\": " << threads
+         << ", \"arrivals\": " << threads * ops
+         << ", \"arrivals_per_sec\": " << threads * ops / seconds
+         << ", \"queries_per_sec\": " << queries / seconds << "}" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    long ops = 1000000;
+    vector<int> threadCounts;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--ops=", 6) == 0) {
+            ops = atol(argv[i] + 6);
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            stringstream list(argv[i] + 10);
+            string item;
+            while (getline(list, item, ',')) {
+                threadCounts.push_back(stoi(item));
+            }
+        } else {
+            cerr << "Usage: snzi_bench [--ops=N] [--threads=N,N,...]" << endl;
+            return 1;
+        }
+    }
+    if (threadCounts.empty()) {
+        int max = std::max(4u, thread::hardware_concurrency());
+        for (int n = 1; n <= max; n *= 2) {
+            threadCounts.push_back(n);
+        }
+    }
+
+    for (int threads : threadCounts) {
+        run<Snzi>("snzi", threads, ops);
+        run<AtomicIndicator>("atomic", threads, ops);
+        run<MutexIndicator>("mutex", threads, ops);
+    }
+    return 0;
+}
@@ -0,0 +1,441 @@
+/*
+ * Benchmark for the Station class under each lock and wait policy (see
+ * sync-policies.hh). A fixed population of passengers rides repeatedly:
+ * each calls wait_for_train and boarded in a loop, while one train keeps
+ * calling load_train until every ride has happened. Prints one JSON object
+ * per configuration.
+ *
+ * Usage: station_bench [--lock=std|spin|futex|morphing|instrumented|fiber
+ *                              |null]
+ *                      [--wait=std|futex|adaptive|morphing|fiber]
+ *                      [--max-spin-us=N] [--passengers=N]
+ *                      [--rides=N] [--seats=N] [--doors=N]
+ *                      [--threads=N]
+ *                      [--workload=rides|dock|depart|conveyor]
+ *
+ * The std, spin and futex policies run passengers and the train as kernel
+ * threads. fiber/fiber runs them as fibers on a FiberRuntime with
+ * --threads threads, and null/fiber on a single-threaded one. With
+ * instrumented/std, the lock's contention profile is printed on stderr.
+ * --max-spin-us sets AdaptiveCondVar's spin cap.
+ * Without --lock and --wait, every configuration is run in turn. Hardware
+ * and software event counts per ride are included where perf events are
+ * available (see perf-counters.hh).
+ *
+ * --workload=dock measures wakeups instead of throughput, for kernel-thread
+ * configurations only: in each round every passenger blocks in
+ * wait_for_train, then one train with a seat for each of them calls
+ * load_train, and each passenger records how long after that call its
+ * wait_for_train returned. This is the case wait morphing (MorphingCondVar)
+ * is for: the notify_all wakes everyone, but they all need the lock.
+ *
+ * Trains have --doors doors (see load_train).
+ *
+ * --workload=depart measures how soon a large train leaves once boarding
+ * is done, for kernel-thread configurations only: in each round every
+ * passenger takes a seat on one train, waits until all the others have
+ * one too, and then they all call boarded at once. The latency is from the
+ * last boarded call to load_train's return; with several doors only the
+ * last passenger through each door takes the line's lock.
+ *
+ * --workload=conveyor is the rides workload on a continuously served line:
+ * instead of calling load_train, the producer publishes the rides' seats
+ * with add_seats, --seats at a time, and the line holds at most one
+ * unclaimed seat per passenger (set_seat_limit). It reports sustained
+ * passengers per second, to compare with rides at --seats=1.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "caltrain.hh"
+#include "fiber.hh"
+#include "instrumented-mutex.hh"
+#include "perf-counters.hh"
+#include "sync-policies.hh"
+#include "thread-utils.h"
+
+using namespace std;
+
+struct Options {
+    string lock;
+    string wait;
+    int passengers = 16;
+    long rides = 200000;
+    int seats = 8;
+    int doors = 1;
+    size_t threads = 2;
+    string workload = "rides";
+};
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// The JSON field for AdaptiveCondVar's spin cap, if it is in use.
+static string spin_cap(const Options& opts)
+{
+    return opts.wait != "adaptive" ? ""
+            : ", \"max_spin_us\": "
+                    + to_string(AdaptiveCondVar::max_spin_ns() / 1000);
+}
+
+// Prints ", "name": {p50, p99, max}" for samples in nanoseconds, as
+// microseconds.
+static void print_micros(const char *name, vector<uint64_t>& samples)
+{
+    sort(samples.begin(), samples.end());
+    auto pct = [&samples](double p) {
+        return samples[static_cast<size_t>(p / 100 * (samples.size() - 1))]
+                / 1e3;
+    };
+    cout << ", \"" << name << "\": {\"p50\": " << pct(50)
+         << ", \"p99\": " << pct(99) << ", \"max\": " << pct(100) << "}";
+}
+
+/**
+ * The dock workload (see above) on a station built with the given
+ * policies, with every passenger and the train a kernel thread.
+ */
+template <typename LockPolicy, typename WaitPolicy>
+static void dock(const Options& opts)
+{
+    BasicStation<LockPolicy, WaitPolicy> station;
+    int n = opts.passengers;
+    long rounds = opts.rides / n;
+    atomic<long> arrived = 0;
+    atomic<long> departed = 0;
+
+    // When the current round's load_train was called; passengers read it
+    // after wait_for_train, which orders the read after the write.
+    atomic<uint64_t> loadStart = 0;
+    vector<vector<uint64_t>> latencies(n);
+
+    PerfCounters perf;
+    perf.start();
+    uint64_t start = monotonic_ns();
+    vector<thread> threads;
+    for (int i = 0; i < n; i++) {
+        threads.emplace_back([&, i] {
+            latencies[i].reserve(rounds);
+            for (long r = 0; r < rounds; r++) {
+                arrived++;
+                station.wait_for_train();
+                latencies[i].push_back(monotonic_ns() - loadStart);
+                station.boarded();
+
+                // Otherwise a fast passenger could take a slow one's seat.
+                while (departed <= r) {
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    threads.emplace_back([&] {
+        for (long r = 1; r <= rounds; r++) {
+            while (arrived < r * n) {
+                this_thread::yield();
+            }
+            // Give the last arrival time to block.
+            sleep_for_ns(200000);
+            loadStart = monotonic_ns();
+            station.load_train(n);
+            departed++;
+        }
+    });
+    for (thread& t : threads) {
+        t.join();
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    perf.stop();
+
+    vector<uint64_t> all;
+    for (auto& l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    cout << "{\"bench\": \"station\", \"workload\": \"dock\""
+         << ", \"lock\": \"" << opts.lock
+         << "\", \"wait\": \"" << opts.wait << "\"" << spin_cap(opts)
+         << ", \"passengers\": " << n << ", \"rounds\": " << rounds
+         << ", \"seconds\": " << seconds;
+    print_micros("wake_us", all);
+    perf.write_json(cout, all.size(), "ride");
+    cout << "}" << endl;
+}
+
+/**
+ * The depart workload (see above) on a station built with the given
+ * policies, with every passenger and the train a kernel thread.
+ */
+template <typename LockPolicy, typename WaitPolicy>
+static void depart(const Options& opts)
+{
+    BasicStation<LockPolicy, WaitPolicy> station;
+    int n = opts.passengers;
+    long rounds = opts.rides / n;
+    atomic<long> arrived = 0;
+    atomic<long> seated = 0;
+    atomic<long> departed = 0;
+
+    // When the current round's last boarded call was made.
+    atomic<uint64_t> lastBoarded = 0;
+    vector<uint64_t> latencies;
+    latencies.reserve(rounds);
+
+    PerfCounters perf;
+    perf.start();
+    uint64_t start = monotonic_ns();
+    vector<thread> threads;
+    for (int i = 0; i < n; i++) {
+        threads.emplace_back([&] {
+            for (long r = 0; r < rounds; r++) {
+                arrived++;
+                int door = station.wait_for_train();
+                seated++;
+                while (seated < (r + 1) * n) {
+                    this_thread::yield();
+                }
+                uint64_t now = monotonic_ns();
+                uint64_t last = lastBoarded;
+                while (last < now
+                        && !lastBoarded.compare_exchange_weak(last, now)) {
+                }
+                station.boarded(0, door);
+                while (departed <= r) {
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    threads.emplace_back([&] {
+        for (long r = 1; r <= rounds; r++) {
+            while (arrived < r * n) {
+                this_thread::yield();
+            }
+            // Give the last arrival time to block.
+            sleep_for_ns(200000);
+            station.load_train(0, n, opts.doors);
+            latencies.push_back(monotonic_ns() - lastBoarded);
+            departed++;
+        }
+    });
+    for (thread& t : threads) {
+        t.join();
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    perf.stop();
+
+    cout << "{\"bench\": \"station\", \"workload\": \"depart\""
+         << ", \"lock\": \"" << opts.lock
+         << "\", \"wait\": \"" << opts.wait << "\"" << spin_cap(opts)
+         << ", \"passengers\": " << n << ", \"doors\": " << opts.doors
+         << ", \"rounds\": " << rounds << ", \"seconds\": " << seconds;
+    print_micros("depart_us", latencies);
+    perf.write_json(cout, rounds * n, "ride");
+    cout << "}" << endl;
+}
+
+/**
+ * Runs the workload on a station built with the given policies. If
+ * fiberThreads is nonzero, passengers and the train are fibers on a
+ * runtime with that many threads; otherwise each is a kernel thread.
+ */
+template <typename LockPolicy, typename WaitPolicy>
+static void run(const Options& opts, size_t fiberThreads)
+{
+    if (opts.workload == "dock") {
+        dock<LockPolicy, WaitPolicy>(opts);
+        return;
+    } else if (opts.workload == "depart") {
+        depart<LockPolicy, WaitPolicy>(opts);
+        return;
+    }
+    BasicStation<LockPolicy, WaitPolicy> station;
+    bool conveyor = opts.workload == "conveyor";
+    if (conveyor) {
+        station.set_seat_limit(opts.passengers);
+    }
+    atomic<long> boarded = 0;
+    long per_passenger = opts.rides / opts.passengers;
+    long total = per_passenger * opts.passengers;
+    int seats = opts.seats;
+    int doors = opts.doors;
+
+    auto passenger = [&station, &boarded, per_passenger] {
+        for (long i = 0; i < per_passenger; i++) {
+            int door = station.wait_for_train();
+            station.boarded(0, door);
+            boarded++;
+        }
+    };
+    auto train = [&station, &boarded, conveyor, total, seats, doors](
+            void (*yield)()) {
+        if (conveyor) {
+            for (long published = 0; published < total; published += seats) {
+                station.add_seats(min<long>(seats, total - published));
+                yield();
+            }
+            return;
+        }
+        while (boarded < total) {
+            station.load_train(0, seats, doors);
+            yield();
+        }
+    };
+
+    PerfCounters perf;
+    perf.start();
+    double cpu_start = cpu_seconds();
+    uint64_t start = monotonic_ns();
+    if (fiberThreads) {
+        FiberRuntime runtime(fiberThreads);
+        for (int i = 0; i < opts.passengers; i++) {
+            runtime.spawn(passenger);
+        }
+        runtime.spawn([&train] { train(Fiber::yield); });
+    } else {
+        vector<thread> threads;
+        for (int i = 0; i < opts.passengers; i++) {
+            threads.emplace_back(passenger);
+        }
+        threads.emplace_back([&train] { train(this_thread::yield); });
+        for (thread& t : threads) {
+            t.join();
+        }
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    double cpu = cpu_seconds() - cpu_start;
+    perf.stop();
+
+    cout << "{\"bench\": \"station\"";
+    if (conveyor) {
+        cout << ", \"workload\": \"conveyor\"";
+    }
+    cout << ", \"lock\": \"" << opts.lock
+         << "\", \"wait\": \"" << opts.wait << "\"" << spin_cap(opts)
+         << ", \"threads\": " << (fiberThreads ? fiberThreads
+                : opts.passengers + 1)
+         << ", \"passengers\": " << opts.passengers
+         << ", \"seats\": " << seats << ", \"doors\": " << doors
+         << ", \"rides\": " << total
+         << ", \"seconds\": " << seconds
+         << (conveyor ? ", \"passengers_per_sec\": "
+                : ", \"rides_per_sec\": ") << total / seconds
+         << ", \"cpu_ns_per_ride\": " << cpu * 1e9 / total;
+    perf.write_json(cout, total, "ride");
+    cout << "}" << endl;
+    LockProfile::report_all(cerr);
+}
+
+typedef void (*RunFn)(const Options&, size_t);
+
+// Every supported combination, each its own instance of BasicStation.
+// fibers is 0 for kernel threads, 1 for a single-threaded fiber runtime
+// and 2 for one with --threads threads.
+static const struct {
+    const char *lock;
+    const char *wait;
+    int fibers;
+    RunFn run;
+} CONFIGS[] = {
+    {"std", "std", 0, run<mutex, condition_variable_any>},
+    {"std", "futex", 0, run<mutex, FutexCondVar>},
+    {"spin", "std", 0, run<SpinLock, condition_variable_any>},
+    {"spin", "futex", 0, run<SpinLock, FutexCondVar>},
+    {"futex", "std", 0, run<FutexLock, condition_variable_any>},
+    {"futex", "futex", 0, run<FutexLock, FutexCondVar>},
+    {"futex", "adaptive", 0, run<FutexLock, AdaptiveCondVar>},
+    {"morphing", "morphing", 0, run<MorphingMutex, MorphingCondVar>},
+    {"instrumented", "std", 0,
+            run<InstrumentedMutex<>, condition_variable_any>},
+    {"fiber", "fiber", 2, run<FiberMutex, FiberCondVar>},
+    {"null", "fiber", 1, run<NullLock, FiberCondVar>},
+};
+
+static bool parse(const char *arg, const char *name, string *value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+        return false;
+    }
+    *value = arg + len + 1;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    for (int i = 1; i < argc; i++) {
+        string value;
+        if (parse(argv[i], "--lock", &opts.lock)
+                || parse(argv[i], "--wait", &opts.wait)) {
+            continue;
+        } else if (parse(argv[i], "--passengers", &value)) {
+            opts.passengers = atoi(value.c_str());
+        } else if (parse(argv[i], "--rides", &value)) {
+            opts.rides = atol(value.c_str());
+        } else if (parse(argv[i], "--seats", &value)) {
+            opts.seats = atoi(value.c_str());
+        } else if (parse(argv[i], "--doors", &value)) {
+            opts.doors = atoi(value.c_str());
+        } else if (parse(argv[i], "--threads", &value)) {
+            opts.threads = atoi(value.c_str());
+        } else if (parse(argv[i], "--max-spin-us", &value)) {
+            AdaptiveCondVar::set_max_spin_ns(atof(value.c_str()) * 1000);
+        } else if (parse(argv[i], "--workload", &opts.workload)
+                && (opts.workload == "rides" || opts.workload == "dock"
+                        || opts.workload == "depart"
+                        || opts.workload == "conveyor")) {
+            continue;
+        } else {
+            cerr << "Usage: station_bench "
+                    "[--lock=std|spin|futex|morphing|instrumented|fiber|null] "
+                    "[--wait=std|futex|adaptive|morphing|fiber] "
+                    "[--max-spin-us=N] [--passengers=N] "
+                    "[--rides=N] [--seats=N] [--doors=N] [--threads=N] "
+                    "[--workload=rides|dock|depart|conveyor]" << endl;
+            return 1;
+        }
+    }
+    if (opts.passengers < 1 || opts.rides < opts.passengers
+            || opts.seats < 1 || opts.threads < 1 || opts.doors < 1
+            || opts.doors > Station::MAX_DOORS) {
+        cerr << "need at least one passenger, seat and thread, one to "
+             << Station::MAX_DOORS << " doors, and at least one ride per "
+                "passenger" << endl;
+        return 1;
+    }
+
+    bool found = false;
+    for (const auto& config : CONFIGS) {
+        if ((!opts.lock.empty() && opts.lock != config.lock)
+                || (!opts.wait.empty() && opts.wait != config.wait)
+                || ((opts.workload == "dock" || opts.workload == "depart")
+                        && config.fibers)) {
+            continue;
+        }
+        Options o = opts;
+        o.lock = config.lock;
+        o.wait = config.wait;
+        config.run(o, config.fibers == 2 ? opts.threads : config.fibers);
+        found = true;
+    }
+    if (!found) {
+        cerr << "unknown --lock/--wait combination" << endl;
+        return 1;
+    }
+    return 0;
+}
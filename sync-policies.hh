@@ -0,0 +1,543 @@
+// Lock and wait policies for BasicStation and BasicParty. A lock policy is
+// any type with lock(), try_lock() and unlock(); a wait policy is any type
+// with a templated wait(Lock&) plus notify_one() and notify_all(); see
+// notify_some below for waking a given number of waiters. Each
+// combination is a separate instantiation, so the calls compile down to
+// the policy's own code with no virtual dispatch.
+//
+// Lock policies:  std::mutex, SpinLock (thread-utils.h), FutexLock,
+//                 MorphingMutex, FiberMutex (fiber.hh), NullLock
+// Wait policies:  std::condition_variable_any, FutexCondVar, AdaptiveCondVar,
+//                 MorphingCondVar (with MorphingMutex only),
+//                 FiberCondVar (fiber.hh)
+//
+// NullLock does nothing, so it is only correct when every caller runs on
+// one kernel thread and can only be suspended inside wait(); pair it with
+// FiberCondVar on a single-threaded fiber scheduler, as simulations do.
+
+#ifndef SYNC_POLICIES_H
+#define SYNC_POLICIES_H
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+#include <linux/futex.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "thread-utils.h"
+
+/**
+ * Function: futex_wait, futex_wake
+ * --------------------------------
+ * Thin wrappers for the private futex operations: futex_wait sleeps while
+ * *word == expected (it may also return spuriously), and futex_wake wakes
+ * up to count threads sleeping on word.
+ */
+inline void futex_wait(std::atomic<std::uint32_t> *word,
+        std::uint32_t expected)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, nullptr,
+            nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<std::uint32_t> *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+/**
+ * Class: FutexLock
+ * ----------------
+ * A mutex built directly on a futex word: 0 is unlocked, 1 locked, and 2
+ * locked with (possibly) sleeping waiters. Uncontended lock and unlock are
+ * one atomic instruction each, and unlock makes a system call only when
+ * someone may be asleep. A waiter spins briefly before sleeping.
+ */
+class FutexLock {
+public:
+    void lock()
+    {
+        std::uint32_t c = 0;
+        if (state_.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+            return;
+        }
+        for (int i = 0; i < 100 && state_.load(std::memory_order_relaxed);
+                i++) {
+            cpu_relax();
+        }
+        if (c != 2) {
+            c = state_.exchange(2, std::memory_order_acquire);
+        }
+        while (c != 0) {
+            futex_wait(&state_, 2);
+            c = state_.exchange(2, std::memory_order_acquire);
+        }
+    }
+
+    bool try_lock()
+    {
+        std::uint32_t c = 0;
+        return state_.compare_exchange_strong(c, 1,
+                std::memory_order_acquire);
+    }
+
+    void unlock()
+    {
+        if (state_.exchange(0, std::memory_order_release) == 2) {
+            futex_wake(&state_, 1);
+        }
+    }
+
+private:
+    std::atomic<std::uint32_t> state_ = 0;
+};
+
+/**
+ * Class: FutexCondVar
+ * -------------------
+ * A condition variable that parks waiters on a futex sequence word: a
+ * waiter samples the sequence, releases its lock and sleeps unless the
+ * sequence has moved on, and notifiers bump the sequence before waking.
+ * Notifiers skip the system call when nobody is waiting.
+ */
+class FutexCondVar {
+public:
+    template <typename Lock>
+    void wait(Lock& lock)
+    {
+        waiters_.fetch_add(1);
+        std::uint32_t seq = seq_.load();
+        lock.unlock();
+        futex_wait(&seq_, seq);
+        lock.lock();
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void notify_one() { notify(1); }
+    void notify_all() { notify(INT_MAX); }
+
+    // Wakes up to count waiters, with one system call.
+    void notify(int count)
+    {
+        seq_.fetch_add(1);
+        if (waiters_.load() > 0) {
+            futex_wake(&seq_, count);
+        }
+    }
+
+private:
+    std::atomic<std::uint32_t> seq_ = 0;
+    std::atomic<std::uint32_t> waiters_ = 0;
+};
+
+/**
+ * Class: SpinStats
+ * ----------------
+ * What AdaptiveCondVar learns from waits: a moving average of wait times
+ * and the halvings of the spin budget. A condition variable keeps its
+ * own unless it is given one to share. One made for a single wait, as
+ * Party makes one for each waiting guest, must share longer-lived stats
+ * to learn anything.
+ */
+class SpinStats {
+public:
+    std::uint64_t average_ns() const
+    {
+        return averageNs_.load(std::memory_order_relaxed);
+    }
+
+    int backoff() const { return backoff_.load(std::memory_order_relaxed); }
+
+private:
+    friend class AdaptiveCondVar;
+
+    // Starts at a couple of microseconds, so new waiters try a short spin.
+    std::atomic<std::uint64_t> averageNs_ = 1000;
+    std::atomic<int> backoff_ = 0;
+};
+
+/**
+ * Class: AdaptiveCondVar
+ * ----------------------
+ * A FutexCondVar whose waiters spin, then yield, and only then park, for
+ * waits that are usually over sooner than a round trip through the
+ * kernel. The spin budget is learned, in its SpinStats, from a moving
+ * average of recent wait times: up to twice the average, capped at
+ * max_spin_ns(), and no spinning at all once waits typically outlast the
+ * cap. Spinning backs off when it would take CPU from the threads that
+ * will do the notifying: at most one fewer thread than there are CPUs
+ * spins at a time (none on a single CPU), and a waiter preempted while
+ * spinning halves the budget until a spin succeeds again.
+ */
+class AdaptiveCondVar {
+public:
+    AdaptiveCondVar() : stats_(&ownStats_) {}
+
+    // Learns into stats, which must outlive this condition variable.
+    explicit AdaptiveCondVar(SpinStats& stats) : stats_(&stats) {}
+
+    template <typename Lock>
+    void wait(Lock& lock)
+    {
+        std::uint32_t seq = seq_.load();
+        std::uint64_t start = monotonic_ns();
+        lock.unlock();
+        if (!spin(seq, start)) {
+            for (int i = 0; i < YIELDS && seq_.load() == seq; i++) {
+                std::this_thread::yield();
+            }
+            if (seq_.load() == seq) {
+                sleepers_.fetch_add(1);
+                futex_wait(&seq_, seq);
+                sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        record(monotonic_ns() - start);
+        lock.lock();
+    }
+
+    void notify_one() { notify(1); }
+    void notify_all() { notify(INT_MAX); }
+
+    // Wakes up to count waiters, with at most one system call.
+    void notify(int count)
+    {
+        seq_.fetch_add(1);
+        if (sleepers_.load() > 0) {
+            futex_wake(&seq_, count);
+        }
+    }
+
+    // The most any waiter spins before yielding, for every
+    // AdaptiveCondVar; 0 makes them all park right away.
+    static std::uint64_t max_spin_ns() { return maxSpinNs_; }
+    static void set_max_spin_ns(std::uint64_t ns) { maxSpinNs_ = ns; }
+
+private:
+    static const int YIELDS = 2;
+
+    // Upper limit on the pause instructions between checks, which double
+    // from one so a short wait is noticed promptly.
+    static const int MAX_PAUSES = 64;
+
+    // Halvings of the spin budget after repeated preemptions.
+    static const int MAX_BACKOFF = 6;
+
+    // Spins until the sequence moves on from seq or the budget, counted
+    // from start, runs out. Returns whether the sequence moved.
+    bool spin(std::uint32_t seq, std::uint64_t start)
+    {
+        std::uint64_t limit = maxSpinNs_.load(std::memory_order_relaxed);
+        std::uint64_t average = stats_->average_ns();
+        if (average > limit) {
+            return false;
+        }
+        std::uint64_t budget = std::min(2 * average, limit)
+                >> stats_->backoff();
+        if (budget == 0) {
+            return false;
+        }
+        if (spinners_.fetch_add(1, std::memory_order_relaxed)
+                >= spin_slots()) {
+            spinners_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        long preemptions = involuntary_switches();
+        bool moved = false;
+        for (int pauses = 1; ; pauses = std::min(2 * pauses, MAX_PAUSES)) {
+            if (seq_.load(std::memory_order_acquire) != seq) {
+                moved = true;
+                break;
+            }
+            if (monotonic_ns() - start >= budget) {
+                break;
+            }
+            for (int i = 0; i < pauses; i++) {
+                cpu_relax();
+            }
+        }
+        spinners_.fetch_sub(1, std::memory_order_relaxed);
+
+        int backoff = stats_->backoff();
+        if (involuntary_switches() != preemptions) {
+            stats_->backoff_.store(std::min(backoff + 1, MAX_BACKOFF),
+                    std::memory_order_relaxed);
+        } else if (moved && backoff > 0) {
+            stats_->backoff_.store(backoff - 1, std::memory_order_relaxed);
+        }
+        return moved;
+    }
+
+    // Folds one wait time into the average. Waits much longer than the
+    // spin cap are all the same for this purpose, so they are clipped,
+    // letting the average recover quickly after one long wait. Updates
+    // from concurrent waiters may be lost, which only adds noise.
+    void record(std::uint64_t ns)
+    {
+        std::int64_t sample = std::min<std::uint64_t>(ns,
+                4 * maxSpinNs_.load(std::memory_order_relaxed));
+        std::int64_t average = stats_->average_ns();
+        stats_->averageNs_.store(average + (sample - average) / 8,
+                std::memory_order_relaxed);
+    }
+
+    static long involuntary_switches()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_THREAD, &usage);
+        return usage.ru_nivcsw;
+    }
+
+    static int spin_slots()
+    {
+        static const int slots = static_cast<int>(
+                std::thread::hardware_concurrency()) - 1;
+        return slots;
+    }
+
+    std::atomic<std::uint32_t> seq_ = 0;
+    std::atomic<std::uint32_t> sleepers_ = 0;
+
+    SpinStats *stats_;
+    SpinStats ownStats_;
+
+    inline static std::atomic<std::uint64_t> maxSpinNs_ = 50000;
+    inline static std::atomic<int> spinners_ = 0;
+};
+
+/**
+ * Class: MorphingMutex
+ * --------------------
+ * A FutexLock that MorphingCondVar can requeue waiters onto, and that
+ * holds back notifications made while it is locked until unlock(). The
+ * holder is the only thread that touches the pending list, so it needs
+ * no synchronization of its own.
+ */
+class MorphingCondVar;
+
+class MorphingMutex {
+public:
+    void lock()
+    {
+        std::uint32_t c = 0;
+        if (state_.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+            return;
+        }
+        for (int i = 0; i < 100 && state_.load(std::memory_order_relaxed);
+                i++) {
+            cpu_relax();
+        }
+        if (c != 2) {
+            c = state_.exchange(2, std::memory_order_acquire);
+        }
+        lock_contended(c);
+    }
+
+    bool try_lock()
+    {
+        std::uint32_t c = 0;
+        return state_.compare_exchange_strong(c, 1,
+                std::memory_order_acquire);
+    }
+
+    inline void unlock();
+
+private:
+    friend class MorphingCondVar;
+
+    // Condition variables with notifications deferred to unlock(); more
+    // than this many in one critical section are notified immediately.
+    static const int MAX_PENDING = 4;
+
+    // Takes the lock as a thread that may have had others queued behind
+    // it, leaving the state at 2 so unlock() wakes the next one. c is the
+    // state the caller last swapped out.
+    void lock_contended(std::uint32_t c = 2)
+    {
+        while (c != 0) {
+            futex_wait(&state_, 2);
+            c = state_.exchange(2, std::memory_order_acquire);
+        }
+    }
+
+    inline void defer(MorphingCondVar *cond, int count);
+
+    std::atomic<std::uint32_t> state_ = 0;
+    int numPending_ = 0;
+    MorphingCondVar *pending_[MAX_PENDING];
+    int pendingCount_[MAX_PENDING];
+};
+
+/**
+ * Class: MorphingCondVar
+ * ----------------------
+ * A condition variable with wait morphing: a notification does not wake
+ * its waiters, only to have them block again on the mutex the notifier
+ * still holds, but moves them with FUTEX_CMP_REQUEUE from the condition
+ * variable's futex onto the mutex's, once the notifier unlocks. Each
+ * unlock then wakes one of them, so notify_all costs one wakeup per
+ * waiter as the lock is handed along, not a stampede.
+ *
+ * Works only with std::unique_lock<MorphingMutex>, and notifiers must
+ * hold the mutex, as Station and Party always do.
+ */
+class MorphingCondVar {
+public:
+    void wait(std::unique_lock<MorphingMutex>& lock)
+    {
+        MorphingMutex& mutex = *lock.mutex();
+        mutex_ = &mutex;
+        waiters_++;
+        std::uint32_t seq = seq_.load(std::memory_order_relaxed);
+
+        // The unique_lock still claims the mutex throughout; it is only
+        // ever unlocked and relocked underneath it. unlock() also carries
+        // out this thread's own deferred notifications.
+        mutex.unlock();
+        futex_wait(&seq_, seq);
+
+        // Woken, or requeued onto the mutex and then woken by an unlock:
+        // either way others may be queued on the mutex behind us.
+        mutex.lock_contended(mutex.state_.exchange(2,
+                std::memory_order_acquire));
+        waiters_--;
+    }
+
+    void notify_one() { notify(1); }
+    void notify_all() { notify(INT_MAX); }
+
+    // Moves up to count waiters onto the mutex, in one requeue.
+    void notify(int count)
+    {
+        if (waiters_ > 0) {
+            mutex_->defer(this, count);
+        }
+    }
+
+private:
+    friend class MorphingMutex;
+
+    // Called by the mutex's holder at unlock: moves up to count waiters
+    // onto the mutex, which the caller then releases.
+    void requeue(MorphingMutex *mutex, int count)
+    {
+        std::uint32_t seq = seq_.fetch_add(1, std::memory_order_relaxed) + 1;
+        mutex->state_.store(2, std::memory_order_relaxed);
+        syscall(SYS_futex, &seq_, FUTEX_CMP_REQUEUE_PRIVATE, 0,
+                reinterpret_cast<void *>(static_cast<long>(count)),
+                &mutex->state_, seq);
+    }
+
+    std::atomic<std::uint32_t> seq_ = 0;
+
+    // Threads in wait() that have not yet relocked, and the mutex they
+    // use; only changed with that mutex held.
+    int waiters_ = 0;
+    MorphingMutex *mutex_ = nullptr;
+};
+
+inline void MorphingMutex::unlock()
+{
+    for (int i = 0; i < numPending_; i++) {
+        pending_[i]->requeue(this, pendingCount_[i]);
+    }
+    numPending_ = 0;
+    if (state_.exchange(0, std::memory_order_release) == 2) {
+        futex_wake(&state_, 1);
+    }
+}
+
+inline void MorphingMutex::defer(MorphingCondVar *cond, int count)
+{
+    for (int i = 0; i < numPending_; i++) {
+        if (pending_[i] == cond) {
+            pendingCount_[i] = count > INT_MAX - pendingCount_[i]
+                    ? INT_MAX : pendingCount_[i] + count;
+            return;
+        }
+    }
+    if (numPending_ == MAX_PENDING) {
+        cond->requeue(this, count);
+        return;
+    }
+    pending_[numPending_] = cond;
+    pendingCount_[numPending_] = count;
+    numPending_++;
+}
+
+/**
+ * Class: NullLock
+ * ---------------
+ * A lock that does nothing, for single-threaded simulation (see above).
+ */
+class NullLock {
+public:
+    void lock() {}
+    bool try_lock() { return true; }
+    void unlock() {}
+};
+
+/**
+ * What a wait policy learns across waits, for callers that make a
+ * condition variable per wait to keep it in: SpinStats for
+ * AdaptiveCondVar, and nothing for the other policies.
+ * make_wait_policy makes a condition variable that learns into stats.
+ */
+template <typename WaitPolicy>
+struct WaitStats {
+    struct type {};
+};
+
+template <>
+struct WaitStats<AdaptiveCondVar> {
+    typedef SpinStats type;
+};
+
+template <typename WaitPolicy>
+WaitPolicy make_wait_policy(typename WaitStats<WaitPolicy>::type& stats)
+{
+    if constexpr (std::is_constructible_v<WaitPolicy,
+            typename WaitStats<WaitPolicy>::type&>) {
+        return WaitPolicy(stats);
+    } else {
+        return WaitPolicy();
+    }
+}
+
+/**
+ * Wakes up to count of cond's waiters (all of them if count is at least
+ * their number): with a single notify(count) for the condition variables
+ * above, and with count calls to notify_one for any other wait policy.
+ */
+template <typename CondVar>
+void notify_some(CondVar& cond, int count)
+{
+    for (int i = 0; i < count; i++) {
+        cond.notify_one();
+    }
+}
+
+inline void notify_some(FutexCondVar& cond, int count)
+{
+    cond.notify(count);
+}
+
+inline void notify_some(AdaptiveCondVar& cond, int count)
+{
+    cond.notify(count);
+}
+
+inline void notify_some(MorphingCondVar& cond, int count)
+{
+    cond.notify(count);
+}
+
+#endif /* SYNC_POLICIES_H */
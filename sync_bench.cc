@@ -0,0 +1,378 @@
+/*
+ * Microbenchmarks for the primitives Station and Party are built on, and
+ * the alternatives to them, so that a lock or wait policy can be chosen
+ * from numbers taken on the machine at hand. Prints one JSON object per
+ * (benchmark, thread placement) with latency percentiles in nanoseconds.
+ *
+ * Usage: sync_bench [--bench=NAME] [--placement=NAME] [--samples=N]
+ *
+ * Benchmarks:
+ *   lock-std, lock-futex, lock-spin: lock then unlock with no contention
+ *          (std::mutex, FutexLock, SpinLock), on one thread; each sample
+ *          is the mean over a batch of 100.
+ *   handoff-std, handoff-futex, handoff-spin: contended handoff. One
+ *          thread holds the mutex until the other has been blocked in
+ *          lock() for 50 us, then unlocks; a sample is the time from the
+ *          unlock until the waiter holds the mutex.
+ *   cv, cv-any, cv-futex: ping-pong between two threads, each waiting
+ *          for its turn on a condition variable (std::condition_variable,
+ *          std::condition_variable_any, FutexCondVar with FutexLock).
+ *   atomic-wait: ping-pong with std::atomic::wait and notify_one.
+ *   futex:  ping-pong with raw FUTEX_WAIT and FUTEX_WAKE.
+ *   spin:   ping-pong by spinning on an atomic (yielding after 64 spins,
+ *          like SpinLock, so that it finishes on a single CPU).
+ * Ping-pong samples are round trips, that is two handoffs.
+ *
+ * Placements of the two threads (from cpu_topology in thread-utils):
+ * same-cpu; same-core, two hardware threads of one core; same-socket,
+ * different cores of one package; cross-socket; and unpinned, left to the
+ * scheduler. Placements this machine (or the process's CPU affinity)
+ * cannot provide are skipped with a note on stderr. The lock benchmarks
+ * use only the first CPU.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sync-policies.hh"
+#include "thread-utils.h"
+
+using namespace std;
+
+// Samples taken before measuring, to warm caches and wake CPUs up.
+static const int WARMUP = 100;
+
+// Two CPUs for the benchmark's threads; -1 leaves a thread unpinned.
+struct Placement {
+    string name;
+    int first;
+    int second;
+};
+
+static vector<Placement> placements()
+{
+    vector<CpuInfo> cpus = cpu_topology();
+    vector<Placement> result;
+    if (!cpus.empty()) {
+        result.push_back({"same-cpu", cpus[0].cpu, cpus[0].cpu});
+    }
+
+    // The first pair of distinct CPUs that satisfies match, if any.
+    auto add = [&](const char *name, auto match) {
+        for (size_t i = 0; i < cpus.size(); i++) {
+            for (size_t j = i + 1; j < cpus.size(); j++) {
+                const CpuInfo& a = cpus[i];
+                const CpuInfo& b = cpus[j];
+                if (a.core >= 0 && a.package >= 0 && b.core >= 0
+                        && b.package >= 0 && match(a, b)) {
+                    result.push_back({name, a.cpu, b.cpu});
+                    return;
+                }
+            }
+        }
+        cerr << "no CPUs for placement " << name << ", skipping it" << endl;
+    };
+    add("same-core", [](const CpuInfo& a, const CpuInfo& b) {
+        return a.package == b.package && a.core == b.core;
+    });
+    add("same-socket", [](const CpuInfo& a, const CpuInfo& b) {
+        return a.package == b.package && a.core != b.core;
+    });
+    add("cross-socket", [](const CpuInfo& a, const CpuInfo& b) {
+        return a.package != b.package;
+    });
+    result.push_back({"unpinned", -1, -1});
+    return result;
+}
+
+static void pin(int cpu)
+{
+    if (cpu >= 0 && !pin_thread(cpu)) {
+        cerr << "could not pin a thread to CPU " << cpu << endl;
+    }
+}
+
+// Waits until value is target, spinning briefly and then yielding.
+static void spin_until(const atomic<int>& value, int target)
+{
+    for (int spins = 0; value.load(memory_order_acquire) != target;
+            spins++) {
+        if (spins < 64) {
+            cpu_relax();
+        } else {
+            this_thread::yield();
+        }
+    }
+}
+
+static void report(const string& bench, const Placement& placement,
+        const char *unit, vector<double>& samples)
+{
+    sort(samples.begin(), samples.end());
+    auto pct = [&samples](double p) {
+        return samples[static_cast<size_t>(p / 100 * (samples.size() - 1))];
+    };
+    double total = 0;
+    for (double s : samples) {
+        total += s;
+    }
+    cout << "{\"bench\": \"sync\", \"primitive\": \"" << bench
+         << "\", \"placement\": \"" << placement.name << "\", \"cpus\": ";
+    if (placement.first < 0) {
+        cout << "null";
+    } else {
+        cout << "[" << placement.first << ", " << placement.second << "]";
+    }
+    cout << ", \"unit\": \"" << unit << "\", \"samples\": " << samples.size()
+         << ", \"ns\": {\"mean\": " << total / samples.size()
+         << ", \"p50\": " << pct(50) << ", \"p90\": " << pct(90)
+         << ", \"p99\": " << pct(99) << ", \"p99.9\": " << pct(99.9)
+         << ", \"max\": " << pct(100) << "}}" << endl;
+}
+
+template <typename Mutex>
+static vector<double> uncontended(const Placement& placement, int samples)
+{
+    const int BATCH = 100;
+    vector<double> result;
+    thread t([&] {
+        pin(placement.first);
+        Mutex mutex;
+        for (int i = 0; i < WARMUP + samples; i++) {
+            uint64_t start = monotonic_ns();
+            for (int j = 0; j < BATCH; j++) {
+                mutex.lock();
+                mutex.unlock();
+            }
+            if (i >= WARMUP) {
+                result.push_back(double(monotonic_ns() - start) / BATCH);
+            }
+        }
+    });
+    t.join();
+    return result;
+}
+
+template <typename Mutex>
+static vector<double> handoff(const Placement& placement, int samples)
+{
+    Mutex mutex;
+    // 1: the holder has the mutex; 2: the waiter is about to lock it;
+    // 0: the waiter has taken and released it.
+    atomic<int> phase = 0;
+    uint64_t released = 0;
+    vector<double> result;
+
+    thread holder([&] {
+        pin(placement.first);
+        for (int i = 0; i < WARMUP + samples; i++) {
+            mutex.lock();
+            phase.store(1, memory_order_release);
+            spin_until(phase, 2);
+            sleep_for_ns(50000);
+            released = monotonic_ns();
+            mutex.unlock();
+            spin_until(phase, 0);
+        }
+    });
+    thread waiter([&] {
+        pin(placement.second);
+        for (int i = 0; i < WARMUP + samples; i++) {
+            spin_until(phase, 1);
+            phase.store(2, memory_order_release);
+            mutex.lock();
+            uint64_t acquired = monotonic_ns();
+            if (i >= WARMUP) {
+                result.push_back(acquired - released);
+            }
+            mutex.unlock();
+            phase.store(0, memory_order_release);
+        }
+    });
+    holder.join();
+    waiter.join();
+    return result;
+}
+
+// Runs a ping-pong on a Channel, which has post(side), making it side's
+// turn and waking that side, and wait(side), which blocks until it is
+// side's turn. Side 0 times each round trip.
+template <typename Channel>
+static vector<double> ping_pong(const Placement& placement, int samples)
+{
+    Channel channel;
+    vector<double> result;
+    thread ping([&] {
+        pin(placement.first);
+        for (int i = 0; i < WARMUP + samples; i++) {
+            uint64_t start = monotonic_ns();
+            channel.post(1);
+            channel.wait(0);
+            if (i >= WARMUP) {
+                result.push_back(monotonic_ns() - start);
+            }
+        }
+    });
+    thread pong([&] {
+        pin(placement.second);
+        for (int i = 0; i < WARMUP + samples; i++) {
+            channel.wait(1);
+            channel.post(0);
+        }
+    });
+    ping.join();
+    pong.join();
+    return result;
+}
+
+template <typename Mutex, typename CondVar>
+struct CondVarChannel {
+    Mutex mutex;
+    CondVar turnChanged;
+    int turn = 0;
+
+    void post(int side)
+    {
+        lock_guard<Mutex> lock(mutex);
+        turn = side;
+        turnChanged.notify_one();
+    }
+
+    void wait(int side)
+    {
+        unique_lock<Mutex> lock(mutex);
+        while (turn != side) {
+            turnChanged.wait(lock);
+        }
+    }
+};
+
+struct AtomicWaitChannel {
+    atomic<int> turn = 0;
+
+    void post(int side)
+    {
+        turn.store(side);
+        turn.notify_one();
+    }
+
+    void wait(int side)
+    {
+        for (int t = turn.load(); t != side; t = turn.load()) {
+            turn.wait(t);
+        }
+    }
+};
+
+struct FutexChannel {
+    atomic<uint32_t> turn = 0;
+
+    void post(int side)
+    {
+        turn.store(side);
+        futex_wake(&turn, 1);
+    }
+
+    void wait(int side)
+    {
+        for (uint32_t t = turn.load(); t != uint32_t(side);
+                t = turn.load()) {
+            futex_wait(&turn, t);
+        }
+    }
+};
+
+struct SpinChannel {
+    atomic<int> turn = 0;
+
+    void post(int side) { turn.store(side, memory_order_release); }
+    void wait(int side) { spin_until(turn, side); }
+};
+
+struct Bench {
+    const char *name;
+    const char *unit;
+    vector<double> (*run)(const Placement&, int);
+    bool singleThread;
+};
+
+static const Bench BENCHES[] = {
+    {"lock-std", "lock_unlock", uncontended<mutex>, true},
+    {"lock-futex", "lock_unlock", uncontended<FutexLock>, true},
+    {"lock-spin", "lock_unlock", uncontended<SpinLock>, true},
+    {"handoff-std", "handoff", handoff<mutex>, false},
+    {"handoff-futex", "handoff", handoff<FutexLock>, false},
+    {"handoff-spin", "handoff", handoff<SpinLock>, false},
+    {"cv", "round_trip",
+            ping_pong<CondVarChannel<mutex, condition_variable>>, false},
+    {"cv-any", "round_trip",
+            ping_pong<CondVarChannel<mutex, condition_variable_any>>, false},
+    {"cv-futex", "round_trip",
+            ping_pong<CondVarChannel<FutexLock, FutexCondVar>>, false},
+    {"atomic-wait", "round_trip", ping_pong<AtomicWaitChannel>, false},
+    {"futex", "round_trip", ping_pong<FutexChannel>, false},
+    {"spin", "round_trip", ping_pong<SpinChannel>, false},
+};
+
+static bool parse(const char *arg, const char *name, string *value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+        return false;
+    }
+    *value = arg + len + 1;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    string bench;
+    string placement;
+    int samples = 10000;
+    for (int i = 1; i < argc; i++) {
+        string value;
+        if (parse(argv[i], "--bench", &bench)
+                || parse(argv[i], "--placement", &placement)) {
+            continue;
+        } else if (parse(argv[i], "--samples", &value)
+                && atoi(value.c_str()) > 0) {
+            samples = atoi(value.c_str());
+        } else {
+            cerr << "Usage: sync_bench [--bench=NAME] [--placement=NAME] "
+                    "[--samples=N]" << endl;
+            return 1;
+        }
+    }
+
+    vector<Placement> all = placements();
+    bool found = false;
+    for (const Bench& b : BENCHES) {
+        if (!bench.empty() && bench != b.name) {
+            continue;
+        }
+        for (const Placement& p : all) {
+            // One thread needs only one placement: the first CPU.
+            if ((!placement.empty() && placement != p.name)
+                    || (b.singleThread && placement.empty()
+                            && &p != &all.front())) {
+                continue;
+            }
+            vector<double> result = b.run(p, samples);
+            report(b.name, p, b.unit, result);
+            found = true;
+        }
+    }
+    if (!found) {
+        cerr << "no benchmark named '" << bench << "' with placement '"
+             << placement << "'" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,440 @@
+// This file contains the implementation of the thread-utils routines.
+
+#include "thread-utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+
+using namespace std;
+
+namespace {
+
+const uint64_t NS_PER_SEC = 1000000000;
+
+struct timespec to_timespec(uint64_t ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / NS_PER_SEC;
+    ts.tv_nsec = ns % NS_PER_SEC;
+    return ts;
+}
+
+/**
+ * Timing characteristics of this machine, measured the first time a
+ * high-resolution sleep is requested.
+ */
+struct Calibration {
+    Calibration();
+
+    // How long before the deadline the kernel sleep should end: roughly
+    // the 90th percentile of clock_nanosleep's overshoot. Updated after
+    // every kernel sleep, so it follows changes in load.
+    atomic<uint64_t> sleepSlack;
+
+    // When less than this much time remains, stop yielding and spin:
+    // a yield that lands on a busy core could overshoot the deadline.
+    uint64_t spinWindow;
+};
+
+// Bounds for sleepSlack, in ns.
+const uint64_t MIN_SLACK = 5000;
+const uint64_t MAX_SLACK = 2000000;
+
+Calibration::Calibration()
+{
+    const int SAMPLES = 16;
+    uint64_t overshoot[SAMPLES];
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t target = monotonic_ns() + 100000;
+        struct timespec ts = to_timespec(target);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr)
+                == EINTR) {}
+        overshoot[i] = monotonic_ns() - target;
+    }
+    sort(overshoot, overshoot + SAMPLES);
+    sleepSlack = clamp(overshoot[SAMPLES * 9 / 10], MIN_SLACK, MAX_SLACK);
+
+    uint64_t yield[SAMPLES];
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = monotonic_ns();
+        sched_yield();
+        yield[i] = monotonic_ns() - start;
+    }
+    sort(yield, yield + SAMPLES);
+    spinWindow = max<uint64_t>(2000, 4 * yield[SAMPLES / 2]);
+}
+
+Calibration& calibration()
+{
+    static Calibration cal;
+    return cal;
+}
+
+} // namespace
+
+void sleep_for(size_t milliseconds)
+{
+    uint64_t deadline = monotonic_ns() + milliseconds * 1000000;
+    struct timespec ts = to_timespec(deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr)
+            == EINTR) {}
+}
+
+uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+void sleep_for_ns(uint64_t nanoseconds)
+{
+    sleep_until_ns(monotonic_ns() + nanoseconds);
+}
+
+void sleep_until_ns(uint64_t deadline)
+{
+    Calibration& cal = calibration();
+    uint64_t now = monotonic_ns();
+
+    // Phase 1: sleep in the kernel until one slack before the deadline.
+    uint64_t slack = cal.sleepSlack.load(memory_order_relaxed);
+    if (now + slack + cal.spinWindow < deadline) {
+        uint64_t target = deadline - slack;
+        struct timespec ts = to_timespec(target);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr)
+                == EINTR) {}
+        now = monotonic_ns();
+
+        // Track the overshoot: jump up at once if we overslept the real
+        // deadline, otherwise drift toward 1.25x the observed overshoot.
+        uint64_t overshoot = now - target;
+        uint64_t updated = now > deadline ? overshoot
+                : (7 * slack + overshoot * 5 / 4) / 8;
+        cal.sleepSlack.store(clamp(updated, MIN_SLACK, MAX_SLACK),
+                memory_order_relaxed);
+    }
+
+    // Phase 2: give the processor away while there is time to spare.
+    while (now + cal.spinWindow < deadline) {
+        sched_yield();
+        now = monotonic_ns();
+    }
+
+    // Phase 3: spin out the last couple of microseconds.
+    while (now < deadline) {
+        cpu_relax();
+        now = monotonic_ns();
+    }
+}
+
+namespace {
+
+// Reads one id from cpu's sysfs topology directory; -1 if missing.
+int topology_id(int cpu, const char *name)
+{
+    ifstream in("/sys/devices/system/cpu/cpu" + to_string(cpu)
+            + "/topology/" + name);
+    int id = -1;
+    in >> id;
+    return in ? id : -1;
+}
+
+// The NUMA node cpu belongs to, from the nodeN link in its directory.
+int node_id(int cpu)
+{
+    string path = "/sys/devices/system/cpu/cpu" + to_string(cpu);
+    DIR *dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return -1;
+    }
+    int node = -1;
+    while (struct dirent *entry = readdir(dir)) {
+        if (strncmp(entry->d_name, "node", 4) == 0
+                && isdigit(entry->d_name[4])) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// The id of the highest-level cache cpu uses, which is its last-level
+// cache.
+int llc_id(int cpu)
+{
+    int level = 0;
+    int id = -1;
+    for (int index = 0;; index++) {
+        string path = "/sys/devices/system/cpu/cpu" + to_string(cpu)
+                + "/cache/index" + to_string(index) + "/";
+        ifstream levelFile(path + "level");
+        int l;
+        if (!(levelFile >> l)) {
+            return id;
+        }
+        ifstream idFile(path + "id");
+        int i;
+        if (l > level && idFile >> i) {
+            level = l;
+            id = i;
+        }
+    }
+}
+
+} // namespace
+
+vector<CpuInfo> cpu_topology()
+{
+    vector<CpuInfo> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return cpus;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus.push_back({cpu, topology_id(cpu, "core_id"),
+                    topology_id(cpu, "physical_package_id"), node_id(cpu),
+                    llc_id(cpu)});
+        }
+    }
+    return cpus;
+}
+
+int current_cpu()
+{
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu;
+}
+
+bool pin_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+namespace {
+
+// The pool and worker (a ThreadPool::Worker) the calling thread is, if
+// it is a pool worker.
+thread_local ThreadPool *currentPool = nullptr;
+thread_local void *currentWorker = nullptr;
+
+} // namespace
+
+ThreadPool::ThreadPool(size_t numThreads, size_t maxThreads)
+    : target_(numThreads ? numThreads
+            : max<size_t>(1, thread::hardware_concurrency()))
+    , maxThreads_(max(maxThreads, target_))
+    , workers_(new unique_ptr<Worker>[maxThreads_])
+    , numWorkers_(0)
+    , queued_(0)
+    , outstanding_(0)
+    , running_(0)
+    , parked_(0)
+    , wakeups_(0)
+    , shutdown_(false)
+{
+    lock_guard<mutex> lock(mutex_);
+    for (size_t i = 0; i < target_; i++) {
+        start_worker();
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    wait_idle();
+    {
+        lock_guard<mutex> lock(mutex_);
+        shutdown_ = true;
+        wakeup_.notify_all();
+    }
+    size_t n = numWorkers_.load();
+    for (size_t i = 0; i < n; i++) {
+        workers_[i]->thread.join();
+    }
+}
+
+// Must be called with mutex_ held.
+void ThreadPool::start_worker()
+{
+    size_t index = numWorkers_.load(memory_order_relaxed);
+    workers_[index] = make_unique<Worker>();
+    Worker *worker = workers_[index].get();
+    running_++;
+    worker->thread = thread([this, worker] { worker_main(worker); });
+
+    // Publish the slot to thieves only once it is fully constructed.
+    numWorkers_.store(index + 1, memory_order_release);
+}
+
+void ThreadPool::post(function<void()> task)
+{
+    // Count the task before queueing it so queued_ never underflows.
+    // This pairs with park(): a worker parks only after it has left
+    // running_ and then seen queued_ == 0, so one side sees the other.
+    outstanding_++;
+    queued_++;
+    if (currentPool == this) {
+        Worker *self = static_cast<Worker *>(currentWorker);
+        lock_guard<mutex> lock(self->mutex);
+        self->tasks.push_back(move(task));
+    } else {
+        lock_guard<mutex> lock(sharedMutex_);
+        sharedTasks_.push_back(move(task));
+    }
+    if (running_.load() < target_) {
+        wake_or_start_worker();
+    }
+}
+
+void ThreadPool::wake_or_start_worker()
+{
+    lock_guard<mutex> lock(mutex_);
+    if (shutdown_ || running_.load() >= target_) {
+        return;
+    }
+    if (parked_ > wakeups_) {
+        wakeups_++;
+        running_++;
+        wakeup_.notify_one();
+    } else if (numWorkers_.load() < maxThreads_) {
+        start_worker();
+    }
+}
+
+bool ThreadPool::find_task(Worker *self, function<void()> *task)
+{
+    // Own deque first, newest task first (it is likely still in cache).
+    {
+        lock_guard<mutex> lock(self->mutex);
+        if (!self->tasks.empty()) {
+            *task = move(self->tasks.back());
+            self->tasks.pop_back();
+            queued_--;
+            return true;
+        }
+    }
+    {
+        lock_guard<mutex> lock(sharedMutex_);
+        if (!sharedTasks_.empty()) {
+            *task = move(sharedTasks_.front());
+            sharedTasks_.pop_front();
+            queued_--;
+            return true;
+        }
+    }
+
+    // Steal the oldest task from another worker, starting at a different
+    // victim each time so thieves spread out.
+    thread_local size_t nextVictim = 0;
+    size_t n = numWorkers_.load(memory_order_acquire);
+    for (size_t i = 0; i < n; i++) {
+        Worker *victim = workers_[(nextVictim + i) % n].get();
+        if (victim == self) {
+            continue;
+        }
+        unique_lock<mutex> lock(victim->mutex, try_to_lock);
+        if (lock.owns_lock() && !victim->tasks.empty()) {
+            *task = move(victim->tasks.front());
+            victim->tasks.pop_front();
+            queued_--;
+            nextVictim = (nextVictim + i + 1) % n;
+            return true;
+        }
+    }
+    nextVictim++;
+    return false;
+}
+
+// Takes the calling worker out of running_ until there is work for it
+// (returns true, counted in running_ again) or the pool shuts down
+// (returns false).
+bool ThreadPool::park()
+{
+    unique_lock<mutex> lock(mutex_);
+    running_--;
+    while (true) {
+        if (wakeups_ > 0) {
+            wakeups_--;
+            return true;
+        }
+        if (shutdown_) {
+            return false;
+        }
+        if (queued_.load() > 0 && running_.load() < target_) {
+            running_++;
+            return true;
+        }
+        parked_++;
+        wakeup_.wait(lock);
+        parked_--;
+    }
+}
+
+void ThreadPool::worker_main(Worker *self)
+{
+    currentPool = this;
+    currentWorker = self;
+    function<void()> task;
+    while (true) {
+        if (find_task(self, &task)) {
+            task();
+            task = nullptr;
+            if (outstanding_.fetch_sub(1) == 1) {
+                lock_guard<mutex> lock(mutex_);
+                idle_.notify_all();
+            }
+
+            // Step aside if workers that were in blocking() have come
+            // back and there are now more running than target_.
+            if (running_.load() <= target_) {
+                continue;
+            }
+        } else if (queued_.load() > 0) {
+            // A task is being posted, or a deque was busy while we
+            // tried to steal from it.
+            continue;
+        }
+        if (!park()) {
+            return;
+        }
+    }
+}
+
+bool ThreadPool::begin_blocking()
+{
+    if (currentPool != this) {
+        return false;
+    }
+    running_--;
+    if (queued_.load() > 0) {
+        wake_or_start_worker();
+    }
+    return true;
+}
+
+void ThreadPool::end_blocking()
+{
+    running_++;
+}
+
+void ThreadPool::wait_idle()
+{
+    unique_lock<mutex> lock(mutex_);
+    while (outstanding_.load() > 0) {
+        idle_.wait(lock);
+    }
+}
@@ -6,7 +6,18 @@
 #ifndef _thread_utils_
 #define _thread_utils_
 
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 /**
  * Function: sleep_for
@@ -17,4 +28,235 @@
  */
 void sleep_for(std::size_t milliseconds);
 
+/**
+ * Function: monotonic_ns
+ * Usage: std::uint64_t start = monotonic_ns();
+ * --------------------------------------------
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+std::uint64_t monotonic_ns();
+
+/**
+ * Function: sleep_for_ns, sleep_until_ns
+ * Usage: sleep_for_ns(250000);
+ *        sleep_until_ns(monotonic_ns() + 250000);
+ * -----------------------------------------------
+ * Sleeps until the given duration has elapsed (or the given monotonic_ns
+ * deadline has passed), waking within a few microseconds of it. Most of
+ * the wait is spent in clock_nanosleep; the last stretch, whose length
+ * is the timer slack measured the first time these functions are used
+ * and then tracked as sleeps complete, is covered by yielding and finally
+ * by a short spin. Requests shorter than the timer slack never enter the
+ * kernel.
+ */
+void sleep_for_ns(std::uint64_t nanoseconds);
+void sleep_until_ns(std::uint64_t deadline);
+
+/**
+ * Struct: CpuInfo
+ * Function: cpu_topology
+ * Usage: for (const CpuInfo& c : cpu_topology()) ...
+ * --------------------------------------------------
+ * Returns the CPUs the calling thread may run on, in increasing order,
+ * each with the ids of its core, its package (socket), its NUMA node and
+ * its last-level cache as the kernel reports them under
+ * /sys/devices/system/cpu; an id the kernel does not report is -1. Two
+ * CPUs with the same package and core are hardware threads of one core.
+ */
+struct CpuInfo {
+    int cpu;
+    int core;
+    int package;
+    int node;
+    int llc;
+};
+
+std::vector<CpuInfo> cpu_topology();
+
+/**
+ * Function: current_cpu
+ * Usage: int cpu = current_cpu();
+ * -------------------------------
+ * Returns the CPU the calling thread is running on, or 0 if unknown. The
+ * thread may have moved by the time the caller looks at the result.
+ */
+int current_cpu();
+
+/**
+ * Function: pin_thread
+ * Usage: if (!pin_thread(3)) ...
+ * ------------------------------
+ * Restricts the calling thread to the given CPU. Returns false, leaving
+ * the thread's affinity unchanged, if that is not allowed.
+ */
+bool pin_thread(int cpu);
+
+/**
+ * Function: cpu_relax
+ * Usage: while (!flag.load()) cpu_relax();
+ * ----------------------------------------
+ * Tells the processor that the caller is in a spin-wait loop.
+ */
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/**
+ * Class: SpinLock
+ * ---------------
+ * A test-and-test-and-set lock for very short critical sections. After a
+ * brief spin it yields the processor, so a waiter whose holder has been
+ * preempted does not burn a whole time slice. Meets the Lockable
+ * requirements, so it works with std::lock_guard and std::unique_lock.
+ */
+class SpinLock {
+public:
+    void lock()
+    {
+        for (int spins = 0; !try_lock(); spins++) {
+            while (locked_.load(std::memory_order_relaxed)) {
+                if (spins++ < 64) {
+                    cpu_relax();
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    bool try_lock()
+    {
+        return !locked_.load(std::memory_order_relaxed)
+                && !locked_.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() { locked_.store(false, std::memory_order_release); }
+
+private:
+    std::atomic<bool> locked_ = false;
+};
+
+/**
+ * Class: ThreadPool
+ * -----------------
+ * A fixed set of worker threads that run submitted tasks. Each worker
+ * has its own deque: tasks posted from a worker go on the back of that
+ * worker's deque and it takes work from the back (newest first), while
+ * idle workers steal from the front of other deques (oldest first).
+ * Tasks posted from outside the pool go to a shared queue.
+ *
+ * Station and Party clients block for long periods, which would tie up
+ * a worker apiece. A task wraps such calls in blocking(), e.g.
+ *
+ *     pool.post([&] {
+ *         pool.blocking([&] { station.wait_for_train(); });
+ *         station.boarded();
+ *     });
+ *
+ * While a worker is inside blocking(), the pool wakes a parked worker,
+ * or starts a new one (up to maxThreads), so that numThreads workers
+ * keep running tasks. Workers are reused, so a scenario costs at most
+ * as many threads as it has clients blocked at once, rather than one
+ * thread per client.
+ */
+class ThreadPool {
+public:
+    // numThreads = 0 means one per hardware thread; maxThreads (at least
+    // numThreads) bounds the workers started to cover blocking() calls.
+    explicit ThreadPool(std::size_t numThreads = 0,
+            std::size_t maxThreads = 256);
+
+    // Waits for all tasks to finish, then stops the workers.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Schedules task to run on some worker.
+    void post(std::function<void()> task);
+
+    // Schedules fn to run on some worker; the future yields its result
+    // (or exception).
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F&& fn)
+    {
+        typedef std::invoke_result_t<F> R;
+        auto task = std::make_shared<std::packaged_task<R()>>(
+                std::forward<F>(fn));
+        std::future<R> result = task->get_future();
+        post([task] { (*task)(); });
+        return result;
+    }
+
+    // Runs fn on the calling thread; if that is one of this pool's
+    // workers, another worker is made available while fn runs.
+    template <typename F>
+    std::invoke_result_t<F> blocking(F&& fn)
+    {
+        struct Guard {
+            ThreadPool *pool;
+            bool active;
+            ~Guard() { if (active) pool->end_blocking(); }
+        } guard = {this, begin_blocking()};
+        return std::forward<F>(fn)();
+    }
+
+    // Waits until every task posted so far (and every task those tasks
+    // post) has finished.
+    void wait_idle();
+
+    // Number of worker threads started so far.
+    std::size_t num_workers() const { return numWorkers_.load(); }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+    };
+
+    void start_worker();
+    void worker_main(Worker *self);
+    bool find_task(Worker *self, std::function<void()> *task);
+    bool park();
+    void wake_or_start_worker();
+    bool begin_blocking();
+    void end_blocking();
+
+    const std::size_t target_;
+    const std::size_t maxThreads_;
+
+    // Workers, in order of creation; slots [0, numWorkers_) are valid.
+    std::unique_ptr<std::unique_ptr<Worker>[]> workers_;
+    std::atomic<std::size_t> numWorkers_;
+
+    // Tasks posted from outside the pool.
+    std::mutex sharedMutex_;
+    std::deque<std::function<void()>> sharedTasks_;
+
+    // Tasks queued in any deque, and tasks posted but not yet finished.
+    std::atomic<std::size_t> queued_;
+    std::atomic<std::size_t> outstanding_;
+
+    // Workers neither parked nor inside blocking(). Workers park when
+    // they find no work or when more than target_ are running.
+    std::atomic<std::size_t> running_;
+
+    // Protects parking and the fields below.
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable idle_;
+    std::size_t parked_;
+
+    // Wakeups granted to parked workers but not yet taken; the waker
+    // has already counted the woken worker in running_.
+    std::size_t wakeups_;
+    bool shutdown_;
+};
+
 #endif
@@ -0,0 +1,164 @@
+/*
+ * Decoder for the binary event traces written by event-trace.cc. Reads
+ * any number of per-thread trace files, merges their records into one
+ * stream ordered by timestamp, and prints it either as text (one event per
+ * line, times relative to the first event) or as Chrome trace JSON, which
+ * can be loaded into chrome://tracing or Perfetto.
+ *
+ * Usage: trace_decode [--chrome] FILE...
+ */
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "event-trace.hh"
+
+using namespace std;
+
+// The records of one file, oldest first.
+struct ThreadRecords {
+    string path;
+    vector<TraceRecord> records;
+    size_t next = 0;
+};
+
+static bool load(const string& path, ThreadRecords *out)
+{
+    ifstream in(path, ios::binary);
+    TraceFileHeader header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        cerr << path << ": too short for a trace header" << endl;
+        return false;
+    }
+    if (memcmp(header.magic, "EVTRACE1", 8) != 0 || header.version != 1
+            || header.recordSize != sizeof(TraceRecord)) {
+        cerr << path << ": not a version 1 event trace" << endl;
+        return false;
+    }
+    vector<TraceRecord> ring(header.capacity);
+    if (!in.read(reinterpret_cast<char *>(ring.data()),
+            ring.size() * sizeof(TraceRecord))) {
+        cerr << path << ": truncated trace file" << endl;
+        return false;
+    }
+
+    // If the ring wrapped, the oldest surviving record follows the newest.
+    uint64_t count = min(header.written, header.capacity);
+    uint64_t first = header.written - count;
+    out->path = path;
+    for (uint64_t i = first; i < header.written; i++) {
+        out->records.push_back(ring[i % header.capacity]);
+    }
+    if (header.written > header.capacity) {
+        cerr << path << ": ring wrapped, " << first
+             << " oldest records lost" << endl;
+    }
+    return true;
+}
+
+static const char *event_name(uint16_t event)
+{
+    switch (event) {
+    case TRACE_TRAIN_ARRIVE: return "train_arrive";
+    case TRACE_TRAIN_DEPART: return "train_depart";
+    case TRACE_PASSENGER_ARRIVE: return "passenger_arrive";
+    case TRACE_PASSENGER_WAKE: return "passenger_wake";
+    case TRACE_PASSENGER_BOARD: return "passenger_board";
+    case TRACE_GUEST_ARRIVE: return "guest_arrive";
+    case TRACE_GUEST_MATCH: return "guest_match";
+    case TRACE_GUEST_DEPART: return "guest_depart";
+    case TRACE_SEATS_ADD: return "seats_add";
+    default: return "unknown";
+    }
+}
+
+/**
+ * Prints one record as a Chrome trace event. Calls that block are shown
+ * as duration slices (begin at the call, end when it returns); the other
+ * events are instants.
+ */
+static void print_chrome(const TraceRecord& r, uint64_t base, bool first)
+{
+    const char *name = event_name(r.event);
+    const char *phase = "i";
+    switch (r.event) {
+    case TRACE_TRAIN_ARRIVE: name = "load_train"; phase = "B"; break;
+    case TRACE_TRAIN_DEPART: name = "load_train"; phase = "E"; break;
+    case TRACE_PASSENGER_ARRIVE: name = "wait_for_train"; phase = "B"; break;
+    case TRACE_PASSENGER_WAKE: name = "wait_for_train"; phase = "E"; break;
+    case TRACE_GUEST_ARRIVE: name = "meet"; phase = "B"; break;
+    case TRACE_GUEST_DEPART: name = "meet"; phase = "E"; break;
+    }
+    cout << (first ? "" : ",\n") << "{\"name\": \"" << name
+         << "\", \"ph\": \"" << phase << "\""
+         << ", \"ts\": " << (r.timestamp - base) / 1000.0
+         << ", \"pid\": 1, \"tid\": " << r.tid;
+    if (phase[0] == 'i') {
+        cout << ", \"s\": \"t\"";
+    }
+    cout << ", \"args\": {\"object\": \"0x" << hex << r.object << dec
+         << "\", \"arg\": " << r.arg << "}}";
+}
+
+int main(int argc, char *argv[])
+{
+    bool chrome = false;
+    vector<ThreadRecords> threads;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--chrome") == 0) {
+            chrome = true;
+            continue;
+        }
+        threads.emplace_back();
+        if (!load(argv[i], &threads.back())) {
+            return 1;
+        }
+    }
+    if (threads.empty()) {
+        cerr << "Usage: trace_decode [--chrome] FILE..." << endl;
+        return 1;
+    }
+
+    // k-way merge: each file is already in time order.
+    auto later = [&threads](size_t a, size_t b) {
+        return threads[a].records[threads[a].next].timestamp
+                > threads[b].records[threads[b].next].timestamp;
+    };
+    priority_queue<size_t, vector<size_t>, decltype(later)> heads(later);
+    uint64_t base = UINT64_MAX;
+    for (size_t i = 0; i < threads.size(); i++) {
+        if (!threads[i].records.empty()) {
+            heads.push(i);
+            base = min(base, threads[i].records[0].timestamp);
+        }
+    }
+
+    if (chrome) {
+        cout << "{\"traceEvents\": [\n";
+    }
+    bool first = true;
+    while (!heads.empty()) {
+        size_t i = heads.top();
+        heads.pop();
+        const TraceRecord& r = threads[i].records[threads[i].next++];
+        if (chrome) {
+            print_chrome(r, base, first);
+        } else {
+            cout << r.timestamp - base << "\t" << r.tid << "\t"
+                 << event_name(r.event) << "\t0x" << hex << r.object << dec
+                 << "\t" << r.arg << "\n";
+        }
+        first = false;
+        if (threads[i].next < threads[i].records.size()) {
+            heads.push(i);
+        }
+    }
+    if (chrome) {
+        cout << "\n], \"displayTimeUnit\": \"ns\"}" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,10 @@
+// This file defines the constants shared by Party and the code built
+// around it, such as its metrics layer.
+
+#ifndef ZODIAC_H
+#define ZODIAC_H
+
+// The total number of Zodiac signs
+static const int NUM_SIGNS = 12;
+
+#endif /* ZODIAC_H */